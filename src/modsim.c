@@ -0,0 +1,410 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : modsim
+  Used by   :
+  Purpose   : Program to simulate a Modbus TCP meter serving the default
+              register map of the modbus module as holding registers, e.g. to
+              test and benchmark the driver without access to real devices.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#include "pylon/io.h"
+#include "pylon/modbus.h"
+#include "pylon/timer.h"
+#include "pylon/args.h"
+#include "pylon/common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Number of holding registers served
+#define NUM_REGISTERS 512
+
+// Function code to read holding registers and exception codes
+#define READ_HOLDING_REGISTERS 0x03
+#define ILLEGAL_FUNCTION       0x01
+#define ILLEGAL_DATA_ADDRESS   0x02
+
+// Maximum size of the buffered requests and responses of a connection
+#define MAX_REQUEST_SIZE  1024
+#define MAX_RESPONSE_SIZE 16384
+
+// Maximum time in milliseconds to wait for sockets without pending work
+#define IDLE_TIMEOUT 1000
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Context of a client connection
+typedef struct Connection_s {
+	int sfd;                           // Socket of the connection
+	size_t received;                   // Number of bytes in the request buffer
+	unsigned char request[MAX_REQUEST_SIZE];
+	size_t length;                     // Number of bytes in the response buffer
+	unsigned char response[MAX_RESPONSE_SIZE];
+	uint64_t sendTime;                 // Time in milliseconds to send the responses
+} Connection;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Supported program arguments
+static Argument args[] = {
+	{"port",     "-p", "1502", ARG_INT  | OPTIONAL, "Port to listen at"},
+	{"unit",     "-u", "1",    ARG_INT  | OPTIONAL, "Unit identifier to answer to, 0 for any"},
+	{"latency",  "-l", "0",    ARG_INT  | OPTIONAL, "Delay of the responses in milliseconds"},
+	{"help",     "-h", NULL,   ARG_FLAG | OPTIONAL, "Display program usage and help"},
+	{"verbose",  "-v", "1",    ARG_INT  | OPTIONAL, "Verbose level"},
+	{0} // End of list
+};
+
+// Client connections indexed by socket descriptor
+static Connection* m_connections[FD_SETSIZE];
+
+// Socket to accept connections
+static int m_listener = INVALID_SOCKET;
+
+// Variables to hold program arguments
+static int m_unit;
+static int m_latency;
+
+// The holding registers
+static uint16_t m_registers[NUM_REGISTERS];
+
+// Number of requests answered
+static unsigned long m_requests;
+
+// Flag to terminate the simulation
+static volatile sig_atomic_t m_running = 1;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Signal handler to terminate the simulation
+static void handleSignal(int sig);
+
+// Accepts pending connections at the listening socket
+static void handleAccept(int sfd, int events, void* arg);
+
+// Handles events of a client connection
+static void handleConnection(int sfd, int events, void* arg);
+
+// Appends the response to the request at the beginning of the buffer and
+// returns the length of the request, or 0 if incomplete
+static size_t handleRequest(Connection* c);
+
+// Sends the buffered responses that are due and returns the next due time
+static uint64_t processConnections(uint64_t now);
+
+// Closes the specified connection
+static void closeConnection(Connection* c);
+
+// Updates the registers with the values at the specified time
+static void simulateValues(double t);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+	// Input program arguments
+	if (!args_parse(args, argc, argv) || args_value(args, "help")) {
+		args_printUsage(args, argv[0]);
+		args_printInfo(args);
+		return 0;
+	}
+
+	// Set log level
+	log_level = atoi(args_value(args, "verbose"));
+
+	// Initialize static variables
+	m_unit    = atoi(args_value(args, "unit"));
+	m_latency = atoi(args_value(args, "latency"));
+
+	// Initialize I/O subsystem
+	io_init();
+
+	// Wait for connections
+	m_listener = io_createServerSocket(atoi(args_value(args, "port")));
+	if (m_listener == INVALID_SOCKET ||
+		!io_multiplex(m_listener, "listener", IO_READ, handleAccept, NULL))
+	{
+		printf("Failed to listen at port %s\n", args_value(args, "port"));
+		return 1;
+	}
+
+	signal(SIGINT, handleSignal);
+	signal(SIGTERM, handleSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	LOG(1, "Simulating Modbus meter at port %s\n", args_value(args, "port"));
+
+	// Run the simulation
+	while (m_running) {
+		uint64_t now = timer_now();
+		uint64_t deadline = processConnections(now);
+		now = timer_now();
+		io_processTimeout(deadline > now ? (int)(deadline - now) : 0);
+	}
+
+	LOG(1, "requests: %lu\n", m_requests);
+
+	// Cleanup
+	for (int i = 0; i < FD_SETSIZE; i++) {
+		if (m_connections[i]) {
+			closeConnection(m_connections[i]);
+		}
+	}
+	io_closeSocket(&m_listener);
+	io_deinit();
+
+	return 0;
+}
+
+void handleSignal(int sig)
+{
+	m_running = 0;
+}
+
+void handleAccept(int sfd, int events, void* arg)
+{
+	// Accept all pending connections
+	while (1) {
+		int cfd = accept4(sfd, NULL, NULL, SOCK_NONBLOCK);
+		if (cfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LOG(1, "Failed to accept connection: %s\n", strerror(errno));
+			}
+			return;
+		}
+		if (cfd >= FD_SETSIZE) {
+			close(cfd);
+			continue;
+		}
+
+		// Create context
+		Connection* c = calloc(1, sizeof(Connection));
+		if (!c) {
+			LOG(0, "Failed to allocate connection\n");
+			close(cfd);
+			continue;
+		}
+		c->sfd = cfd;
+		m_connections[cfd] = c;
+
+		if (!io_multiplex(cfd, "client", IO_READ, handleConnection, c)) {
+			closeConnection(c);
+		}
+	}
+}
+
+void handleConnection(int sfd, int events, void* arg)
+{
+	Connection* c = (Connection*)arg;
+
+	// Receive available data
+	ssize_t size = recv(sfd, c->request + c->received, sizeof(c->request) - c->received, 0);
+	if (size == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			closeConnection(c);
+		}
+		return;
+	}
+	if (size == 0) {
+		closeConnection(c);
+		return;
+	}
+	c->received += size;
+
+	// Answer all complete requests, they may be pipelined
+	simulateValues(timer_now() / 1000.0);
+	size_t length;
+	while ((length = handleRequest(c)) > 0) {
+		memmove(c->request, c->request + length, c->received - length);
+		c->received -= length;
+	}
+	if (c->received == sizeof(c->request)) {
+		LOG(1, "Invalid request\n");
+		closeConnection(c);
+	}
+}
+
+size_t handleRequest(Connection* c)
+{
+	// Wait for the MBAP header and the rest of the request
+	const unsigned char* req = c->request;
+	if (c->received < 8) {
+		return 0;
+	}
+	size_t length = 6 + ((req[4] << 8) | req[5]);
+	if (c->received < length) {
+		return 0;
+	}
+	if (m_unit && req[6] != m_unit) {
+		return length; // Not addressed to us
+	}
+
+	// Process the request
+	unsigned char pdu[2 + 2 * NUM_REGISTERS];
+	size_t pduLength;
+	uint16_t address = length >= 12 ? (req[8] << 8) | req[9] : 0;
+	uint16_t count   = length >= 12 ? (req[10] << 8) | req[11] : 0;
+	if (req[7] != READ_HOLDING_REGISTERS || length < 12) {
+		pdu[0] = req[7] | 0x80;
+		pdu[1] = ILLEGAL_FUNCTION;
+		pduLength = 2;
+	} else if (count == 0 || count > 125 || address + count > NUM_REGISTERS) {
+		pdu[0] = req[7] | 0x80;
+		pdu[1] = ILLEGAL_DATA_ADDRESS;
+		pduLength = 2;
+	} else {
+		pdu[0] = READ_HOLDING_REGISTERS;
+		pdu[1] = 2 * count;
+		for (int i = 0; i < count; i++) {
+			pdu[2 + 2 * i] = m_registers[address + i] >> 8;
+			pdu[3 + 2 * i] = m_registers[address + i] & 0xff;
+		}
+		pduLength = 2 + 2 * count;
+	}
+
+	// Append the response with the transaction of the request
+	if (c->length + 7 + pduLength > sizeof(c->response)) {
+		LOG(1, "Too many pending responses\n");
+		return length;
+	}
+	unsigned char* res = c->response + c->length;
+	memcpy(res, req, 4);
+	res[4] = (pduLength + 1) >> 8;
+	res[5] = (pduLength + 1) & 0xff;
+	res[6] = req[6];
+	memcpy(res + 7, pdu, pduLength);
+	if (c->length == 0) {
+		c->sendTime = timer_now() + m_latency;
+	}
+	c->length += 7 + pduLength;
+	m_requests++;
+
+	return length;
+}
+
+uint64_t processConnections(uint64_t now)
+{
+	uint64_t next = now + IDLE_TIMEOUT;
+	for (int i = 0; i < FD_SETSIZE; i++) {
+		Connection* c = m_connections[i];
+		if (!c || c->length == 0) {
+			continue;
+		}
+		if (c->sendTime > now) {
+			if (c->sendTime < next) {
+				next = c->sendTime;
+			}
+			continue;
+		}
+
+		// The responses are small, a connection that cannot take them is dropped
+		ssize_t size = send(c->sfd, c->response, c->length, MSG_NOSIGNAL);
+		if (size != (ssize_t)c->length) {
+			LOG(1, "Failed to send responses\n");
+			closeConnection(c);
+			continue;
+		}
+		c->length = 0;
+	}
+	return next;
+}
+
+void closeConnection(Connection* c)
+{
+	m_connections[c->sfd] = NULL;
+	io_closeSocket(&c->sfd);
+	free(c);
+}
+
+void simulateValues(double t)
+{
+	// Slowly varying load around 1 kW, distributed unevenly over the phases
+	static const double share[3] = {0.5, 0.3, 0.2};
+	double load = 1000 + 600 * sin(2 * M_PI * t / 600);
+
+	double val[NUM_VARIABLES] = {0};
+	double re = 0, im = 0;
+	for (int i = 0; i < 3; i++) {
+		double voltage = 230 + 2 * sin(2 * M_PI * t / 60 + i);
+		double current = load * share[i] / voltage;
+		val[VOLTAGE_L1 + i] = voltage;
+		val[CURRENT_L1 + i] = current;
+		val[POWER_L1 + i]   = load * share[i];
+		val[PHASE_ANGLE_CURRENT_VOLTAGE_L1 + i] = 5 + i;
+
+		// The neutral carries the sum of the phase currents
+		re += current * cos(2 * M_PI * i / 3);
+		im += current * sin(2 * M_PI * i / 3);
+	}
+	val[POWER_ALL_PHASES] = load;
+	val[CURRENT_NEUTRAL]  = sqrt(re * re + im * im);
+
+	// Store the values according to the default register map
+	int count = 0;
+	const Modbus_Register* map = modbus_getDefaultRegisters(&count);
+	for (int i = 0; i < count; i++) {
+		float f = val[map[i].id] / map[i].scale;
+		uint32_t raw;
+		memcpy(&raw, &f, sizeof(raw));
+		m_registers[map[i].address]     = raw >> 16;
+		m_registers[map[i].address + 1] = raw & 0xffff;
+	}
+}
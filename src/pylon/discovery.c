@@ -0,0 +1,342 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : discovery
+  Used by   : smartmeter
+  Purpose   : Listens for the BRE multicasts performed by Smart Meters in order
+              to detect their network addresses, without blocking the io loop.
+              Optionally keeps track of all Smart Meters heard.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "discovery.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <ifaddrs.h>
+
+#include "io.h"
+#include "timer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Multicast group and port of the BRE multicasts
+#define BRE_GROUP "232.0.100.0"
+#define BRE_PORT  7259
+
+// Number of buckets of the table of Smart Meters (power of two)
+#define TABLE_BITS 10
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Entry of the table of Smart Meters heard
+typedef struct Entry_s {
+	IP_Address addr;             // Address of the Smart Meter
+	uint64_t lastSeen;           // Time in milliseconds it was last heard
+	void* context;               // Context returned by the client
+	struct Entry_s* next;        // Next entry in the same bucket
+} Entry;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Socket receiving the multicasts
+static int m_socket = INVALID_SOCKET;
+
+// Callback to notify client module about Smart Meters
+static discovery_cb m_callback;
+
+// Table of the Smart Meters heard, chained by bucket
+static Entry* m_table[TABLE_SIZE];
+
+// Number of Smart Meters in the table
+static int m_count;
+
+// Callbacks and timeout to track the Smart Meters
+static discovery_appear_cb m_appear;
+static discovery_vanish_cb m_vanish;
+static int m_timeout;
+
+// Time the table needs to be scanned for vanished Smart Meters next
+static uint64_t m_nextExpiry;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Creates the non-blocking socket to receive the multicasts
+static int createSocket(void);
+
+// Joins the multicast group on every network interface and returns the
+// number of interfaces joined
+static int joinGroup(int sfd);
+
+// Callback function invoked by the io module upon batches of multicasts
+static void handleMulticasts(int sfd, const IO_Datagram* datagrams, int count);
+
+// Callback function keeping track of the Smart Meters heard
+static void trackMeter(IP_Address addr);
+
+// Returns the bucket of the specified address in the table
+static Entry** lookupBucket(IP_Address addr);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int discovery_start(discovery_cb callback)
+{
+	if (m_socket != INVALID_SOCKET) {
+		LOG(1, "Discovery already started\n");
+		return 0;
+	}
+
+	m_socket = createSocket();
+	if (m_socket == INVALID_SOCKET) {
+		return 0;
+	}
+
+	// Receive multicasts on the io loop
+	m_callback = callback;
+	if (!io_multiplexBatch(m_socket, "discovery", 0, handleMulticasts)) {
+		io_closeSocket(&m_socket);
+		return 0;
+	}
+
+	return 1; // Success
+}
+
+int discovery_track(discovery_appear_cb appear, discovery_vanish_cb vanish, int timeout)
+{
+	m_appear  = appear;
+	m_vanish  = vanish;
+	m_timeout = timeout;
+	return discovery_start(trackMeter);
+}
+
+uint64_t discovery_expire(uint64_t now)
+{
+	if (now < m_nextExpiry) {
+		return m_nextExpiry;
+	}
+	uint64_t next = now + m_timeout;
+
+	// Scan the whole table, it is small compared to the timeout
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		Entry** it = &m_table[i];
+		while (*it) {
+			Entry* entry = *it;
+			uint64_t deadline = entry->lastSeen + m_timeout;
+			if (deadline > now) {
+				if (deadline < next) {
+					next = deadline;
+				}
+				it = &entry->next;
+				continue;
+			}
+
+			// Remove the Smart Meter
+			*it = entry->next;
+			m_count--;
+			LOG(2, "Smart Meter at %s vanished (%d left)\n", inet_ntoa(entry->addr), m_count);
+			if (entry->context && m_vanish) {
+				m_vanish(entry->addr, entry->context);
+			}
+			free(entry);
+		}
+	}
+
+	m_nextExpiry = next;
+	return next;
+}
+
+int discovery_count(void)
+{
+	return m_count;
+}
+
+void discovery_stop(void)
+{
+	io_closeSocket(&m_socket);
+
+	// Forget the Smart Meters
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		while (m_table[i]) {
+			Entry* entry = m_table[i];
+			m_table[i] = entry->next;
+			free(entry);
+		}
+	}
+	m_count = 0;
+}
+
+int createSocket(void)
+{
+	// Create new UDP socket
+	int sfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	if (sfd == INVALID_SOCKET) {
+		LOG(0, "Failed to initialize socket: %s\n", strerror(errno));
+		return INVALID_SOCKET;
+	}
+
+	// Share the port with other listeners
+	int on = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+		LOG(0, "Failed to set SO_REUSEADDR: %s\n", strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	// Bind socket to the port of the multicasts
+	struct sockaddr_in sa = {0};
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(BRE_PORT);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sfd, (struct sockaddr*) &sa, sizeof(sa)) == -1) {
+		LOG(0, "Failed to bind socket to port %d: %s\n", BRE_PORT, strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	// Without memberships, the multicasts are not received at all
+	if (!joinGroup(sfd)) {
+		LOG(0, "Failed to join multicast group '%s'\n", BRE_GROUP);
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	return sfd;
+}
+
+int joinGroup(int sfd)
+{
+	// Get interfaces list
+	struct ifaddrs* ifa = NULL;
+	if (getifaddrs(&ifa) == -1) {
+		LOG(0, "Failed to get network interfaces: %s\n", strerror(errno));
+		return 0;
+	}
+
+	// Join on every interface that is up, since the Smart Meter may be
+	// attached to any of them rather than to the one of the default route
+	int count = 0;
+	for (struct ifaddrs* it = ifa; it; it = it->ifa_next) {
+		if (!it->ifa_addr || it->ifa_addr->sa_family != AF_INET || !(it->ifa_flags & IFF_UP)) {
+			continue;
+		}
+
+		struct ip_mreqn mreq = {{0}};
+		mreq.imr_multiaddr.s_addr = inet_addr(BRE_GROUP);
+		mreq.imr_address          = ((struct sockaddr_in*)it->ifa_addr)->sin_addr;
+		mreq.imr_ifindex          = if_nametoindex(it->ifa_name);
+
+		// Interfaces with several addresses are joined only once
+		if (setsockopt(sfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+			if (errno != EADDRINUSE) {
+				LOG(2, "Failed to join multicast group on %s: %s\n", it->ifa_name, strerror(errno));
+			}
+			continue;
+		}
+
+		LOG(3, "Joined multicast group on %s\n", it->ifa_name);
+		count++;
+	}
+
+	// Cleanup
+	freeifaddrs(ifa);
+
+	return count;
+}
+
+void handleMulticasts(int sfd, const IO_Datagram* datagrams, int count)
+{
+	// Only the sender is of interest, so the payload is not even received
+	for (int i = 0; i < count; i++) {
+		LOG(4, "Multicast from %s\n", inet_ntoa(datagrams[i].from.sin_addr));
+		if (m_callback) {
+			m_callback(datagrams[i].from.sin_addr);
+		}
+	}
+}
+
+void trackMeter(IP_Address addr)
+{
+	// Refresh known Smart Meters
+	Entry** bucket = lookupBucket(addr);
+	for (Entry* entry = *bucket; entry; entry = entry->next) {
+		if (entry->addr.s_addr == addr.s_addr) {
+			entry->lastSeen = timer_now();
+			return;
+		}
+	}
+
+	// Add new Smart Meter
+	Entry* entry = malloc(sizeof(Entry));
+	if (!entry) {
+		LOG(0, "Failed to allocate table entry\n");
+		return;
+	}
+	entry->addr     = addr;
+	entry->lastSeen = timer_now();
+	entry->next     = *bucket;
+	*bucket = entry;
+	m_count++;
+
+	LOG(2, "Smart Meter at %s appeared (%d known)\n", inet_ntoa(addr), m_count);
+	entry->context = m_appear ? m_appear(addr) : NULL;
+}
+
+Entry** lookupBucket(IP_Address addr)
+{
+	// Multiplicative hashing spreads consecutive addresses evenly
+	uint32_t hash = ntohl(addr.s_addr) * 2654435761u;
+	return &m_table[hash >> (32 - TABLE_BITS)];
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : discovery
+  Used by   : smartmeter
+  Purpose   : Listens for the BRE multicasts performed by Smart Meters in order
+              to detect their network addresses, without blocking the io loop.
+              Optionally keeps track of all Smart Meters heard.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#ifndef __DISCOVERY_H
+#define __DISCOVERY_H
+
+#include <stdint.h>
+
+#include "ip.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Callback used to notify clients about the address of a Smart Meter
+// performing a multicast
+typedef void(*discovery_cb)(IP_Address addr);
+
+// Callbacks used to notify clients about Smart Meters appearing on and
+// vanishing from the network. The context returned upon appearance is passed
+// back upon vanishing; if NULL, the Smart Meter is ignored until it vanishes.
+typedef void*(*discovery_appear_cb)(IP_Address addr);
+typedef void(*discovery_vanish_cb)(IP_Address addr, void* context);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Starts listening for multicasts on all network interfaces. The socket is
+// registered with the io module, so the callback is invoked by io_process().
+int discovery_start(discovery_cb callback);
+
+// Starts listening for multicasts and keeps track of the Smart Meters heard.
+// Smart Meters not heard for 'timeout' milliseconds are considered vanished
+// upon the next call of discovery_expire().
+int discovery_track(discovery_appear_cb appear, discovery_vanish_cb vanish, int timeout);
+
+// Removes the Smart Meters that have not been heard within the timeout.
+// 'now' is the current time as returned by timer_now(). Returns the time
+// when the function needs to be called again.
+uint64_t discovery_expire(uint64_t now);
+
+// Returns the number of Smart Meters currently tracked
+int discovery_count(void);
+
+// Stops listening for multicasts and forgets the Smart Meters tracked
+// without notifying the client
+void discovery_stop(void);
+
+#endif // __DISCOVERY_H
@@ -44,37 +44,122 @@
 #include "fluksometer.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 
-#include "meter.h"
-#include "timer.h"
+#include "io.h"
 #include "common.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// STATIC VARIABLES
+// CONSTANTS
 ////////////////////////////////////////////////////////////////////////////////
 
-// Stores context for the thread performing the measurements
-static MeterHandle* m_handle;
+// Size of the buffer holding the data read from the FIFO, a multiple of
+// the pipe buffer so that a full FIFO is drained with few reads
+#define BUFFER_SIZE 8192
+
+// Time in milliseconds between two attempts to open the FIFO without
+// directory watch
+#define RETRY_INTERVAL 1000
+
+// Size of the buffer to receive directory change notifications
+#define EVENT_BUFFER_SIZE 4096
+
+// Maximum number of lines parsed before the callback is invoked for them
+#define MAX_BATCH 64
+
+// Number of significant digits parsed without loss of precision
+#define MAX_DIGITS 18
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
 
 // Holds the name of the FIFO special file to read from
 static const char* m_fifo;
 
-// Handle to the FIFO
-static FILE* m_fd;
+// Descriptor of the FIFO
+static int m_fd = -1;
+
+// Inotify instance watching the directory of the FIFO for its (re)creation
+static int m_watch = -1;
+
+// Flag if the sensor data is being processed by fluksometer_join()
+static volatile int m_running;
+
+// Timer to look for the FIFO if the directory cannot be watched
+static int m_retryTimer;
+
+// Data read from the FIFO, the lines not yet parsed start at m_begin
+static char m_buffer[BUFFER_SIZE];
+static size_t m_begin;
+static size_t m_end;
+
+// Statistics about reading and parsing the lines
+static Fluksometer_Stats m_stats;
 
 // Callback to notify the client module about measurements
 static fluksometer_cb m_callback;
 
+// Powers of ten to scale the fractional digits
+static const double m_scale[MAX_DIGITS + 1] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+	1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+};
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // HELPER FUNCTIONS
 ////////////////////////////////////////////////////////////////////////////////
 
-// Callback function invoked by the meter thread
-static void performMeasurement(MeterHandle* handle);
+// Callback functions invoked by the io module when the FIFO has data and
+// when the directory of the FIFO changed
+static void handleFifo(int fd, int events, void* arg);
+static void handleWatch(int fd, int events, void* arg);
+
+// Opens the FIFO and registers it for multiplexing while running
+static int openFifo(void);
+
+// Closes the FIFO, discarding incomplete lines
+static void closeFifo(void);
+
+// Starts watching the directory of the FIFO. Returns 0 if not supported
+static int openWatch(void);
+
+// Callback invoked by the io module to look for the FIFO without watch
+static void retryOpen(int id, void* arg);
+
+// Parses all complete lines in the buffer and invokes the callback
+static void drainLines(void);
+
+// Waits up to timeout ms for data and reads all available data from the FIFO.
+// Returns the number of bytes read or -1 if the FIFO failed or was closed
+static int fillBuffer(int timeout);
+
+// Parses the next complete line in the buffer. Returns 1 if a measurement
+// was parsed, 0 if no complete line is buffered or -1 if the line is invalid
+static int parseNextLine(SmartMeter_Data* m);
+
+// Parses the sensor readings of a line (without newline)
+static int parseLine(const char* p, const char* end, SmartMeter_Data* m);
+
+// Parse a number preceded by blanks and return the position after it or
+// NULL if there is none
+static const char* parseDecimal(const char* p, const char* end, double* value);
+static const char* parseInteger(const char* p, const char* end, int* value);
+
+// Returns the CPU time in microseconds consumed by the calling thread
+static double getCpuTime(void);
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -91,89 +176,387 @@ int fluksometer_init(const char* fifo, fluksometer_cb callback)
 
 int fluksometer_measure(SmartMeter_Data* m)
 {
-	// Open FIFO with sensor readings
-	if (!m_fd) {
-		m_fd = fopen(m_fifo, "r");
-		if (!m_fd) {
-			LOG(1, "Failed to open FIFO '%s': %s\n", m_fifo, strerror(errno));
+	// Return buffered lines first, read more only if there is none
+	while (1) {
+		int result = parseNextLine(m);
+		if (result != 0) {
+			return result > 0;
+		}
+		if (fillBuffer(-1) < 0) {
 			return 0;
 		}
 	}
-	
-	// Read line from stream
-	char line[128];
-	if (!fgets(line, sizeof(line), m_fd)) {
-
-		LOG(1, "Failed to read from FIFO: %s\n", 
-			errno ? strerror(errno) : "EOF reached");
-			
-		// Close FIFO to retry next time
-		fclose(m_fd);
-		m_fd = NULL;
-		
-		return 0;	
-	}
-
-	// Parse line (newline included)
-	int phaseid[3];
-	int counter[3];
-	int cnt = sscanf(line, "%lf %d %d %lf %d %d %lf %d %d %lf", 
-		&m->val[TIMESTAMP], 
-		&phaseid[0], // == 0
-		&counter[0],
-		&m->val[POWER_L1],
-		&phaseid[1], // == 1
-		&counter[1],
-		&m->val[POWER_L2],
-		&phaseid[2], // == 2
-		&counter[2],
-		&m->val[POWER_L3]
-	);
-	
-	if (cnt < 4) {
-		LOG(1, "Failed to parse line: %s", line);
+}
+
+int fluksometer_getStats(Fluksometer_Stats* stats)
+{
+	*stats = m_stats;
+	return 1; // Success
+}
+
+void handleFifo(int fd, int events, void* arg)
+{
+	if (fillBuffer(0) < 0) {
+
+		// A FIFO opened read-only reports EOF when the writer exits,
+		// open it again right away to wait for the next one
+		struct stat st;
+		if (stat(m_fifo, &st) == 0 && S_ISFIFO(st.st_mode)) {
+			openFifo();
+		}
+		return;
+	}
+	drainLines();
+}
+
+void handleWatch(int fd, int events, void* arg)
+{
+	const char* name = strrchr(m_fifo, '/');
+	name = name ? name + 1 : m_fifo;
+
+	// Reopen the FIFO whenever it is (re)created, e.g. by a restarting writer
+	char buffer[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t size;
+	while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + size; ) {
+			const struct inotify_event* event = (const struct inotify_event*)p;
+			if (event->len && strcmp(event->name, name) == 0) {
+				LOG(2, "FIFO '%s' created, reopening\n", m_fifo);
+				closeFifo();
+				openFifo();
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+int openFifo(void)
+{
+	// Open the FIFO for writing as well, so that it neither reports EOF nor
+	// has to be reopened when the writer restarts. Fall back to read-only.
+	m_fd = open(m_fifo, O_RDWR | O_NONBLOCK);
+	if (m_fd == -1 && (errno == EACCES || errno == EROFS)) {
+		m_fd = open(m_fifo, O_RDONLY | O_NONBLOCK);
+	}
+	if (m_fd == -1) {
+		LOG(1, "Failed to open FIFO '%s': %s\n", m_fifo, strerror(errno));
+		return 0;
+	}
+	m_begin = m_end = 0;
+
+	if (m_running && !io_multiplex(m_fd, "fluksometer", IO_READ, handleFifo, NULL)) {
+		closeFifo();
+		return 0;
+	}
+	return 1; // Success
+}
+
+void closeFifo(void)
+{
+	if (m_fd != -1) {
+		io_unregister(m_fd);
+		close(m_fd);
+		m_fd = -1;
+	}
+}
+
+int openWatch(void)
+{
+	// Watch the directory, the FIFO itself may not exist yet
+	char dir[PATH_MAX];
+	const char* sep = strrchr(m_fifo, '/');
+	if (!sep) {
+		strcpy(dir, ".");
+	} else if (sep == m_fifo) {
+		strcpy(dir, "/");
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(sep - m_fifo), m_fifo);
+	}
+
+	m_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_watch == -1 || inotify_add_watch(m_watch, dir, IN_CREATE | IN_MOVED_TO) == -1 ||
+		!io_multiplex(m_watch, "fluksometer-watch", IO_READ, handleWatch, NULL))
+	{
+		LOG(1, "Failed to watch directory '%s': %s\n", dir, strerror(errno));
+		if (m_watch != -1) {
+			close(m_watch);
+			m_watch = -1;
+		}
+		return 0;
+	}
+	return 1; // Success
+}
+
+void retryOpen(int id, void* arg)
+{
+	if (m_fd == -1) {
+		openFifo();
+	}
+}
+
+void drainLines(void)
+{
+	// Drain every complete line, parsing in batches to measure the CPU time
+	// spent on parsing apart from the callback
+	unsigned int lines = 0;
+	SmartMeter_Data batch[MAX_BATCH];
+	int count;
+	do {
+		double begin = getCpuTime();
+		int result;
+		count = 0;
+		memset(batch, 0, sizeof(batch));
+		while (count < MAX_BATCH && (result = parseNextLine(&batch[count])) != 0) {
+			if (result > 0) {
+				count++;
+			} else {
+				m_stats.numErrors++;
+			}
+		}
+		m_stats.totalCpuTime += getCpuTime() - begin;
+		m_stats.numLines += count;
+		lines += count;
+
+		// Invoke callback
+		for (int i = 0; i < count; i++) {
+			if (m_callback) {
+				m_callback(&batch[i]);
+			} else {
+				LOG(1, "No callback specified\n");
+			}
+		}
+	} while (count == MAX_BATCH);
+
+	if (lines > m_stats.maxBurst) {
+		m_stats.maxBurst = lines;
+	}
+}
+
+int fillBuffer(int timeout)
+{
+	// Open FIFO with sensor readings
+	if (m_fd == -1 && !openFifo()) {
+		return -1;
+	}
+
+	// Keep the incomplete line at the end only
+	if (m_begin > 0) {
+		memmove(m_buffer, m_buffer + m_begin, m_end - m_begin);
+		m_end -= m_begin;
+		m_begin = 0;
+	}
+	if (m_end == sizeof(m_buffer)) {
+		LOG(1, "Discarding line exceeding %d bytes\n", BUFFER_SIZE);
+		m_end = 0;
+	}
+
+	// Wait for data
+	struct pollfd pfd = {m_fd, POLLIN, 0};
+	int ready = poll(&pfd, 1, timeout);
+	if (ready <= 0) {
+		return ready == 0 || errno == EINTR ? 0 : -1;
+	}
+
+	// Read as much as the buffer takes
+	int total = 0;
+	while (m_end < sizeof(m_buffer)) {
+		ssize_t size = read(m_fd, m_buffer + m_end, sizeof(m_buffer) - m_end);
+		if (size > 0) {
+			m_end += size;
+			total += size;
+			m_stats.numReads++;
+			continue;
+		}
+		if (size == -1 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+
+		// Close FIFO to retry next time unless there is data to process
+		if (total == 0) {
+			LOG(1, "Failed to read from FIFO: %s\n",
+				size == -1 ? strerror(errno) : "EOF reached");
+			closeFifo();
+			return -1;
+		}
+		break;
+	}
+	return total;
+}
+
+int parseNextLine(SmartMeter_Data* m)
+{
+	char* begin = m_buffer + m_begin;
+	char* newline = memchr(begin, '\n', m_end - m_begin);
+	if (!newline) {
+		return 0;
+	}
+	m_begin = newline + 1 - m_buffer;
+
+	// Ignore a trailing carriage return
+	const char* end = newline;
+	if (end > begin && end[-1] == '\r') {
+		end--;
+	}
+	if (!parseLine(begin, end, m)) {
+		LOG(1, "Failed to parse line: %.*s\n", (int)(end - begin), begin);
+		return -1;
+	}
+	return 1;
+}
+
+int parseLine(const char* p, const char* end, SmartMeter_Data* m)
+{
+	// Format: timestamp followed by 'phase counter power' for each phase
+	static const SmartMeter_VarID phases[3] = {POWER_L1, POWER_L2, POWER_L3};
+
+	p = parseDecimal(p, end, &m->val[TIMESTAMP]);
+	if (!p) {
+		return 0;
+	}
+	m->valid = SMARTMETER_VAR(TIMESTAMP);
+
+	for (int i = 0; i < 3; i++) {
+		int phaseid, counter;
+		const char* next = parseInteger(p, end, &phaseid);
+		next = next ? parseInteger(next, end, &counter) : NULL;
+		next = next ? parseDecimal(next, end, &m->val[phases[i]]) : NULL;
+		if (!next) {
+			break;
+		}
+		m->valid |= SMARTMETER_VAR(phases[i]);
+		p = next;
+	}
+
+	// The first phase is mandatory
+	if (!(m->valid & SMARTMETER_VAR(POWER_L1))) {
 		return 0;
 	}
 
 	// Compute total power
 	m->val[POWER_ALL_PHASES] = m->val[POWER_L1] + m->val[POWER_L2] + m->val[POWER_L3];
-	
+	m->valid |= SMARTMETER_VAR(POWER_ALL_PHASES);
+
 	return 1; // Success
 }
 
-void performMeasurement(MeterHandle* handle)
+const char* parseDecimal(const char* p, const char* end, double* value)
 {
-	// Read measurement
-	SmartMeter_Data m = {{0}};
-	if (!fluksometer_measure(&m)) {
-		LOG(1, "Failed to perform measurement\n");
-	
-		// Wait a bit before retrying
-		timer_sleep(1000);
-		return;
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
 	}
-	
-	// Invoke callback
-	if (m_callback) {
-		m_callback(&m);
-	} else {
-		LOG(1, "No callback specified\n");
+	const char* begin = p;
+
+	int negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+')) {
+		p++;
+	}
+
+	// Accumulate the digits as integer and scale the fractional part once
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int fraction = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		mantissa = mantissa * 10 + (*p - '0');
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, fraction++) {
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+	}
+	if (digits == 0) {
+		return NULL;
+	}
+
+	// Leave rare forms like exponents and long numbers to the C library
+	if (digits > MAX_DIGITS || (p < end && *p != ' ' && *p != '\t')) {
+		char number[64];
+		size_t length = end - begin < (long)sizeof(number) - 1 ? end - begin : sizeof(number) - 1;
+		memcpy(number, begin, length);
+		number[length] = '\0';
+		char* stop;
+		*value = strtod(number, &stop);
+		return stop == number ? NULL : begin + (stop - number);
+	}
+
+	*value = (double)mantissa / m_scale[fraction];
+	if (negative) {
+		*value = -*value;
+	}
+	return p;
+}
+
+const char* parseInteger(const char* p, const char* end, int* value)
+{
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+
+	int negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+')) {
+		p++;
+	}
+
+	const char* digits = p;
+	long result = 0;
+	for (; p < end && *p >= '0' && *p <= '9' && p - digits < 10; p++) {
+		result = result * 10 + (*p - '0');
+	}
+	if (p == digits || (p < end && *p != ' ' && *p != '\t')) {
+		return NULL;
+	}
+
+	*value = (int)(negative ? -result : result);
+	return p;
+}
+
+double getCpuTime(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1) {
+		return 0;
 	}
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
 }
 
 int fluksometer_start(void)
 {
-	m_handle = meter_start(-1, performMeasurement);
-	return m_handle != NULL;
+	m_running = 1;
+
+	// Without directory watch the FIFO is looked for periodically
+	if (!openWatch()) {
+		m_retryTimer = io_addTimer(RETRY_INTERVAL, RETRY_INTERVAL, retryOpen, NULL);
+	}
+
+	// Register the FIFO if already opened by fluksometer_measure()
+	if (m_fd != -1) {
+		return io_multiplex(m_fd, "fluksometer", IO_READ, handleFifo, NULL);
+	}
+	if (!openFifo() && m_watch != -1) {
+		LOG(1, "Waiting for FIFO '%s' to be created\n", m_fifo);
+	}
+	return 1; // Success
 }
 
 int fluksometer_stop(void)
 {
-	return meter_stop(m_handle);
+	m_running = 0;
+	return 1; // Success
 }
 
 int fluksometer_join(void)
 {
-	return meter_join(m_handle);
-}
+	while (m_running && io_process()) {
+		continue;
+	}
 
+	// Cleanup
+	io_cancelTimer(m_retryTimer);
+	m_retryTimer = 0;
+	closeFifo();
+	if (m_watch != -1) {
+		io_unregister(m_watch);
+		close(m_watch);
+		m_watch = -1;
+	}
+	return 1; // Success
+}
@@ -61,6 +61,15 @@
 // Callback used to notify about incoming data
 typedef void(*fluksometer_cb)(const SmartMeter_Data* m);
 
+// Structure to hold statistics about reading the sensor data
+typedef struct Fluksometer_Stats_s {
+	unsigned int numLines;   // Number of lines parsed successfully
+	unsigned int numErrors;  // Number of lines failed to parse
+	unsigned int numReads;   // Number of reads from the FIFO
+	unsigned int maxBurst;   // Maximum number of lines drained at once
+	double totalCpuTime;     // Accumulated CPU time in us to parse the lines
+} Fluksometer_Stats;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTIONS
@@ -72,19 +81,22 @@ typedef void(*fluksometer_cb)(const SmartMeter_Data* m);
 //   callback : Function to be called upon data received
 int fluksometer_init(const char* fifo, fluksometer_cb callback);
 
-// Starts the fluksometer thread in order to perform
-// measurements at the specified time interval
+// Registers the FIFO with the io module in order to process the sensor
+// data as it arrives. The FIFO is reopened as soon as it is recreated.
 int fluksometer_start(void);
 
-// Stops the fluksometer thread
+// Makes fluksometer_join() return, e.g. from the callback
 int fluksometer_stop(void);
 
-// Waits for the fluksometer thread to terminate
+// Processes the sensor data by calling io_processTimeout() until stopped
 int fluksometer_join(void);
 
-// Reads a measurement
+// Reads a measurement, waiting for the sensor board if none is buffered
 int fluksometer_measure(SmartMeter_Data* m);
 
+// Retrieves the statistics about reading the sensor data
+int fluksometer_getStats(Fluksometer_Stats* stats);
+
 
 #endif // __FLUKSOMETER_H
 
@@ -0,0 +1,723 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : gateway
+  Used by   : smlogger
+  Purpose   : Polls many Smart Meters concurrently using non-blocking
+              sessions on the io event loop, optionally sharded across
+              threads pinned to the CPUs, each running a loop of its own.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "gateway.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "io.h"
+#include "uring.h"
+#include "timer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Time in milliseconds between the first sessions of subsequent meters
+#define STAGGER_STEP 10
+
+// Maximum delay in milliseconds of the first session of a meter
+#define STAGGER_MAX 1000
+
+// Time in milliseconds to wait for events when there is nothing to poll
+#define IDLE_TIMEOUT 1000
+
+// Maximum number of shards, i.e. threads polling a share of the meters
+#define MAX_SHARDS 64
+
+// Number of points of every shard on the hash ring, the more the more evenly
+// the meters are spread
+#define RING_POINTS 128
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Struct to hold a Smart Meter polled by a shard
+typedef struct PollEntry_s {
+	SmartMeter* sm;
+	struct Shard_s* shard;
+	uint64_t due;            // Time to poll the Smart Meter next
+	int index;               // Position in the heap of the shard
+} PollEntry;
+
+// Struct to hold a share of the Smart Meters polled by a thread of its own
+typedef struct Shard_s {
+	IO_Loop* loop;           // Loop of the thread, NULL for the calling thread
+	pthread_t thread;
+	int started;             // Flag if the thread has been started
+	int cpu;                 // CPU to run on, or -1 if not pinned
+	PollEntry** meters;      // Smart Meters polled as min-heap by due time,
+	int count;               // accessed by the thread only
+	int capacity;
+} Shard;
+
+// Struct to hold a point of a shard on the hash ring
+typedef struct RingPoint_s {
+	uint32_t hash;
+	int shard;
+} RingPoint;
+
+// Struct to hold a message passed to the thread of a shard
+typedef struct Message_s {
+	Shard* shard;
+	SmartMeter* sm;
+} Message;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Array of all Smart Meters polled, accessed by the calling thread only
+static SmartMeter** m_meters;
+
+// Number of Smart Meters in the array
+static int m_count;
+
+// Capacity of the array
+static int m_capacity;
+
+// Shards polling the Smart Meters, the first one in the calling thread
+static Shard* m_shards;
+static int m_numShards;
+
+// Points of the shards on the hash ring, sorted by hash
+static RingPoint* m_ring;
+
+// Flag if the threads of the shards run, so that their Smart Meters are
+// added and removed by messages only
+static int m_started;
+
+// Flag used for loop termination, shared by the threads of the shards
+static int m_running;
+
+// Callback to perform periodic work
+static gateway_tick_cb m_tick;
+
+// Number of io_uring entries of every shard, or 0 to use epoll
+static unsigned int m_uringEntries;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Determines the CPUs the process may run on and returns their number
+static int getCpus(int* cpus, int size);
+
+// Hash functions to place the shards and Smart Meters on the hash ring
+static uint32_t hashPoint(int shard, int point);
+static uint32_t hashHost(const char* host);
+
+// Compares two points on the hash ring by hash for qsort()
+static int comparePoints(const void* a, const void* b);
+
+// Returns the shard to poll the specified Smart Meter, i.e. the shard owning
+// the next point on the hash ring
+static Shard* findShard(const SmartMeter* sm);
+
+// Removes the Smart Meter from the array of all Smart Meters
+static int unlistMeter(SmartMeter* sm);
+
+// Passes the Smart Meter to the handler in the thread of the shard, or right
+// away if the thread is not running
+static int sendMessage(Shard* shard, SmartMeter* sm, Task_cb handler);
+
+// Message handlers to add, remove, and remove and free a Smart Meter
+static void handleAdd(void* arg);
+static void handleRemove(void* arg);
+static void handleRelease(void* arg);
+
+// Task to interrupt the loop of a shard, e.g. to notice the gateway stopped
+static void wakeUp(void* arg);
+
+// Callback function invoked by the smartmeter module to poll a Smart Meter
+// earlier than scheduled
+static void wakeUpMeter(SmartMeter* sm, void* arg);
+
+// Functions to restore the heap property after the due time of the entry at
+// the specified position decreased or increased
+static void siftUp(Shard* shard, int index);
+static void siftDown(Shard* shard, int index);
+
+// Entry point of the threads of the shards
+static void* runShard(void* arg);
+
+// Polls the Smart Meters of the shard in the calling thread until the gateway
+// is stopped
+static int pollShard(Shard* shard);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int gateway_setShards(int count)
+{
+	if (m_count > 0 || m_started) {
+		LOG(0, "Shards must be set before adding Smart Meters\n");
+		return 0;
+	}
+
+	// Use one shard per CPU if not specified
+	int cpus[MAX_SHARDS];
+	int numCpus = getCpus(cpus, MAX_SHARDS);
+	if (count <= 0) {
+		count = numCpus > 0 ? numCpus : 1;
+	}
+	if (count > MAX_SHARDS) {
+		LOG(1, "Limiting to %d shards\n", MAX_SHARDS);
+		count = MAX_SHARDS;
+	}
+
+	Shard* shards = calloc(count, sizeof(Shard));
+	RingPoint* ring = malloc(count * RING_POINTS * sizeof(RingPoint));
+	if (!shards || !ring) {
+		LOG(0, "Failed to allocate shards\n");
+		free(shards);
+		free(ring);
+		return 0;
+	}
+
+	// Pin the threads to distinct CPUs as long as there are enough
+	for (int i = 0; i < count; i++) {
+		shards[i].cpu = count > 1 && numCpus > 0 ? cpus[i % numCpus] : -1;
+	}
+
+	// The points of a shard do not depend on the number of shards, so only
+	// few meters move to other shards if it changes
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < RING_POINTS; j++) {
+			ring[i * RING_POINTS + j].hash  = hashPoint(i, j);
+			ring[i * RING_POINTS + j].shard = i;
+		}
+	}
+	qsort(ring, count * RING_POINTS, sizeof(RingPoint), comparePoints);
+
+	gateway_cleanup(0);
+	m_shards = shards;
+	m_numShards = count;
+	m_ring = ring;
+
+	LOG(2, "Polling on %d shards\n", count);
+	return 1; // Success
+}
+
+void gateway_setUring(unsigned int entries)
+{
+	m_uringEntries = entries;
+}
+
+int gateway_add(SmartMeter* sm)
+{
+	if (!sm) {
+		LOG(0, "No Smart Meter specified\n");
+		return 0;
+	}
+
+	// Poll all meters in the calling thread unless sharded
+	if (!m_shards && !gateway_setShards(1)) {
+		return 0;
+	}
+
+	// Grow array if required
+	if (m_count == m_capacity) {
+		int capacity = m_capacity ? 2 * m_capacity : 16;
+		SmartMeter** meters = realloc(m_meters, capacity * sizeof(SmartMeter*));
+		if (!meters) {
+			LOG(0, "Failed to grow meter array\n");
+			return 0;
+		}
+		m_meters = meters;
+		m_capacity = capacity;
+	}
+	
+	// Do not connect to all meters at the same time, unless aligned to
+	// the wall clock with their own phase
+	if (smartmeter_getPhase(sm) < 0) {
+		smartmeter_schedule(sm, timer_now() + (m_count * STAGGER_STEP) % STAGGER_MAX);
+	}
+	
+	if (!sendMessage(findShard(sm), sm, handleAdd)) {
+		return 0;
+	}
+	m_meters[m_count++] = sm;
+	
+	LOG(2, "Polling %s (%d meters)\n", smartmeter_getHost(sm), m_count);
+	return 1; // Success
+}
+
+int gateway_remove(SmartMeter* sm)
+{
+	return unlistMeter(sm) && sendMessage(findShard(sm), sm, handleRemove);
+}
+
+int gateway_release(SmartMeter* sm)
+{
+	if (!unlistMeter(sm)) {
+		smartmeter_free(sm);
+		return 0;
+	}
+	return sendMessage(findShard(sm), sm, handleRelease);
+}
+
+int gateway_count(void)
+{
+	return m_count;
+}
+
+SmartMeter* gateway_find(const char* host)
+{
+	for (int i = 0; i < m_count; i++) {
+		if (strcmp(smartmeter_getHost(m_meters[i]), host) == 0) {
+			return m_meters[i];
+		}
+	}
+	return NULL;
+}
+
+void gateway_setTick(gateway_tick_cb tick)
+{
+	m_tick = tick;
+}
+
+int gateway_run(void)
+{
+	if (!m_shards && !gateway_setShards(1)) {
+		return 0;
+	}
+
+	// Start the threads of the other shards, each running a loop of its own
+	__atomic_store_n(&m_running, 1, __ATOMIC_RELAXED); // Enter loop
+	for (int i = 1; i < m_numShards && __atomic_load_n(&m_running, __ATOMIC_RELAXED); i++) {
+		Shard* shard = &m_shards[i];
+		if (!shard->loop) {
+			shard->loop = io_createLoop();
+		}
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (shard->cpu >= 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(shard->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		if (!shard->loop || pthread_create(&shard->thread, &attr, runShard, shard) != 0) {
+			LOG(0, "Failed to start shard %d\n", i);
+			gateway_stop();
+		} else {
+			shard->started = 1;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	m_started = 1;
+
+	// Poll the first shard in the calling thread, pinned for the time being
+	cpu_set_t previous;
+	int pinned = m_shards[0].cpu >= 0 &&
+		pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) == 0;
+	if (pinned) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(m_shards[0].cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	int success = __atomic_load_n(&m_running, __ATOMIC_RELAXED) && pollShard(&m_shards[0]);
+	if (pinned) {
+		pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+	}
+
+	// Let the other shards notice and wait for them to finish
+	gateway_stop();
+	for (int i = 1; i < m_numShards; i++) {
+		Shard* shard = &m_shards[i];
+		if (shard->started) {
+			io_post(shard->loop, wakeUp, NULL);
+			pthread_join(shard->thread, NULL);
+			shard->started = 0;
+		}
+	}
+	m_started = 0;
+
+	// Handle the messages posted after the shards left their loops
+	IO_Loop* loop = io_getLoop();
+	for (int i = 1; i < m_numShards; i++) {
+		if (m_shards[i].loop) {
+			io_setLoop(m_shards[i].loop);
+			io_processTimeout(0);
+		}
+	}
+	io_setLoop(loop);
+	
+	return success;
+}
+
+void gateway_stop(void)
+{
+	__atomic_store_n(&m_running, 0, __ATOMIC_RELAXED); // Leave loop
+}
+
+void gateway_cleanup(int freeMeters)
+{
+	IO_Loop* loop = io_getLoop();
+	for (int i = 0; i < m_numShards; i++) {
+		Shard* shard = &m_shards[i];
+
+		// Free the Smart Meters on behalf of the thread of the shard
+		if (shard->loop) {
+			io_setLoop(shard->loop);
+		}
+		for (int j = 0; j < shard->count; j++) {
+			smartmeter_setWakeupHook(shard->meters[j]->sm, NULL, NULL);
+			if (freeMeters) {
+				smartmeter_free(shard->meters[j]->sm);
+			}
+			free(shard->meters[j]);
+		}
+		io_setLoop(loop);
+		io_freeLoop(shard->loop);
+		free(shard->meters);
+	}
+	free(m_shards);
+	m_shards = NULL;
+	m_numShards = 0;
+	free(m_ring);
+	m_ring = NULL;
+	
+	free(m_meters);
+	m_meters = NULL;
+	m_count = 0;
+	m_capacity = 0;
+}
+
+int getCpus(int* cpus, int size)
+{
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+		LOG(1, "Failed to determine CPUs: %s\n", strerror(errno));
+		return 0;
+	}
+
+	int count = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE && count < size; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus[count++] = cpu;
+		}
+	}
+	return count;
+}
+
+uint32_t hashPoint(int shard, int point)
+{
+	// Finalizer of MurmurHash3 to spread the points over the ring
+	uint32_t h = (uint32_t)shard * RING_POINTS + point + 1;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+uint32_t hashHost(const char* host)
+{
+	// FNV-1a, followed by the finalizer to spread similar addresses
+	uint32_t h = 2166136261u;
+	for (const char* c = host; *c; c++) {
+		h = (h ^ (unsigned char)*c) * 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+int comparePoints(const void* a, const void* b)
+{
+	uint32_t ha = ((const RingPoint*)a)->hash;
+	uint32_t hb = ((const RingPoint*)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+Shard* findShard(const SmartMeter* sm)
+{
+	// Binary search for the first point at or after the hash, wrapping around
+	uint32_t hash = hashHost(smartmeter_getHost(sm));
+	int lo = 0, hi = m_numShards * RING_POINTS;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (m_ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == m_numShards * RING_POINTS) {
+		lo = 0;
+	}
+	return &m_shards[m_ring[lo].shard];
+}
+
+int unlistMeter(SmartMeter* sm)
+{
+	for (int i = 0; i < m_count; i++) {
+		if (m_meters[i] == sm) {
+			m_meters[i] = m_meters[--m_count];
+			LOG(2, "Stopped polling %s (%d meters)\n", smartmeter_getHost(sm), m_count);
+			return 1; // Success
+		}
+	}
+	
+	LOG(1, "Smart Meter not found\n");
+	return 0;
+}
+
+int sendMessage(Shard* shard, SmartMeter* sm, Task_cb handler)
+{
+	Message* msg = malloc(sizeof(Message));
+	if (!msg) {
+		LOG(0, "Failed to allocate message\n");
+		return 0;
+	}
+	msg->shard = shard;
+	msg->sm    = sm;
+
+	// The meters of the calling thread are handled right away as well
+	if (m_started && shard->loop) {
+		if (!io_post(shard->loop, handler, msg)) {
+			free(msg);
+			return 0;
+		}
+		return 1; // Success
+	}
+	handler(msg);
+	return 1; // Success
+}
+
+void handleAdd(void* arg)
+{
+	Message* msg = (Message*)arg;
+	Shard* shard = msg->shard;
+
+	// Grow heap if required
+	if (shard->count == shard->capacity) {
+		int capacity = shard->capacity ? 2 * shard->capacity : 16;
+		PollEntry** meters = realloc(shard->meters, capacity * sizeof(PollEntry*));
+		if (!meters) {
+			LOG(0, "Failed to grow meter array of shard\n");
+			free(msg);
+			return;
+		}
+		shard->meters = meters;
+		shard->capacity = capacity;
+	}
+	PollEntry* entry = malloc(sizeof(PollEntry));
+	if (!entry) {
+		LOG(0, "Failed to allocate meter entry\n");
+		free(msg);
+		return;
+	}
+
+	// Poll right away to learn when the Smart Meter is due
+	entry->sm    = msg->sm;
+	entry->shard = shard;
+	entry->due   = 0;
+	entry->index = shard->count;
+	shard->meters[shard->count++] = entry;
+	siftUp(shard, entry->index);
+	smartmeter_setWakeupHook(msg->sm, wakeUpMeter, entry);
+	free(msg);
+}
+
+void handleRemove(void* arg)
+{
+	Message* msg = (Message*)arg;
+	Shard* shard = msg->shard;
+	for (int i = 0; i < shard->count; i++) {
+		PollEntry* entry = shard->meters[i];
+		if (entry->sm == msg->sm) {
+			smartmeter_setWakeupHook(entry->sm, NULL, NULL);
+			free(entry);
+
+			// Fill the gap with the last entry, which may belong either way
+			if (i < --shard->count) {
+				PollEntry* last = shard->meters[shard->count];
+				shard->meters[i] = last;
+				last->index = i;
+				siftUp(shard, i);
+				siftDown(shard, last->index);
+			}
+			break;
+		}
+	}
+	free(msg);
+}
+
+void handleRelease(void* arg)
+{
+	SmartMeter* sm = ((Message*)arg)->sm;
+	handleRemove(arg);
+	smartmeter_free(sm);
+}
+
+void wakeUp(void* arg)
+{
+	// Nothing to do, returning from io_processTimeout() is all it takes
+}
+
+void wakeUpMeter(SmartMeter* sm, void* arg)
+{
+	// Move to the top, so that the loop polls the Smart Meter next
+	PollEntry* entry = (PollEntry*)arg;
+	entry->due = 0;
+	siftUp(entry->shard, entry->index);
+}
+
+void siftUp(Shard* shard, int index)
+{
+	PollEntry* entry = shard->meters[index];
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (shard->meters[parent]->due <= entry->due) {
+			break;
+		}
+		shard->meters[index] = shard->meters[parent];
+		shard->meters[index]->index = index;
+		index = parent;
+	}
+	shard->meters[index] = entry;
+	entry->index = index;
+}
+
+void siftDown(Shard* shard, int index)
+{
+	PollEntry* entry = shard->meters[index];
+	while (1) {
+		int child = 2 * index + 1;
+		if (child >= shard->count) {
+			break;
+		}
+		if (child + 1 < shard->count && shard->meters[child + 1]->due < shard->meters[child]->due) {
+			child++;
+		}
+		if (entry->due <= shard->meters[child]->due) {
+			break;
+		}
+		shard->meters[index] = shard->meters[child];
+		shard->meters[index]->index = index;
+		index = child;
+	}
+	shard->meters[index] = entry;
+	entry->index = index;
+}
+
+void* runShard(void* arg)
+{
+	Shard* shard = (Shard*)arg;
+	io_setLoop(shard->loop);
+	if (!pollShard(shard)) {
+		gateway_stop();
+	}
+	io_setLoop(NULL);
+	return NULL;
+}
+
+int pollShard(Shard* shard)
+{
+	// Every shard runs the sessions on a ring of its own if requested
+	if (m_uringEntries && !uring_init(m_uringEntries)) {
+		LOG(1, "Falling back to epoll for the sessions\n");
+	}
+
+	int success = 1;
+	while (__atomic_load_n(&m_running, __ATOMIC_RELAXED)) {
+	
+		// Start due sessions and determine the next deadline
+		uint64_t now = timer_now();
+		uint64_t next = now + IDLE_TIMEOUT;
+		if (m_tick && shard == m_shards) {
+			uint64_t deadline = m_tick(now);
+			if (deadline < next) {
+				next = deadline;
+			}
+		}
+
+		// Poll only the Smart Meters due, the others wait on the heap
+		while (shard->count > 0 && shard->meters[0]->due <= now) {
+			PollEntry* entry = shard->meters[0];
+			uint64_t deadline = smartmeter_poll(entry->sm, now);
+			entry->due = deadline > now ? deadline : now + 1; // Not again in this round
+			siftUp(shard, entry->index);
+			siftDown(shard, entry->index);
+		}
+		if (shard->count > 0 && shard->meters[0]->due < next) {
+			next = shard->meters[0]->due;
+		}
+		
+		// Submit the sessions started in one go if running on io_uring
+		if (uring_isEnabled()) {
+			uring_submit();
+		}
+
+		// Handle socket events until the next deadline
+		if (!io_processTimeout(next > now ? (int)(next - now) : 0)) {
+			LOG(0, "Failed to process socket events\n");
+			success = 0;
+			break;
+		}
+	}
+
+	uring_deinit();
+	return success;
+}
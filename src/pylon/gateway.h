@@ -0,0 +1,111 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : gateway
+  Used by   : smlogger
+  Purpose   : Polls many Smart Meters concurrently using non-blocking
+              sessions on the io event loop, optionally sharded across
+              threads pinned to the CPUs, each running a loop of its own.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#ifndef __GATEWAY_H
+#define __GATEWAY_H
+
+#include "smartmeter.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Callback invoked by gateway_run() on every iteration. 'now' is the current
+// time as returned by timer_now(). Returns the time to be invoked again at the
+// latest.
+typedef uint64_t(*gateway_tick_cb)(uint64_t now);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Spreads the Smart Meters over the specified number of shards, or one per
+// CPU if zero, to be called before adding any. The calling thread of
+// gateway_run() polls the first shard, the others are polled by threads of
+// their own, each pinned to a CPU and running an io loop (see io_setLoop()).
+// Meters are assigned to the shards by consistent hashing of their address.
+// The callbacks of the Smart Meters are invoked from the thread of their shard.
+int gateway_setShards(int count);
+
+// Makes every shard run the sessions on an io_uring instance with the
+// specified number of entries, or on epoll if not available or zero
+void gateway_setUring(unsigned int entries);
+
+// Adds a Smart Meter to be polled by the gateway
+// The first sessions of subsequently added meters are staggered
+int gateway_add(SmartMeter* sm);
+
+// Removes a Smart Meter from the gateway (does not free its context)
+// The shard of the meter may still use it until gateway_run() returns.
+int gateway_remove(SmartMeter* sm);
+
+// Removes a Smart Meter from the gateway and frees its context once its
+// shard lets go of it
+int gateway_release(SmartMeter* sm);
+
+// Returns the number of Smart Meters polled by the gateway
+int gateway_count(void);
+
+// Returns the Smart Meter polled at the specified address or NULL
+SmartMeter* gateway_find(const char* host);
+
+// Sets a callback to perform periodic work in the gateway's thread, e.g. to
+// add and remove Smart Meters
+void gateway_setTick(gateway_tick_cb tick);
+
+// Polls all Smart Meters until gateway_stop() is invoked, the first shard in
+// the calling thread. Smart Meters are added and removed by the calling thread
+// only, e.g. from the tick, which passes them to their shards as messages.
+int gateway_run(void);
+
+// Requests gateway_run() to return
+void gateway_stop(void);
+
+// Removes all Smart Meters and releases the associated resources
+// If 'freeMeters' is set, the contexts of the Smart Meters are freed as well
+void gateway_cleanup(int freeMeters);
+
+#endif // __GATEWAY_H
+
@@ -48,21 +48,51 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netdb.h> 
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <time.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netpacket/packet.h>
+#include <linux/filter.h>
 
 #include "common.h"
+#include "timer.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // CONSTANTS
 ////////////////////////////////////////////////////////////////////////////////
 
-// Maximum number of entries in the socket table
-#define SOCKETTABLE_SIZE 16
+// Initial number of entries in the socket table, which is indexed by
+// descriptor and grows as required
+#define SOCKETTABLE_SIZE 64
+
+// Maximum number of events retrieved from epoll at once
+#define MAX_EVENTS 64
+
+// Initial capacity of the timer heap
+#define TIMERHEAP_SIZE 16
+
+// The identifiers of the timers hold the slot locating the timer in the heap
+// in the lower bits, and a generation counter in the upper bits
+#define TIMER_SLOT_BITS 20
+#define TIMER_SLOT_MASK ((1 << TIMER_SLOT_BITS) - 1)
+#define MAX_TIMERS (1 << TIMER_SLOT_BITS)
+#define TIMER_GENERATIONS (INT_MAX >> TIMER_SLOT_BITS)
+
+// Time in milliseconds a connection attempt is given before the next address
+// is tried in parallel (RFC 8305)
+#define CONNECT_ATTEMPT_DELAY 250
+
+// Maximum number of connection attempts pending in parallel
+#define MAX_CONNECT_ATTEMPTS 8
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -74,31 +104,204 @@ typedef struct SocketEntry_s {
 	// Socket descriptor
 	int sfd;
 	const char* name;
-	// Callback invoked upon socket is ready for read
-	SocketReady_cb callback;
+	// Events of interest (IO_READ, IO_WRITE)
+	int events;
+	// Callback invoked upon socket is ready for read (legacy interface)
+	SocketReady_cb ready;
+	// Callback invoked upon socket is ready for the events of interest
+	SocketEvent_cb callback;
+	// Callback passed the datagrams received in batches
+	SocketBatch_cb batchReady;
+	// Argument passed to the callback
+	void* arg;
+	// Registration the events reported by epoll belong to, so that events of
+	// a descriptor closed and reused in the meantime are ignored
+	uint32_t generation;
+	// Flag if the descriptor is registered with epoll
+	int registered;
 } SocketEntry;
 
-// Table to hold information about open sockets
-SocketEntry socketTable[SOCKETTABLE_SIZE];
+// Buffer to hold the receive timestamp passed as ancillary data
+typedef union ControlBuffer_u {
+	struct cmsghdr hdr;
+	unsigned char buf[CMSG_SPACE(sizeof(struct timespec))];
+} ControlBuffer;
+
+// Struct to hold the buffers to receive a batch of datagrams
+struct IO_Batch_s {
+	int capacity;              // Maximum number of datagrams
+	size_t size;               // Size of the buffer of each datagram
+	IO_Datagram* datagrams;    // Datagrams passed to the client
+	struct mmsghdr* msgs;      // Headers passed to recvmmsg()
+	struct iovec* iovs;
+	ControlBuffer* controls;
+	unsigned char* buffers;
+};
+
+// Struct to hold a timer in the heap
+typedef struct TimerEntry_s {
+	uint64_t due;         // Time in milliseconds (see timer_now()) to expire
+	int period;           // Time in milliseconds between expirations, zero if once
+	int id;               // Identifier returned to the client
+	Timer_cb callback;    // Callback invoked upon expiration
+	void* arg;            // Argument passed to the callback
+} TimerEntry;
+
+// Struct to locate a timer in the heap by its identifier
+typedef struct TimerSlot_s {
+	int id;               // Identifier of the timer last held by the slot
+	int index;            // Position of the timer in the heap, -1 if free
+	int nextFree;         // Next free slot plus one, zero if none
+} TimerSlot;
 
-// Descriptor set used for select()
-static fd_set readfds;
+// Struct to hold a deferred task
+typedef struct TaskEntry_s {
+	struct TaskEntry_s* next;
+	Task_cb callback;
+	void* arg;
+} TaskEntry;
 
-// Maximum descriptor required by select()
-static int max_sfd;
+// Struct to hold the state of a connection attempt racing the addresses of
+// a host
+typedef struct Connector_s {
+	struct Connector_s* next;
+	int id;                              // Identifier returned to the client
+	const char* host;                    // Host for logging only
+	struct addrinfo* addrs;              // Addresses resolved
+	int ownsAddrs;                       // Flag if the addresses are freed along
+	struct addrinfo* nextAddr;           // Address to try next
+	int sockets[MAX_CONNECT_ATTEMPTS];   // Sockets of the pending attempts
+	int numSockets;
+	int sfd;                             // Connected socket
+	int error;                           // Error of the latest failed attempt
+	uint64_t deadline;                   // Time in milliseconds to give up
+	uint64_t nextAttempt;                // Time in milliseconds to try next
+	Connect_cb callback;                 // Callback if driven by the event loop
+	void* arg;                           // Argument passed to the callback
+	int timer;                           // Timer for the next step
+} Connector;
+
+// Struct to hold the state of an event loop
+struct IO_Loop_s {
+	// Table to hold information about open sockets, indexed by descriptor
+	SocketEntry* sockets;
+	int socketCapacity;
+	// Counter to tag the registrations
+	uint32_t generation;
+	// Descriptor of the epoll instance
+	int epollFd;
+	// Binary min-heap of the timers ordered by expiration time
+	TimerEntry* timers;
+	int numTimers;
+	int timerCapacity;
+	// Slots of the timers, as many as the capacity of the heap, and the first
+	// free slot plus one
+	TimerSlot* timerSlots;
+	int freeTimer;
+	// Mailbox of the tasks posted by any thread, a stack pushed without
+	// locking and taken as a whole by the loop
+	TaskEntry* mailbox;
+	// Event descriptor to wake up io_process() for posted tasks
+	int wakeupFd;
+	// Batch buffers shared by the sockets registered with io_multiplexBatch()
+	// and flag if they are passed to a callback
+	IO_Batch* batch;
+	int batchBusy;
+	// Connection attempts driven by the loop
+	Connector* connectors;
+	int lastConnectId;
+};
+
+// Loop of the threads that did not select another one
+static IO_Loop m_defaultLoop = {.epollFd = INVALID_SOCKET, .wakeupFd = INVALID_SOCKET};
+
+// Loop selected by the calling thread
+static __thread IO_Loop* m_loop;
 
 ////////////////////////////////////////////////////////////////////////////////
 // HELPER FUNCTIONS
 ////////////////////////////////////////////////////////////////////////////////
 
+// Returns the loop selected by the calling thread or the default one
+static IO_Loop* currentLoop(void);
+
+// Sets up the epoll instance and the wakeup event of a loop
+static int initLoop(IO_Loop* loop);
+
+// Closes the sockets of a loop and drops its timers, tasks and connection
+// attempts left
+static void deinitLoop(IO_Loop* loop);
+
 // Creates a new entry in the socket table
-SocketEntry* createSocketEntry(int sfd);
+SocketEntry* createSocketEntry(IO_Loop* loop, int sfd);
 
 // Looks up an entry in the socket table
-SocketEntry* lookupSocketEntry(int sfd);
+SocketEntry* lookupSocketEntry(IO_Loop* loop, int sfd);
 
 // Removes an entry from the socket table
-void removeSocketEntry(int sfd);
+void removeSocketEntry(IO_Loop* loop, int sfd);
+
+// Updates the registration with epoll according to the events of interest
+static int updateRegistration(IO_Loop* loop, SocketEntry* entry);
+
+// Invokes the callbacks of the expired timers and returns the time in
+// milliseconds until the next one expires, or -1 if there is none
+static int processTimers(IO_Loop* loop);
+
+// Runs the tasks posted so far in the order they were posted
+static void processTasks(IO_Loop* loop);
+
+// Callback to consume the wakeups of the event descriptor
+static void handleWakeup(int sfd, int events, void* arg);
+
+// Passes the pending datagrams of the socket to the callback in batches
+static void receiveBatches(IO_Loop* loop, int sfd, SocketBatch_cb callback);
+
+// Adjusts the receive time to the kernel timestamp passed along if any
+static void applyTimestamp(struct msghdr* msg, uint64_t* time);
+
+// Restore the heap property upwards or downwards from the specified index
+static void siftUp(IO_Loop* loop, int index);
+static void siftDown(IO_Loop* loop, int index);
+
+// Removes the timer at the specified index from the heap and frees its slot
+static void removeTimer(IO_Loop* loop, int index);
+
+// Resolves the host and starts the first connection attempt
+static Connector* createConnector(const char* host, const char* service,
+	int timeout, Connect_cb callback, void* arg);
+
+// Starts the first connection attempt on the specified addresses
+static Connector* initConnector(const char* host, struct addrinfo* addrs,
+	int timeout, Connect_cb callback, void* arg);
+
+// Returns the socket if the attempt of the connector is over already, or else
+// lets the event loop complete it and sets *id
+static int startConnector(Connector* c, int* id);
+
+// Resolves the host to all its addresses, ordered for the connection attempts
+static struct addrinfo* resolveAll(const char* host, const char* service);
+
+// Closes the pending attempts and frees the connector
+static void freeConnector(Connector* c);
+
+// Orders the addresses to alternate between the address families
+static struct addrinfo* interleaveAddresses(struct addrinfo* ai);
+
+// Starts attempts on the next addresses until one is pending or connected
+static void startAttempt(Connector* c);
+
+// Checks the outcome of the specified pending attempt
+static void checkAttempt(Connector* c, int index);
+
+// Starts the next attempt if due and returns the time in milliseconds to wait
+// for the pending ones, or -1 if the attempt is over
+static int stepConnector(Connector* c);
+
+// Callbacks to drive the connection attempts by the event loop
+static void handleConnectEvent(int sfd, int events, void* arg);
+static void handleConnectTimer(int id, void* arg);
+static void updateConnector(Connector* c);
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -107,33 +310,105 @@ void removeSocketEntry(int sfd);
 
 void io_init(void)
 {
-	FD_ZERO(&readfds);
-	max_sfd = 0;
+	initLoop(&m_defaultLoop);
+}
+
+void io_deinit(void)
+{
+	deinitLoop(&m_defaultLoop);
+}
 
-	// Initialize socket table
-	for (int i = 0; i < SOCKETTABLE_SIZE; i++) {
-		socketTable[i].sfd = INVALID_SOCKET;
+IO_Loop* io_createLoop(void)
+{
+	IO_Loop* loop = calloc(1, sizeof(IO_Loop));
+	if (!loop) {
+		LOG(0, "Failed to allocate loop\n");
+		return NULL;
+	}
+	loop->epollFd  = INVALID_SOCKET;
+	loop->wakeupFd = INVALID_SOCKET;
+	if (!initLoop(loop)) {
+		deinitLoop(loop);
+		free(loop);
+		return NULL;
 	}
+	return loop;
 }
 
-void io_deinit(void)
+void io_freeLoop(IO_Loop* loop)
 {
-	FD_ZERO(&readfds);
-	max_sfd = 0;
-	
-	// Close all remaining sockets
-	for (int i = 0; i < SOCKETTABLE_SIZE; i++) {
-		io_closeSocket(&socketTable[i].sfd);
+	if (loop && loop != &m_defaultLoop) {
+		deinitLoop(loop);
+		free(loop);
 	}
 }
 
-int io_createRawSocket(void)
+void io_setLoop(IO_Loop* loop)
+{
+	m_loop = loop;
+}
+
+IO_Loop* io_getLoop(void)
+{
+	return currentLoop();
+}
+
+int io_createRawSocket(const char* interface, int port)
 {
-	int sfd = socket(AF_INET, SOCK_RAW, IPPROTO_UDP);
+	// Receive the IP packets without link-layer header
+	int sfd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, htons(ETH_P_IP));
 	if (sfd == INVALID_SOCKET) {
 		LOG(0, "Failed to initialize socket: %s\n", strerror(errno));
 		return INVALID_SOCKET;
 	}
+
+	// Let the kernel drop everything but the TCP segments from the port:
+	// ip[9] == tcp && !(ip[6:2] & 0x1fff) && tcp[0:2] == port
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, 9),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_TCP, 0, 5),
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,  0x1fff, 3, 0),
+		BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, 0),
+		BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   port, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffff)
+	};
+	struct sock_fprog filter = {sizeof(code) / sizeof(code[0]), code};
+	if (setsockopt(sfd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == -1) {
+		LOG(0, "Failed to attach filter: %s\n", strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	// Restrict to the specified interface
+	int ifindex = 0;
+	if (interface) {
+		ifindex = if_nametoindex(interface);
+		if (!ifindex) {
+			LOG(0, "Unknown interface '%s'\n", interface);
+			close(sfd);
+			return INVALID_SOCKET;
+		}
+		struct sockaddr_ll sll = {0};
+		sll.sll_family   = AF_PACKET;
+		sll.sll_protocol = htons(ETH_P_IP);
+		sll.sll_ifindex  = ifindex;
+		if (bind(sfd, (struct sockaddr*) &sll, sizeof(sll)) == -1) {
+			LOG(0, "Failed to bind socket to %s: %s\n", interface, strerror(errno));
+			close(sfd);
+			return INVALID_SOCKET;
+		}
+
+		// Also receive the traffic of other hosts, e.g. on a mirror port
+		struct packet_mreq mreq = {0};
+		mreq.mr_ifindex = ifindex;
+		mreq.mr_type    = PACKET_MR_PROMISC;
+		if (setsockopt(sfd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+			LOG(1, "Failed to enable promiscuous mode on %s: %s\n", interface, strerror(errno));
+		}
+	}
 	
 	return sfd;
 }
@@ -217,15 +492,144 @@ int io_createClientSocket(const char* host, const char* service, int timeout)
 	
 	// Initialize timeout structure
 	struct timeval to = {0};
-  to.tv_sec  = timeout / 1000;           // Seconds
-  to.tv_usec = (timeout % 1000) * 1000;  // Microseconds
+	to.tv_sec  = timeout / 1000;           // Seconds
+	to.tv_usec = (timeout % 1000) * 1000;  // Microseconds
+
+	Connector* c = createConnector(host, service, timeout, NULL, NULL);
+	if (!c) {
+		return INVALID_SOCKET;
+	}
+	
+	// Wait for the pending attempts, starting further ones in between
+	int wait;
+	while ((wait = stepConnector(c)) >= 0) {
+		struct pollfd fds[MAX_CONNECT_ATTEMPTS];
+		int numFds = c->numSockets;
+		for (int i = 0; i < numFds; i++) {
+			fds[i].fd = c->sockets[i];
+			fds[i].events = POLLOUT;
+			fds[i].revents = 0;
+		}
+		int numReady = poll(fds, numFds, wait);
+		if (numReady == -1 && errno != EINTR) {
+			LOG(0, "Failed to poll sockets: %s\n", strerror(errno));
+			break;
+		}
+		
+		// Check the completed attempts, which may reorder the pending ones
+		for (int i = 0; i < numFds && numReady > 0 && c->sfd == INVALID_SOCKET; i++) {
+			if (fds[i].revents) {
+				for (int j = 0; j < c->numSockets; j++) {
+					if (c->sockets[j] == fds[i].fd) {
+						checkAttempt(c, j);
+						break;
+					}
+				}
+			}
+		}
+	}
+	
+	int sfd = c->sfd;
+	c->sfd = INVALID_SOCKET;
+	freeConnector(c);
+	if (sfd == INVALID_SOCKET) {
+		return INVALID_SOCKET;
+	}
+	
+	// Switch back to blocking mode and set receive timeout
+	int flags = fcntl(sfd, F_GETFL);
+	if (flags == -1 || fcntl(sfd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+		LOG(0, "Failed to make socket blocking: %s\n", strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+	if (timeout >= 0) {
+		if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to)) == -1) {
+			LOG(0, "Failed to set timeout: %s\n", strerror(errno));
+		}
+	}
+	
+	return sfd;
+}
+
+int io_connect(const char* host, const char* service, int timeout,
+	Connect_cb callback, void* arg, int* id)
+{
+	*id = 0;
+	if (!host || !service || !callback) {
+		LOG(0, "Invalid connection request\n");
+		return INVALID_SOCKET;
+	}
+	
+	Connector* c = createConnector(host, service, timeout, callback, arg);
+	if (!c) {
+		return INVALID_SOCKET;
+	}
+	return startConnector(c, id);
+}
+
+int io_connectTo(const struct addrinfo* addrs, const char* host, int timeout,
+	Connect_cb callback, void* arg, int* id)
+{
+	*id = 0;
+	if (!addrs || !host || !callback) {
+		LOG(0, "Invalid connection request\n");
+		return INVALID_SOCKET;
+	}
+
+	// The addresses are only read, and released by the caller
+	Connector* c = initConnector(host, (struct addrinfo*) addrs, timeout, callback, arg);
+	if (!c) {
+		return INVALID_SOCKET;
+	}
+	return startConnector(c, id);
+}
+
+int startConnector(Connector* c, int* id)
+{
+	// Return the socket if connected immediately, e.g. on loopback
+	if (c->sfd != INVALID_SOCKET || stepConnector(c) < 0) {
+		int sfd = c->sfd;
+		c->sfd = INVALID_SOCKET;
+		freeConnector(c);
+		return sfd;
+	}
+	
+	// Let the event loop complete the attempt
+	IO_Loop* loop = currentLoop();
+	loop->lastConnectId = loop->lastConnectId < INT_MAX ? loop->lastConnectId + 1 : 1;
+	c->id = loop->lastConnectId;
+	c->next = loop->connectors;
+	loop->connectors = c;
+	for (int i = 0; i < c->numSockets; i++) {
+		io_multiplex(c->sockets[i], c->host, IO_WRITE, handleConnectEvent, c);
+	}
+	updateConnector(c);
+	
+	*id = c->id;
+	return INVALID_SOCKET;
+}
+
+int io_cancelConnect(int id)
+{
+	for (Connector** it = &currentLoop()->connectors; *it; it = &(*it)->next) {
+		if ((*it)->id == id) {
+			Connector* c = *it;
+			*it = c->next;
+			freeConnector(c);
+			return 1; // Success
+		}
+	}
+	return 0;
+}
 
+int io_resolve(const char* host, const char* service, 
+	struct sockaddr_storage* sa, socklen_t* len)
+{
 	// Specify address information details
 	struct addrinfo hints = {0};
 	hints.ai_family   = AF_UNSPEC;     // Allow IPv4 or IPv6
 	hints.ai_socktype = SOCK_STREAM;   // TCP Socket
-	hints.ai_flags    = 0;
-	hints.ai_protocol = 0;             // Any protocol
 	
 	// Get address information according to host/service	
 	struct addrinfo* ai = NULL;
@@ -233,59 +637,224 @@ int io_createClientSocket(const char* host, const char* service, int timeout)
 	if (error) {
 		LOG(0, "getaddrinfo failed: %s\n", 
 			error != EAI_SYSTEM ? gai_strerror(error) : strerror(errno));
-		return INVALID_SOCKET;
+		return 0;
 	}
 	
-	// Examine results
-	int sfd = INVALID_SOCKET;
-	for (struct addrinfo* it = ai; it; it = it->ai_next) {
-
-		// Try to create socket with the current address details
-		sfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
-		if (sfd == INVALID_SOCKET) {
-			if (it->ai_next) {
-				continue; // Try the next entry
-			} else {
-				LOG(0, "Failed to create socket: %s\n", strerror(errno));
-				break;
-			}
-		}
-		
-		// Set receive timeout
-		if (timeout >= 0) {
-			if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof(to)) == -1) {
-				LOG(0, "Failed to set timeout: %s\n", strerror(errno));
-				break;
-			}
-		}
-		
-		// Try to connect with the current address details
-		if (connect(sfd, it->ai_addr, it->ai_addrlen) == -1) {
-			close(sfd);
-			sfd = INVALID_SOCKET;
-			if (it->ai_next) {
-				continue; // Try the next entry
-			} else {
-				LOG(0, "Failed to connect to %s:%s: %s\n",
-					host, service, strerror(errno));
-				break;
-			}
-		}
-		
-		break; // Success
+	// Take the first result
+	int success = 0;
+	if (ai && ai->ai_addrlen <= sizeof(*sa)) {
+		memcpy(sa, ai->ai_addr, ai->ai_addrlen);
+		*len = ai->ai_addrlen;
+		success = 1;
 	}
 	
 	// Cleanup
 	freeaddrinfo(ai);
 	
+	return success;
+}
+
+struct addrinfo* io_resolveAll(const char* host, const char* service)
+{
+	if (!host || !service) {
+		LOG(0, "Host or service not specified\n");
+		return NULL;
+	}
+	return resolveAll(host, service);
+}
+
+void io_freeAddresses(struct addrinfo* addrs)
+{
+	if (addrs) {
+		freeaddrinfo(addrs);
+	}
+}
+
+int io_createClientSocketAsync(const struct sockaddr* sa, socklen_t len)
+{
+	// Create non-blocking TCP socket
+	int sfd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sfd == INVALID_SOCKET) {
+		LOG(0, "Failed to create socket: %s\n", strerror(errno));
+		return INVALID_SOCKET;
+	}
+	
+	// Initiate connection
+	if (connect(sfd, sa, len) == -1 && errno != EINPROGRESS) {
+		LOG(1, "Failed to connect: %s\n", strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+	
+	return sfd;
+}
+
+int io_createServerSocket(int port)
+{
+	// Create non-blocking TCP socket
+	int sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sfd == INVALID_SOCKET) {
+		LOG(0, "Failed to create socket: %s\n", strerror(errno));
+		return INVALID_SOCKET;
+	}
+
+	// Allow to restart right away
+	int on = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+		LOG(0, "Failed to set SO_REUSEADDR: %s\n", strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	// Bind socket to all local addresses
+	struct sockaddr_in sa = {0};
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sfd, (struct sockaddr*) &sa, sizeof(sa)) == -1) {
+		LOG(0, "Failed to bind socket to port %d: %s\n", port, strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	// Wait for connections
+	if (listen(sfd, SOMAXCONN) == -1) {
+		LOG(0, "Failed to listen: %s\n", strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
 	return sfd;
 }
 
+int io_getSocketError(int sfd)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(sfd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+		return errno;
+	}
+	return error;
+}
+
+void io_enableTimestamps(int sfd)
+{
+	// Not supported by all platforms, so fall back silently
+	int on = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1) {
+		LOG(3, "Failed to set SO_TIMESTAMPNS: %s\n", strerror(errno));
+	}
+}
+
+ssize_t io_recvTimestamp(int sfd, void* buffer, size_t size, int flags, uint64_t* time)
+{
+	return io_recvFromTimestamp(sfd, buffer, size, flags, NULL, time);
+}
+
+ssize_t io_recvFromTimestamp(int sfd, void* buffer, size_t size, int flags,
+	struct sockaddr_in* from, uint64_t* time)
+{
+	struct iovec iov = {buffer, size};
+	ControlBuffer control;
+	struct msghdr msg = {0};
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if (from) {
+		msg.msg_name    = from;
+		msg.msg_namelen = sizeof(*from);
+	}
+
+	ssize_t ret = recvmsg(sfd, &msg, flags);
+	*time = timer_nowUs();
+	if (ret <= 0) {
+		return ret;
+	}
+
+	applyTimestamp(&msg, time);
+	return ret;
+}
+
+IO_Batch* io_createBatch(int capacity, size_t size)
+{
+	IO_Batch* batch = calloc(1, sizeof(IO_Batch));
+	if (!batch) {
+		LOG(0, "Failed to allocate batch\n");
+		return NULL;
+	}
+	batch->capacity  = capacity;
+	batch->size      = size;
+	batch->datagrams = calloc(capacity, sizeof(IO_Datagram));
+	batch->msgs      = calloc(capacity, sizeof(struct mmsghdr));
+	batch->iovs      = calloc(capacity, sizeof(struct iovec));
+	batch->controls  = calloc(capacity, sizeof(ControlBuffer));
+	batch->buffers   = malloc(capacity * size);
+	if (!batch->datagrams || !batch->msgs || !batch->iovs || !batch->controls ||
+		(size && !batch->buffers))
+	{
+		LOG(0, "Failed to allocate batch buffers\n");
+		io_freeBatch(batch);
+		return NULL;
+	}
+
+	// Link the buffers once, recvmmsg() only updates the lengths
+	for (int i = 0; i < capacity; i++) {
+		batch->datagrams[i].data = size ? batch->buffers + i * size : NULL;
+		batch->iovs[i].iov_base  = batch->datagrams[i].data;
+		batch->iovs[i].iov_len   = size;
+		struct msghdr* msg = &batch->msgs[i].msg_hdr;
+		msg->msg_name    = &batch->datagrams[i].from;
+		msg->msg_iov     = &batch->iovs[i];
+		msg->msg_iovlen  = 1;
+		msg->msg_control = batch->controls[i].buf;
+	}
+	return batch;
+}
+
+void io_freeBatch(IO_Batch* batch)
+{
+	if (batch) {
+		free(batch->datagrams);
+		free(batch->msgs);
+		free(batch->iovs);
+		free(batch->controls);
+		free(batch->buffers);
+		free(batch);
+	}
+}
+
+int io_recvBatch(int sfd, IO_Batch* batch, const IO_Datagram** datagrams)
+{
+	// Reset the lengths returned by the previous call
+	for (int i = 0; i < batch->capacity; i++) {
+		batch->msgs[i].msg_hdr.msg_namelen    = sizeof(struct sockaddr_in);
+		batch->msgs[i].msg_hdr.msg_controllen = sizeof(ControlBuffer);
+	}
+
+	int count = recvmmsg(sfd, batch->msgs, batch->capacity, MSG_DONTWAIT, NULL);
+	uint64_t now = timer_nowUs();
+	if (count == -1) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		IO_Datagram* datagram = &batch->datagrams[i];
+		datagram->size = batch->msgs[i].msg_len < batch->size ?
+			batch->msgs[i].msg_len : batch->size;
+		datagram->time = now;
+		applyTimestamp(&batch->msgs[i].msg_hdr, &datagram->time);
+	}
+	*datagrams = batch->datagrams;
+	return count;
+}
+
 void io_closeSocket(int* sfd)
 {
 	if (sfd && *sfd != INVALID_SOCKET) {
-		close(*sfd);
-		removeSocketEntry(*sfd);
+		int fd = *sfd; // May point into the socket table
+		removeSocketEntry(currentLoop(), fd);
+		close(fd);
 		*sfd = INVALID_SOCKET;
 	}
 }
@@ -331,9 +900,10 @@ int io_multiplexRead(int sfd, const char* name, SocketReady_cb callback)
 		LOG(0, "Callback not specified for %d\n", sfd);
 		return 0;
 	}
+	IO_Loop* loop = currentLoop();
 
 	// Create new socket entry
-	SocketEntry* entry = createSocketEntry(sfd);
+	SocketEntry* entry = createSocketEntry(loop, sfd);
 	if (!entry) {
 		LOG(0, "Failed to create socket entry\n");
 		return 0;
@@ -341,86 +911,854 @@ int io_multiplexRead(int sfd, const char* name, SocketReady_cb callback)
 	
 	// Store data
 	entry->name = name;
-	entry->callback = callback;
+	entry->events = IO_READ;
+	entry->ready = callback;
+	entry->callback = NULL;
+	entry->batchReady = NULL;
+	entry->arg = NULL;
 	
-	// Add descriptor to set
-	FD_SET(sfd, &readfds);
-	if (max_sfd < sfd) {
-		max_sfd = sfd;
+	// Register descriptor with epoll
+	if (!updateRegistration(loop, entry)) {
+		removeSocketEntry(loop, sfd);
+		return 0;
 	}
 	
 	return 1; // Success
 }
 
-int io_process(void)
+int io_multiplexBatch(int sfd, const char* name, size_t size, SocketBatch_cb callback)
 {
-	// Copy working set (will be modified by select() )
-	fd_set ready_readfds = readfds;
+	if (!callback) {
+		LOG(0, "Callback not specified for %d\n", sfd);
+		return 0;
+	}
+	IO_Loop* loop = currentLoop();
 
-	// Perform synchronous I/O multiplexing
-	int numReady = select(max_sfd+1, &ready_readfds, NULL, NULL, NULL);
-	if (numReady == -1) {
-  	LOG(0, "Failed to select socket: %s\n", strerror(errno));
-  	return 0;
+	// Grow the shared batch buffers if required
+	if (!loop->batch || loop->batch->size < size) {
+		if (loop->batchBusy) {
+			LOG(0, "Failed to grow batch buffers in use\n");
+			return 0;
+		}
+		IO_Batch* batch = io_createBatch(IO_BATCH_SIZE, size);
+		if (!batch) {
+			return 0;
+		}
+		io_freeBatch(loop->batch);
+		loop->batch = batch;
+	}
+
+	// Create new socket entry
+	SocketEntry* entry = createSocketEntry(loop, sfd);
+	if (!entry) {
+		LOG(0, "Failed to create socket entry\n");
+		return 0;
 	}
 	
-	// Examine results
-	for (int sfd = 0; sfd <= max_sfd; ++sfd) {
+	// Store data
+	entry->name = name;
+	entry->events = IO_READ;
+	entry->ready = NULL;
+	entry->callback = NULL;
+	entry->batchReady = callback;
+	entry->arg = NULL;
 	
-		// Check if socket is ready
-		if (FD_ISSET(sfd, &ready_readfds)) {
-		
-			// Lookup the socket entry
-			const SocketEntry* entry = lookupSocketEntry(sfd);
-			if (!entry) {
-				LOG(1, "Socket entry missing for %d\n", sfd);
-				continue;
-			}
-
-			LOG(4, "%s: Data received\n", entry->name);
-			
-			// Invoke callback
-			entry->callback(sfd);
-		}
+	// Register descriptor with epoll
+	if (!updateRegistration(loop, entry)) {
+		removeSocketEntry(loop, sfd);
+		return 0;
 	}
 	
 	return 1; // Success
 }
 
-void io_processLoop(void)
+int io_multiplex(int sfd, const char* name, int events, 
+	SocketEvent_cb callback, void* arg)
 {
-	while (io_process()) continue;
-}
+	if (!callback) {
+		LOG(0, "Callback not specified for %d\n", sfd);
+		return 0;
+	}
+	IO_Loop* loop = currentLoop();
 
-SocketEntry* lookupSocketEntry(int sfd)
-{
-	for (int i = 0; i < SOCKETTABLE_SIZE; i++) {
-		if (socketTable[i].sfd == sfd) {
-			return &socketTable[i];
+	// Reuse existing entry when updating the events of interest
+	SocketEntry* entry = lookupSocketEntry(loop, sfd);
+	if (!entry) {
+		entry = createSocketEntry(loop, sfd);
+		if (!entry) {
+			LOG(0, "Failed to create socket entry\n");
+			return 0;
 		}
 	}
-	return NULL;
+	
+	// Store data
+	entry->name = name;
+	entry->events = events;
+	entry->ready = NULL;
+	entry->callback = callback;
+	entry->batchReady = NULL;
+	entry->arg = arg;
+	
+	// Register descriptor with epoll
+	if (!updateRegistration(loop, entry)) {
+		removeSocketEntry(loop, sfd);
+		return 0;
+	}
+	
+	return 1; // Success
 }
 
-SocketEntry* createSocketEntry(int sfd)
+void io_unregister(int sfd)
 {
-	SocketEntry* entry = lookupSocketEntry(INVALID_SOCKET);
-	if (entry) {
-		entry->sfd = sfd;
-		return entry;
+	removeSocketEntry(currentLoop(), sfd);
+}
+
+int io_process(void)
+{
+	return io_processTimeout(-1);
+}
+
+int io_processTimeout(int timeout)
+{
+	IO_Loop* loop = currentLoop();
+
+	// Wait no longer than until the next timer expires
+	int next = processTimers(loop);
+	if (next >= 0 && (timeout < 0 || next < timeout)) {
+		timeout = next;
+	}
+
+	// Perform synchronous I/O multiplexing
+	struct epoll_event ready[MAX_EVENTS];
+	int numReady = epoll_wait(loop->epollFd, ready, MAX_EVENTS, timeout);
+	if (numReady == -1) {
+		if (errno == EINTR) {
+			return 1; // Interrupted by a signal, nothing to do
+		}
+		LOG(0, "Failed to wait for socket events: %s\n", strerror(errno));
+		return 0;
+	}
+	
+	// Examine the ready sockets only
+	for (int i = 0; i < numReady; ++i) {
+		int sfd = (int)(ready[i].data.u64 & 0xffffffff);
+		uint32_t generation = ready[i].data.u64 >> 32;
+		
+		// Lookup the socket entry
+		const SocketEntry* entry = lookupSocketEntry(loop, sfd);
+		if (!entry || entry->generation != generation) {
+			// Unregistered by a previous callback in the meantime
+			LOG(4, "Socket entry missing for %d\n", sfd);
+			continue;
+		}
+		
+		// Errors and hangups are reported to readers and writers alike
+		int events = 0;
+		if (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			events |= IO_READ;
+		}
+		if (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+			events |= IO_WRITE;
+		}
+		
+		// Ignore events no longer of interest
+		events &= entry->events;
+		if (!events) {
+			continue;
+		}
+
+		LOG(4, "%s: Socket ready\n", entry->name);
+		
+		// Invoke callback
+		if (entry->callback) {
+			entry->callback(sfd, events, entry->arg);
+		} else if (entry->batchReady) {
+			receiveBatches(loop, sfd, entry->batchReady);
+		} else {
+			entry->ready(sfd);
+		}
+	}
+
+	// Run the work that became due meanwhile
+	processTasks(loop);
+	processTimers(loop);
+	
+	return 1; // Success
+}
+
+int io_addTimer(int delay, int period, Timer_cb callback, void* arg)
+{
+	if (!callback || delay < 0 || period < 0) {
+		LOG(0, "Invalid timer\n");
+		return 0;
+	}
+	IO_Loop* loop = currentLoop();
+
+	// Grow heap and slots if required
+	if (loop->numTimers == loop->timerCapacity) {
+		if (loop->timerCapacity == MAX_TIMERS) {
+			LOG(0, "Too many timers\n");
+			return 0;
+		}
+		int capacity = loop->timerCapacity ? 2 * loop->timerCapacity : TIMERHEAP_SIZE;
+		TimerEntry* timers = realloc(loop->timers, capacity * sizeof(TimerEntry));
+		if (!timers) {
+			LOG(0, "Failed to grow timer heap\n");
+			return 0;
+		}
+		loop->timers = timers;
+		TimerSlot* slots = realloc(loop->timerSlots, capacity * sizeof(TimerSlot));
+		if (!slots) {
+			LOG(0, "Failed to grow timer heap\n");
+			return 0;
+		}
+		for (int i = capacity - 1; i >= loop->timerCapacity; i--) {
+			slots[i].id       = 0;
+			slots[i].index    = -1;
+			slots[i].nextFree = loop->freeTimer;
+			loop->freeTimer   = i + 1;
+		}
+		loop->timerSlots = slots;
+		loop->timerCapacity = capacity;
+	}
+
+	// Identifiers are positive and not reused for a long time, as the slots
+	// count their generations
+	int slot = loop->freeTimer - 1;
+	TimerSlot* s = &loop->timerSlots[slot];
+	loop->freeTimer = s->nextFree;
+	s->id = ((s->id >> TIMER_SLOT_BITS) % TIMER_GENERATIONS + 1) << TIMER_SLOT_BITS | slot;
+
+	TimerEntry* timer = &loop->timers[loop->numTimers];
+	timer->due      = timer_now() + delay;
+	timer->period   = period;
+	timer->id       = s->id;
+	timer->callback = callback;
+	timer->arg      = arg;
+	siftUp(loop, loop->numTimers++);
+
+	return s->id;
+}
+
+int io_cancelTimer(int id)
+{
+	IO_Loop* loop = currentLoop();
+
+	// Locate the timer by the slot in its identifier
+	int slot = id & TIMER_SLOT_MASK;
+	if (id <= 0 || slot >= loop->timerCapacity ||
+		loop->timerSlots[slot].id != id || loop->timerSlots[slot].index < 0)
+	{
+		return 0;
+	}
+	removeTimer(loop, loop->timerSlots[slot].index);
+	return 1; // Success
+}
+
+int io_defer(Task_cb callback, void* arg)
+{
+	return io_post(currentLoop(), callback, arg);
+}
+
+int io_post(IO_Loop* loop, Task_cb callback, void* arg)
+{
+	TaskEntry* task = malloc(sizeof(TaskEntry));
+	if (!task) {
+		LOG(0, "Failed to allocate task\n");
+		return 0;
+	}
+	task->callback = callback;
+	task->arg      = arg;
+
+	// Push onto the mailbox, the posting threads only race each other
+	TaskEntry* head = __atomic_load_n(&loop->mailbox, __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&loop->mailbox, &head, task, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	// Wake up epoll_wait(), unless the wakeup for the tasks already in the
+	// mailbox is pending
+	uint64_t one = 1;
+	if (!head && loop->wakeupFd != INVALID_SOCKET &&
+		write(loop->wakeupFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+	{
+		LOG(1, "Failed to signal wakeup event: %s\n", strerror(errno));
+	}
+	return 1; // Success
+}
+
+int processTimers(IO_Loop* loop)
+{
+	uint64_t now = timer_now();
+	while (loop->numTimers > 0 && loop->timers[0].due <= now) {
+
+		// Reschedule periodic timers on their grid before the callback,
+		// so that it may cancel them
+		TimerEntry timer = loop->timers[0];
+		if (timer.period > 0) {
+			uint64_t missed = (now - timer.due) / timer.period;
+			loop->timers[0].due += (missed + 1) * timer.period;
+			siftDown(loop, 0);
+		} else {
+			removeTimer(loop, 0);
+		}
+
+		timer.callback(timer.id, timer.arg);
+		now = timer_now();
+	}
+
+	if (loop->numTimers == 0) {
+		return -1;
+	}
+	return (int)(loop->timers[0].due - now);
+}
+
+void processTasks(IO_Loop* loop)
+{
+	// Take the tasks posted so far, those posted by them run next time
+	TaskEntry* head = __atomic_exchange_n(&loop->mailbox, NULL, __ATOMIC_ACQUIRE);
+
+	// Restore the order they were posted in
+	TaskEntry* task = NULL;
+	while (head) {
+		TaskEntry* next = head->next;
+		head->next = task;
+		task = head;
+		head = next;
+	}
+
+	while (task) {
+		TaskEntry* next = task->next;
+		task->callback(task->arg);
+		free(task);
+		task = next;
+	}
+}
+
+void handleWakeup(int sfd, int events, void* arg)
+{
+	uint64_t count;
+	if (read(sfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		LOG(1, "Failed to consume wakeup event: %s\n", strerror(errno));
+	}
+}
+
+void receiveBatches(IO_Loop* loop, int sfd, SocketBatch_cb callback)
+{
+	// Drain the socket, a partial batch means nothing is left
+	const IO_Datagram* datagrams = NULL;
+	int count;
+	loop->batchBusy = 1;
+	while ((count = io_recvBatch(sfd, loop->batch, &datagrams)) > 0) {
+		callback(sfd, datagrams, count);
+
+		// Stop if unregistered by the callback
+		const SocketEntry* entry = lookupSocketEntry(loop, sfd);
+		if (count < loop->batch->capacity || !entry || entry->batchReady != callback) {
+			break;
+		}
+	}
+	loop->batchBusy = 0;
+
+	if (count == -1 && errno != EINTR) {
+		LOG(1, "Failed to receive from socket: %s\n", strerror(errno));
+	}
+}
+
+void applyTimestamp(struct msghdr* msg, uint64_t* time)
+{
+	// Use the time the kernel received the data if available, related to
+	// the monotonic clock by its age
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts, now;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			if (clock_gettime(CLOCK_REALTIME, &now) == 0) {
+				int64_t age = ((int64_t)now.tv_sec - ts.tv_sec) * 1000000 +
+					(now.tv_nsec - ts.tv_nsec) / 1000;
+				if (age > 0 && (uint64_t)age < *time) {
+					*time -= age;
+				}
+			}
+		}
+	}
+}
+
+void siftUp(IO_Loop* loop, int index)
+{
+	TimerEntry timer = loop->timers[index];
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (loop->timers[parent].due <= timer.due) {
+			break;
+		}
+		loop->timers[index] = loop->timers[parent];
+		loop->timerSlots[loop->timers[index].id & TIMER_SLOT_MASK].index = index;
+		index = parent;
+	}
+	loop->timers[index] = timer;
+	loop->timerSlots[timer.id & TIMER_SLOT_MASK].index = index;
+}
+
+void siftDown(IO_Loop* loop, int index)
+{
+	TimerEntry timer = loop->timers[index];
+	while (1) {
+		int child = 2 * index + 1;
+		if (child >= loop->numTimers) {
+			break;
+		}
+		if (child + 1 < loop->numTimers && loop->timers[child + 1].due < loop->timers[child].due) {
+			child++;
+		}
+		if (timer.due <= loop->timers[child].due) {
+			break;
+		}
+		loop->timers[index] = loop->timers[child];
+		loop->timerSlots[loop->timers[index].id & TIMER_SLOT_MASK].index = index;
+		index = child;
+	}
+	loop->timers[index] = timer;
+	loop->timerSlots[timer.id & TIMER_SLOT_MASK].index = index;
+}
+
+void removeTimer(IO_Loop* loop, int index)
+{
+	// Free the slot for the next timer
+	int slot = loop->timers[index].id & TIMER_SLOT_MASK;
+	loop->timerSlots[slot].index    = -1;
+	loop->timerSlots[slot].nextFree = loop->freeTimer;
+	loop->freeTimer = slot + 1;
+
+	// Fill the gap with the last timer
+	loop->numTimers--;
+	if (index < loop->numTimers) {
+		loop->timers[index] = loop->timers[loop->numTimers];
+		siftUp(loop, index);
+		siftDown(loop, index);
+	}
+}
+
+Connector* createConnector(const char* host, const char* service,
+	int timeout, Connect_cb callback, void* arg)
+{
+	struct addrinfo* addrs = resolveAll(host, service);
+	if (!addrs) {
+		return NULL;
+	}
+	Connector* c = initConnector(host, addrs, timeout, callback, arg);
+	if (!c) {
+		freeaddrinfo(addrs);
+		return NULL;
+	}
+	c->ownsAddrs = 1;
+	return c;
+}
+
+struct addrinfo* resolveAll(const char* host, const char* service)
+{
+	// Specify address information details
+	struct addrinfo hints = {0};
+	hints.ai_family   = AF_UNSPEC;     // Allow IPv4 or IPv6
+	hints.ai_socktype = SOCK_STREAM;   // TCP Socket
+	
+	// Get address information according to host/service	
+	struct addrinfo* ai = NULL;
+	int error = getaddrinfo(host, service, &hints, &ai);
+	if (error) {
+		LOG(0, "getaddrinfo failed: %s\n", 
+			error != EAI_SYSTEM ? gai_strerror(error) : strerror(errno));
+		return NULL;
+	}
+	return interleaveAddresses(ai);
+}
+
+Connector* initConnector(const char* host, struct addrinfo* addrs,
+	int timeout, Connect_cb callback, void* arg)
+{
+	Connector* c = calloc(1, sizeof(Connector));
+	if (!c) {
+		LOG(0, "Failed to allocate connector\n");
+		return NULL;
+	}
+	c->host     = host;
+	c->addrs    = addrs;
+	c->nextAddr = c->addrs;
+	c->sfd      = INVALID_SOCKET;
+	c->callback = callback;
+	c->arg      = arg;
+	
+	uint64_t now = timer_now();
+	c->deadline = timeout >= 0 ? now + timeout : UINT64_MAX;
+	startAttempt(c);
+	return c;
+}
+
+void freeConnector(Connector* c)
+{
+	// Sockets are registered with the event loop once the connector has an ID
+	for (int i = 0; i < c->numSockets; i++) {
+		if (c->id) {
+			io_closeSocket(&c->sockets[i]);
+		} else {
+			close(c->sockets[i]);
+		}
+	}
+	if (c->sfd != INVALID_SOCKET) {
+		close(c->sfd);
+	}
+	if (c->timer) {
+		io_cancelTimer(c->timer);
+	}
+	if (c->ownsAddrs) {
+		freeaddrinfo(c->addrs);
+	}
+	free(c);
+}
+
+struct addrinfo* interleaveAddresses(struct addrinfo* ai)
+{
+	// Split into the addresses of the preferred family and the others,
+	// keeping the order of getaddrinfo()
+	struct addrinfo* preferred = NULL;
+	struct addrinfo* others = NULL;
+	struct addrinfo** preferredTail = &preferred;
+	struct addrinfo** othersTail = &others;
+	for (struct addrinfo* it = ai; it; ) {
+		struct addrinfo* next = it->ai_next;
+		it->ai_next = NULL;
+		if (it->ai_family == ai->ai_family) {
+			*preferredTail = it;
+			preferredTail = &it->ai_next;
+		} else {
+			*othersTail = it;
+			othersTail = &it->ai_next;
+		}
+		it = next;
+	}
+	
+	// Merge them alternately
+	struct addrinfo* result = NULL;
+	struct addrinfo** tail = &result;
+	while (preferred || others) {
+		if (preferred) {
+			*tail = preferred;
+			tail = &preferred->ai_next;
+			preferred = preferred->ai_next;
+		}
+		if (others) {
+			*tail = others;
+			tail = &others->ai_next;
+			others = others->ai_next;
+		}
+	}
+	return result;
+}
+
+void startAttempt(Connector* c)
+{
+	while (c->nextAddr && c->numSockets < MAX_CONNECT_ATTEMPTS) {
+		struct addrinfo* it = c->nextAddr;
+		c->nextAddr = it->ai_next;
+		
+		// Create non-blocking socket with the current address details
+		int sfd = socket(it->ai_family, it->ai_socktype | SOCK_NONBLOCK, it->ai_protocol);
+		if (sfd == INVALID_SOCKET) {
+			c->error = errno;
+			continue; // Try the next entry
+		}
+		
+		// Initiate connection
+		if (connect(sfd, it->ai_addr, it->ai_addrlen) == 0) {
+			c->sfd = sfd;
+			return; // Success
+		}
+		if (errno != EINPROGRESS) {
+			c->error = errno;
+			close(sfd);
+			continue; // Try the next entry
+		}
+		if (c->id && !io_multiplex(sfd, c->host, IO_WRITE, handleConnectEvent, c)) {
+			close(sfd);
+			continue; // Try the next entry
+		}
+		
+		// Give the attempt a head start before racing the next address
+		c->sockets[c->numSockets++] = sfd;
+		c->nextAttempt = timer_now() + CONNECT_ATTEMPT_DELAY;
+		return;
+	}
+}
+
+void checkAttempt(Connector* c, int index)
+{
+	int sfd = c->sockets[index];
+	c->sockets[index] = c->sockets[--c->numSockets];
+	
+	int error = io_getSocketError(sfd);
+	if (!error) {
+		if (c->id) {
+			io_unregister(sfd);
+		}
+		c->sfd = sfd;
+		return; // Success
+	}
+	
+	LOG(3, "%s: Connection attempt failed: %s\n", c->host, strerror(error));
+	c->error = error;
+	if (c->id) {
+		io_closeSocket(&sfd);
 	} else {
+		close(sfd);
+	}
+	
+	// Try the next address right away
+	startAttempt(c);
+}
+
+int stepConnector(Connector* c)
+{
+	if (c->sfd != INVALID_SOCKET) {
+		return -1; // Connected
+	}
+	
+	// Race the next address if the pending attempts take too long
+	uint64_t now = timer_now();
+	if (c->nextAddr && now >= c->nextAttempt) {
+		startAttempt(c);
+		if (c->sfd != INVALID_SOCKET) {
+			return -1; // Connected
+		}
+	}
+	
+	if (!c->numSockets && !c->nextAddr) {
+		LOG(0, "Failed to connect to %s: %s\n", c->host, strerror(c->error));
+		return -1;
+	}
+	if (now >= c->deadline) {
+		LOG(0, "Failed to connect to %s: %s\n", c->host, strerror(ETIMEDOUT));
+		return -1;
+	}
+	
+	// Wait for the pending attempts until the next one is due
+	uint64_t until = c->deadline;
+	if (c->nextAddr && c->numSockets < MAX_CONNECT_ATTEMPTS && c->nextAttempt < until) {
+		until = c->nextAttempt;
+	}
+	return until - now < INT_MAX ? (int)(until - now) : INT_MAX;
+}
+
+void handleConnectEvent(int sfd, int events, void* arg)
+{
+	Connector* c = (Connector*)arg;
+	for (int i = 0; i < c->numSockets; i++) {
+		if (c->sockets[i] == sfd) {
+			checkAttempt(c, i);
+			break;
+		}
+	}
+	updateConnector(c);
+}
+
+void handleConnectTimer(int id, void* arg)
+{
+	Connector* c = (Connector*)arg;
+	c->timer = 0; // Expired already
+	updateConnector(c);
+}
+
+void updateConnector(Connector* c)
+{
+	if (c->timer) {
+		io_cancelTimer(c->timer);
+		c->timer = 0;
+	}
+	
+	// Wake up again when the next attempt is due or the time is up
+	int wait = stepConnector(c);
+	if (wait >= 0) {
+		c->timer = io_addTimer(wait, 0, handleConnectTimer, c);
+		return;
+	}
+	
+	// Attempt is over, report the outcome
+	for (Connector** it = &currentLoop()->connectors; *it; it = &(*it)->next) {
+		if (*it == c) {
+			*it = c->next;
+			break;
+		}
+	}
+	int sfd = c->sfd;
+	c->sfd = INVALID_SOCKET;
+	Connect_cb callback = c->callback;
+	void* arg = c->arg;
+	freeConnector(c);
+	callback(sfd, arg);
+}
+
+void io_processLoop(void)
+{
+	while (io_process()) continue;
+}
+
+IO_Loop* currentLoop(void)
+{
+	return m_loop ? m_loop : &m_defaultLoop;
+}
+
+int initLoop(IO_Loop* loop)
+{
+	loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epollFd == -1) {
+		LOG(0, "Failed to create epoll instance: %s\n", strerror(errno));
+		return 0;
+	}
+
+	// Let posted tasks interrupt epoll_wait(), registered on behalf of the
+	// thread to run the loop
+	IO_Loop* previous = m_loop;
+	m_loop = loop;
+	loop->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int success = loop->wakeupFd != -1 &&
+		io_multiplex(loop->wakeupFd, "wakeup", IO_READ, handleWakeup, NULL);
+	if (!success) {
+		LOG(0, "Failed to create wakeup event: %s\n", strerror(errno));
+		io_closeSocket(&loop->wakeupFd);
+	}
+	m_loop = previous;
+
+	return success;
+}
+
+void deinitLoop(IO_Loop* loop)
+{
+	// Release the loop on behalf of the thread that ran it
+	IO_Loop* previous = m_loop;
+	m_loop = loop;
+
+	// Close all remaining sockets
+	for (int i = 0; i < loop->socketCapacity; i++) {
+		io_closeSocket(&loop->sockets[i].sfd);
+	}
+	free(loop->sockets);
+	loop->sockets = NULL;
+	loop->socketCapacity = 0;
+	loop->wakeupFd = INVALID_SOCKET;
+	io_closeSocket(&loop->epollFd);
+
+	io_freeBatch(loop->batch);
+	loop->batch = NULL;
+
+	// Drop the connection attempts left
+	while (loop->connectors) {
+		Connector* c = loop->connectors;
+		loop->connectors = c->next;
+		freeConnector(c);
+	}
+
+	// Drop the timers and tasks left
+	free(loop->timers);
+	loop->timers = NULL;
+	free(loop->timerSlots);
+	loop->timerSlots = NULL;
+	loop->freeTimer = 0;
+	loop->numTimers = 0;
+	loop->timerCapacity = 0;
+	TaskEntry* task = __atomic_exchange_n(&loop->mailbox, NULL, __ATOMIC_ACQUIRE);
+	while (task) {
+		TaskEntry* next = task->next;
+		free(task);
+		task = next;
+	}
+
+	m_loop = previous;
+}
+
+SocketEntry* lookupSocketEntry(IO_Loop* loop, int sfd)
+{
+	if (sfd < 0 || sfd >= loop->socketCapacity) {
 		return NULL;
 	}
+	
+	SocketEntry* entry = &loop->sockets[sfd];
+	return entry->sfd == sfd ? entry : NULL;
 }
 
-void removeSocketEntry(int sfd)
+SocketEntry* createSocketEntry(IO_Loop* loop, int sfd)
 {
-	SocketEntry* entry = lookupSocketEntry(INVALID_SOCKET);
+	if (sfd < 0) {
+		LOG(0, "Invalid descriptor %d\n", sfd);
+		return NULL;
+	}
+
+	// Grow table if required
+	if (sfd >= loop->socketCapacity) {
+		int capacity = loop->socketCapacity ? loop->socketCapacity : SOCKETTABLE_SIZE;
+		while (capacity <= sfd) {
+			capacity *= 2;
+		}
+		SocketEntry* sockets = realloc(loop->sockets, capacity * sizeof(SocketEntry));
+		if (!sockets) {
+			LOG(0, "Failed to grow socket table\n");
+			return NULL;
+		}
+		for (int i = loop->socketCapacity; i < capacity; i++) {
+			sockets[i].sfd = INVALID_SOCKET;
+			sockets[i].registered = 0;
+		}
+		loop->sockets = sockets;
+		loop->socketCapacity = capacity;
+	}
+
+	SocketEntry* entry = &loop->sockets[sfd];
+	if (entry->sfd != INVALID_SOCKET) {
+		LOG(1, "Socket %d already registered\n", sfd);
+	} else {
+		entry->generation = ++loop->generation;
+		entry->registered = 0;
+	}
+	entry->sfd = sfd;
+	return entry;
+}
+
+void removeSocketEntry(IO_Loop* loop, int sfd)
+{
+	SocketEntry* entry = lookupSocketEntry(loop, sfd);
 	if (entry) {
+		entry->events = 0;
+		updateRegistration(loop, entry);
 		entry->sfd = INVALID_SOCKET;
 	}
 }
 
+int updateRegistration(IO_Loop* loop, SocketEntry* entry)
+{
+	// Remove descriptors without events of interest, epoll would keep
+	// reporting errors and hangups
+	if (!entry->events) {
+		if (entry->registered && epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, entry->sfd, NULL) == -1) {
+			// Closed elsewhere already, which removes it as well
+			LOG(4, "Failed to remove socket %d: %s\n", entry->sfd, strerror(errno));
+		}
+		entry->registered = 0;
+		return 1;
+	}
+
+	struct epoll_event event = {0};
+	event.events = (entry->events & IO_READ ? EPOLLIN : 0) |
+		(entry->events & IO_WRITE ? EPOLLOUT : 0);
+	event.data.u64 = ((uint64_t)entry->generation << 32) | (uint32_t)entry->sfd;
+	if (epoll_ctl(loop->epollFd, entry->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		entry->sfd, &event) == -1)
+	{
+		LOG(0, "Failed to register socket %d: %s\n", entry->sfd, strerror(errno));
+		return 0;
+	}
+	entry->registered = 1;
+	return 1; // Success
+}
+
 int io_isLocalAddress(struct in_addr addr)
 {
 	// Get interfaces list
@@ -44,7 +44,10 @@
 #define __IO_H
 
 #include <netinet/in.h>
+#include <netdb.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "ip.h"
 
@@ -58,6 +61,14 @@
 // Buffer size to hold datagrams
 #define MTU 1500
 
+// Flags to specify the events of interest for I/O multiplexing
+#define IO_READ  0x01
+#define IO_WRITE 0x02
+
+// Maximum number of datagrams passed to the callbacks registered with
+// io_multiplexBatch() at once
+#define IO_BATCH_SIZE 16
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // TYPES
@@ -66,9 +77,44 @@
 // Type to hold host names
 typedef char Hostname[HOST_NAME_MAX];
 
+// Struct to hold the state of an event loop, i.e. the sockets, timers and
+// tasks dispatched by io_process()
+typedef struct IO_Loop_s IO_Loop;
+
 // Callback used to notify clients about sockets that are ready for read
 typedef void(*SocketReady_cb)(int sfd); 
 
+// Callback used to notify clients about sockets that are ready for the
+// events in 'events' (IO_READ, IO_WRITE). 'arg' is passed through as
+// specified upon registration.
+typedef void(*SocketEvent_cb)(int sfd, int events, void* arg);
+
+// Callback invoked by io_process() when a timer expires. 'id' identifies
+// the timer as returned by io_addTimer().
+typedef void(*Timer_cb)(int id, void* arg);
+
+// Callback invoked by io_process() to run a deferred task
+typedef void(*Task_cb)(void* arg);
+
+// Callback invoked upon an asynchronous connection attempt completes with
+// the connected socket or INVALID_SOCKET on failure
+typedef void(*Connect_cb)(int sfd, void* arg);
+
+// Struct to hold a datagram received as part of a batch
+typedef struct IO_Datagram_s {
+	unsigned char* data;       // Payload, truncated to the buffer size
+	size_t size;               // Size of the payload in bytes
+	struct sockaddr_in from;   // Address of the sender
+	uint64_t time;             // Time in microseconds received (see timer_nowUs())
+} IO_Datagram;
+
+// Struct to hold the preallocated buffers to receive a batch of datagrams
+typedef struct IO_Batch_s IO_Batch;
+
+// Callback used to pass the datagrams received from a socket at once, which
+// are valid during the callback only
+typedef void(*SocketBatch_cb)(int sfd, const IO_Datagram* datagrams, int count);
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTIONS
@@ -80,18 +126,105 @@ void io_init(void);
 // Deinitializes the io module
 void io_deinit(void);
 
+// Creates an additional event loop to be run by another thread. The functions
+// of this module operate on the loop selected by the calling thread, or on
+// the default loop set up by io_init() if none.
+IO_Loop* io_createLoop(void);
+
+// Closes the sockets registered with the specified loop and frees it. Must
+// not be called while a thread runs the loop.
+void io_freeLoop(IO_Loop* loop);
+
+// Selects the loop the calling thread operates on, or the default if NULL
+void io_setLoop(IO_Loop* loop);
+
+// Returns the loop the calling thread operates on
+IO_Loop* io_getLoop(void);
+
 // Creates a new UDP broadcast socket listening at the specified port
 // using the specified receive timeout in milliseconds and the optional
 // multicast group membership
 int io_createBroadcastSocket(int port, int timeout, const char* group);
 
-// Creates a new raw socket to receive packets on all interfaces
-int io_createRawSocket(void);
+// Creates a new non-blocking raw socket to receive the IP packets holding TCP
+// segments from the specified port, on the specified interface in promiscuous
+// mode or on all interfaces if NULL. Requires CAP_NET_RAW.
+int io_createRawSocket(const char* interface, int port);
 
 // Creates a new TCP client socket connected to the specified service/port
-// using the specified receive timeout in milliseconds
+// using the specified timeout in milliseconds for connecting and receiving.
+// All addresses of the host are tried, racing them happy eyeballs style.
 int io_createClientSocket(const char* host, const char* service, int timeout);
 
+// Connects to the specified service/port like io_createClientSocket() without
+// blocking, though the host is resolved synchronously. Returns the connected
+// non-blocking socket if established immediately. Otherwise returns
+// INVALID_SOCKET and sets *id to the pending attempt, or to zero on failure.
+// The event loop completes the attempt and invokes the callback with the
+// connected socket, or INVALID_SOCKET on failure and timeout.
+int io_connect(const char* host, const char* service, int timeout,
+	Connect_cb callback, void* arg, int* id);
+
+// Cancels the specified pending connection attempt without invoking its
+// callback
+int io_cancelConnect(int id);
+
+// Resolves the specified host and service/port to the address of a TCP peer
+int io_resolve(const char* host, const char* service, 
+	struct sockaddr_storage* sa, socklen_t* len);
+
+// Resolves the specified host and service/port to all addresses of a TCP peer
+// in the order io_connectTo() tries them. Returns NULL on failure. The list
+// must be released by io_freeAddresses().
+struct addrinfo* io_resolveAll(const char* host, const char* service);
+
+// Releases the addresses returned by io_resolveAll()
+void io_freeAddresses(struct addrinfo* addrs);
+
+// Like io_connect() but races the addresses resolved in advance by
+// io_resolveAll(), so that no lookup blocks the event loop. The addresses must
+// remain valid until the callback is invoked or the attempt is cancelled.
+int io_connectTo(const struct addrinfo* addrs, const char* host, int timeout,
+	Connect_cb callback, void* arg, int* id);
+
+// Creates a new non-blocking TCP client socket and initiates a connection to
+// the specified address. The socket becomes ready for write once the connection
+// attempt completes, use io_getSocketError() to check for success.
+int io_createClientSocketAsync(const struct sockaddr* sa, socklen_t len);
+
+// Creates a new non-blocking TCP server socket listening at the specified
+// port on all local addresses
+int io_createServerSocket(int port);
+
+// Returns the pending error of the specified socket, i.e. zero on success
+int io_getSocketError(int sfd);
+
+// Makes the kernel record the time packets are received at the specified
+// socket (SO_TIMESTAMPNS) for io_recvTimestamp()
+void io_enableTimestamps(int sfd);
+
+// Receives data like recv() and returns the monotonic time in microseconds
+// (see timer_nowUs()) the data was received. The time is taken from the kernel
+// if enabled by io_enableTimestamps(), or else when the call returns.
+ssize_t io_recvTimestamp(int sfd, void* buffer, size_t size, int flags, uint64_t* time);
+
+// Like io_recvTimestamp() but also retrieves the address of the sender of
+// a datagram if 'from' is not NULL
+ssize_t io_recvFromTimestamp(int sfd, void* buffer, size_t size, int flags,
+	struct sockaddr_in* from, uint64_t* time);
+
+// Creates buffers to receive up to the specified number of datagrams of the
+// specified size at once
+IO_Batch* io_createBatch(int capacity, size_t size);
+
+// Frees the specified batch buffers
+void io_freeBatch(IO_Batch* batch);
+
+// Receives the pending datagrams up to the capacity of the batch with a single
+// system call without blocking. Returns the number of datagrams received and
+// sets *datagrams, or zero if none is pending, or -1 on failure.
+int io_recvBatch(int sfd, IO_Batch* batch, const IO_Datagram** datagrams);
+
 // Closes a socket
 void io_closeSocket(int* sfd);
 
@@ -103,12 +236,48 @@ int io_getHostname(struct in_addr addr, Hostname host);
 // The specified callback is executed by io_process() when data is available
 int io_multiplexRead(int sfd, const char* name, SocketReady_cb callback);
 
+// Like io_multiplexRead() for datagram sockets, but the callback is passed
+// all pending datagrams in batches of up to IO_BATCH_SIZE datagrams, each
+// received into a buffer of at least the specified size
+int io_multiplexBatch(int sfd, const char* name, size_t size, SocketBatch_cb callback);
+
+// Registers a socket for synchronous I/O multiplexing of the specified events
+// (IO_READ, IO_WRITE). Registering a socket again updates the events of interest.
+// The specified callback is executed by io_process() when the socket is ready.
+int io_multiplex(int sfd, const char* name, int events, 
+	SocketEvent_cb callback, void* arg);
+
+// Removes a socket from synchronous I/O multiplexing
+void io_unregister(int sfd);
+
 // Receives data at the registered sockets
 int io_process(void);
 
+// Like io_process() but waits at most 'timeout' milliseconds for a socket
+// to become ready, or indefinitely if negative
+int io_processTimeout(int timeout);
+
 // Calls io_process in a loop
 void io_processLoop(void);
 
+// Adds a timer invoking the callback from io_process() after 'delay'
+// milliseconds and then every 'period' milliseconds, or once if 'period' is
+// zero. Returns the positive identifier of the timer or 0 on failure.
+int io_addTimer(int delay, int period, Timer_cb callback, void* arg);
+
+// Cancels the timer with the specified identifier, e.g. from its callback.
+// Returns 0 if there is no such timer (any more).
+int io_cancelTimer(int id);
+
+// Queues a task to be run by io_process() after the pending socket events.
+// May be called from any thread or a callback and wakes up io_process().
+int io_defer(Task_cb callback, void* arg);
+
+// Like io_defer() but queues the task to the specified loop, e.g. to pass
+// a message to another thread. Posting does not take a lock, the tasks run
+// in the order posted.
+int io_post(IO_Loop* loop, Task_cb callback, void* arg);
+
 // Checks if the specified address corresponds to the local host
 int io_isLocalAddress(struct in_addr addr);
 
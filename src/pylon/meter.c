@@ -33,8 +33,9 @@
   Project   : Pylon
   Module    : meter
   Used by   : smartmeter
-  Purpose   : Provides basic operations to sample from an arbitrary sensor
-              using a separate thread and a specified sampling rate
+  Purpose   : Provides basic operations to sample from arbitrary sensors
+              at specified sampling rates using a timer wheel served by a
+              small pool of threads shared by all meters
   
   Version   : 1.0
   Date      : 05.04.2012
@@ -46,66 +47,329 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
 
+#include "wheel.h"
 #include "timer.h"
 #include "common.h"
 
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Maximum number of missed ticks performed in a burst to catch up, the
+// ticks missed beyond are skipped (e.g. after the system was suspended)
+#define MAX_CATCH_UP 10
+
+// Default number of threads invoking the callbacks of all meters
+#define DEFAULT_THREADS 1
+
 ////////////////////////////////////////////////////////////////////////////////
 // TYPES
 ////////////////////////////////////////////////////////////////////////////////
 
+// States of a meter with respect to the scheduler
+typedef enum {
+	STATE_IDLE = 0,       // Not scheduled, e.g. before meter_run()
+	STATE_SCHEDULED,      // Waiting in the timer wheel
+	STATE_READY,          // Due and waiting for a thread of the pool
+	STATE_BUSY            // Callback being invoked
+} MeterState;
+
 struct MeterHandle_s {
-	pthread_t thread;     // POSIX handle of the thread
+	WheelTimer timer;     // Timer in the wheel (first member, see expireTimers())
+	MeterState state;     // State with respect to the scheduler
+	MeterHandle* next;    // Next meter in the list of ready meters
+	uint64_t tick;        // Monotonic time in us of the last measurement, zero if none
+	uint64_t deadline;    // Monotonic time in us of the next measurement
+	int preparing;        // Flag if 'prepare' is due next instead of 'measure'
+
 	int interval;         // Time in milliseconds between two measurements
-	int running;          // Flag used for thread termination
+	int running;          // Flag if registered with the scheduler
 	meter_proc measure;   // Callback provided by the client module
+	meter_proc prepare;   // Optional callback invoked ahead of a measurement
+	int lead;             // Time in milliseconds to invoke 'prepare' in advance
+
+	// Adaptive scheduling
+	int minInterval;      // Interval while the tracked value changes
+	int maxInterval;      // Interval while it is steady, zero if not adaptive
+	double threshold;     // Change of the tracked value considered significant
+	double reference;     // Value of the tracked variable at the last change
+	int tracking;         // Flag if the reference has been set
+
+	// Scheduling at fixed deadlines
+	Meter_Schedule schedule; // Policy to schedule the measurements
+	int phase;               // Offset in ms of the wall-clock grid, negative if not aligned
+	unsigned int missedTicks; // Ticks skipped or performed an interval late
 };
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// IMPLEMENTATION
+// STATIC VARIABLES
 ////////////////////////////////////////////////////////////////////////////////
 
+// Timer wheel in milliseconds (see timer_now()) holding the waiting meters
+static Wheel* m_wheel;
+
+// List of the meters that are due, in order
+static MeterHandle* m_readyHead;
+static MeterHandle* m_readyTail;
+
+// Number of running meters, threads in the pool and maximum pool size
+static int m_numMeters;
+static int m_numThreads;
+static int m_maxThreads = DEFAULT_THREADS;
+
+// Lock for all of the above and the state of the meters, condition to wake
+// up the pool and condition signaled whenever a meter becomes idle
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_wakeup;
+static pthread_cond_t m_idle = PTHREAD_COND_INITIALIZER;
+static pthread_once_t m_once = PTHREAD_ONCE_INIT;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Procedure of the threads in the pool
 static void* threadproc(void* arg);
 
+// Initializes the wakeup condition to use the monotonic clock
+static void initialize(void);
+
+// Moves the meters with expired timers to the list of ready meters
+static void expireTimers(uint64_t now);
+
+// Invokes the due callback of the specified meter
+static void invokeMeter(MeterHandle* handle);
+
+// Determines the deadline of the next measurement and schedules the meter
+// accordingly. 'now' is the monotonic time in us.
+static void scheduleNext(MeterHandle* handle, uint64_t now);
+
+// Schedules the meter to be ready at the specified monotonic time in us
+static void scheduleAt(MeterHandle* handle, uint64_t time, uint64_t now);
+
+// Appends the meter to the list of ready meters or removes it
+static void pushReady(MeterHandle* handle);
+static void removeReady(MeterHandle* handle);
 
 
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
 void* threadproc(void* arg)
 {
-	// Get context
-	MeterHandle* handle = (MeterHandle*)arg;
-	if (!handle) {
-		LOG(0, "No context specified\n");
-		return NULL;
-	}
+	pthread_mutex_lock(&m_lock);
 
-	uint64_t barrier = 0;
+	// Serve the meters until none is left
+	while (m_numMeters > 0) {
+		expireTimers(timer_now());
 
-	// Repeat until meter_stop invoked
-	while (handle->running) {
-	
-		// Ensure that measuring no more than every 'interval' milliseconds
-		// if specified
-		if (handle->interval >= 0) {
-			int elapsed = 0;
-			if (!timer_barrier(&barrier, handle->interval, &elapsed)) {
-				LOG(2, "Can't keep up with measurement interval %d ms, time elapsed: %d ms\n", 
-					handle->interval, elapsed);
+		// Invoke the callback of the next ready meter
+		MeterHandle* handle = m_readyHead;
+		if (handle) {
+			removeReady(handle);
+			handle->state = STATE_BUSY;
+			pthread_mutex_unlock(&m_lock);
+
+			invokeMeter(handle);
+
+			pthread_mutex_lock(&m_lock);
+			handle->state = STATE_IDLE;
+			if (handle->running) {
+				if (handle->preparing) {
+					handle->preparing = 0;
+					scheduleAt(handle, handle->deadline, timer_nowUs());
+				} else {
+					scheduleNext(handle, timer_nowUs());
+				}
+			} else {
+				pthread_cond_broadcast(&m_idle);
 			}
+			continue;
+		}
+
+		// Sleep until the next timer expires or a meter is added
+		uint64_t next = wheel_next(m_wheel);
+		if (next == UINT64_MAX) {
+			pthread_cond_wait(&m_wakeup, &m_lock);
+		} else {
+			struct timespec ts;
+			ts.tv_sec  = next / 1000;
+			ts.tv_nsec = (next % 1000) * 1000000;
+			pthread_cond_timedwait(&m_wakeup, &m_lock, &ts);
 		}
-		
-		// Invoke callback
-		handle->measure(handle);
 	}
 
+	m_numThreads--;
+	pthread_mutex_unlock(&m_lock);
 	return NULL;
 }
 
+void initialize(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m_wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void expireTimers(uint64_t now)
+{
+	WheelTimer* timer = wheel_advance(m_wheel, now);
+	while (timer) {
+		WheelTimer* next = timer->next;
+
+		// The timer is the first member of the handle
+		MeterHandle* handle = (MeterHandle*)timer;
+		pushReady(handle);
+		timer = next;
+	}
+}
+
+void invokeMeter(MeterHandle* handle)
+{
+	if (handle->preparing) {
+
+		// Give the client module the chance to get ready shortly before
+		handle->prepare(handle);
+		return;
+	}
+
+	// The wheel has millisecond resolution, wait for the exact deadline
+	timer_sleepUntil(handle->deadline);
+	handle->tick = handle->deadline;
+	handle->measure(handle);
+}
+
+void scheduleNext(MeterHandle* handle, uint64_t now)
+{
+	uint64_t interval = (uint64_t)handle->interval * 1000;
+	uint64_t deadline = handle->tick + interval;
+
+	if (handle->interval < 0) {
+
+		// Measure continuously
+		deadline = now;
+
+	} else if (handle->schedule != METER_RELATIVE || handle->phase >= 0) {
+
+		// Start the grid with the first measurement unless aligned to the wall
+		// clock, then wait for the next tick of the wall-clock grid
+		if (handle->phase >= 0) {
+			deadline = timer_alignUs(handle->tick ? deadline : now + interval / 2,
+				handle->interval, handle->phase);
+		} else if (handle->tick == 0) {
+			deadline = now;
+		}
+
+		// Deal with the ticks missed by an overrun of the last measurement
+		if (interval > 0 && now >= deadline + interval) {
+			uint64_t missed = (now - deadline) / interval;
+			if (handle->schedule == METER_CATCH_UP && missed <= MAX_CATCH_UP) {
+
+				// Perform this tick late, the next ones follow right away
+				handle->missedTicks++;
+			} else {
+				uint64_t skipped = handle->schedule == METER_CATCH_UP ?
+					missed - MAX_CATCH_UP : missed;
+				deadline += skipped * interval;
+				handle->missedTicks += skipped;
+				LOG(2, "Can't keep up with measurement interval %d ms, skipped %llu ticks\n",
+					handle->interval, (unsigned long long)skipped);
+			}
+		}
+
+	} else if (handle->tick == 0) {
+		deadline = now;
+
+	} else if (deadline < now) {
+
+		// Measure no more than every 'interval' milliseconds
+		LOG(2, "Can't keep up with measurement interval %d ms, time elapsed: %d ms\n",
+			handle->interval, (int)((now - handle->tick) / 1000));
+		deadline = now;
+	}
+	handle->deadline = deadline;
+
+	// Prepare ahead of the measurement (not required for the first one)
+	uint64_t lead = (uint64_t)handle->lead * 1000;
+	if (handle->prepare && handle->tick > 0 && handle->interval >= 0) {
+		handle->preparing = 1;
+		scheduleAt(handle, deadline > lead ? deadline - lead : 0, now);
+	} else {
+		scheduleAt(handle, deadline, now);
+	}
+}
+
+void scheduleAt(MeterHandle* handle, uint64_t time, uint64_t now)
+{
+	if (time <= now) {
+		pushReady(handle);
+	} else {
+		// Expire early within the millisecond, see invokeMeter()
+		handle->state = STATE_SCHEDULED;
+		uint64_t next = wheel_next(m_wheel);
+		wheel_add(m_wheel, &handle->timer, time / 1000);
+
+		// Wake up a thread sleeping until a later timer, e.g. when aligned to
+		// the wall clock
+		if (time / 1000 < next) {
+			pthread_cond_signal(&m_wakeup);
+		}
+	}
+}
+
+void pushReady(MeterHandle* handle)
+{
+	handle->state = STATE_READY;
+	handle->next = NULL;
+	if (m_readyTail) {
+		m_readyTail->next = handle;
+	} else {
+		m_readyHead = handle;
+	}
+	m_readyTail = handle;
+	pthread_cond_signal(&m_wakeup);
+}
+
+void removeReady(MeterHandle* handle)
+{
+	MeterHandle** link = &m_readyHead;
+	MeterHandle* prev = NULL;
+	while (*link && *link != handle) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+	if (*link) {
+		*link = handle->next;
+		if (m_readyTail == handle) {
+			m_readyTail = prev;
+		}
+		handle->next = NULL;
+	}
+}
 
 MeterHandle* meter_start(int interval, meter_proc measure)
+{
+	MeterHandle* handle = meter_create(interval, measure);
+	if (handle && !meter_run(handle)) {
+		free(handle);
+		handle = NULL;
+	}
+	return handle;
+}
+
+MeterHandle* meter_create(int interval, meter_proc measure)
 {
 	// Create context
-	MeterHandle* handle = malloc(sizeof(MeterHandle));
+	MeterHandle* handle = calloc(1, sizeof(MeterHandle));
 	if (!handle) {
 		LOG(0, "Failed to allocate handle\n");
 		return NULL;
@@ -114,19 +378,68 @@ MeterHandle* meter_start(int interval, meter_proc measure)
 	// Set parameters
 	handle->interval = interval;
 	handle->measure  = measure;
-	handle->running  = 1; // Enter loop in threadproc
-	
-	// Create thread
-	int error = pthread_create(&handle->thread, NULL, threadproc, handle);
-	if (error) {
-		LOG(0, "Failed to create thread: %s\n", strerror(error));
-		free(handle);
-		handle = NULL;
-	}
+	handle->schedule = METER_RELATIVE;
+	handle->phase    = -1;
+	handle->state    = STATE_IDLE;
 	
 	return handle;
 }
 
+int meter_run(MeterHandle* handle)
+{
+	if (!handle) {
+		LOG(0, "No handle specified\n");
+		return 0;
+	}
+
+	pthread_once(&m_once, initialize);
+	pthread_mutex_lock(&m_lock);
+
+	if (!m_wheel) {
+		m_wheel = wheel_create(timer_now());
+		if (!m_wheel) {
+			pthread_mutex_unlock(&m_lock);
+			return 0;
+		}
+	}
+	if (handle->running) {
+		pthread_mutex_unlock(&m_lock);
+		LOG(1, "Already running\n");
+		return 1;
+	}
+
+	// Register the meter, the first measurement is due right away
+	handle->running = 1;
+	handle->tick = 0;
+	handle->preparing = 0;
+	m_numMeters++;
+	scheduleNext(handle, timer_nowUs());
+
+	// Grow the pool up to one thread per meter
+	int ret = 1;
+	while (m_numThreads < m_maxThreads && m_numThreads < m_numMeters) {
+		pthread_t thread;
+		int error = pthread_create(&thread, NULL, threadproc, NULL);
+		if (error) {
+			LOG(0, "Failed to create thread: %s\n", strerror(error));
+			ret = m_numThreads > 0;
+			break;
+		}
+		pthread_detach(thread);
+		m_numThreads++;
+	}
+	if (!ret) {
+		wheel_remove(m_wheel, &handle->timer);
+		removeReady(handle);
+		handle->state = STATE_IDLE;
+		handle->running = 0;
+		m_numMeters--;
+	}
+
+	pthread_mutex_unlock(&m_lock);
+	return ret;
+}
+
 int meter_stop(MeterHandle* handle)
 {
 	if (!handle) {
@@ -134,13 +447,29 @@ int meter_stop(MeterHandle* handle)
 		return 0;
 	}
 
+	pthread_mutex_lock(&m_lock);
+
 	if (!handle->running) {
+		pthread_mutex_unlock(&m_lock);
 		LOG(1, "Not running\n");
 		return 1;
 	}
 
-	// Request threadproc to terminate
+	// Unregister the meter, a callback in progress completes
 	handle->running = 0;
+	m_numMeters--;
+	if (handle->state == STATE_SCHEDULED) {
+		wheel_remove(m_wheel, &handle->timer);
+		handle->state = STATE_IDLE;
+	} else if (handle->state == STATE_READY) {
+		removeReady(handle);
+		handle->state = STATE_IDLE;
+	}
+
+	// Let idle threads of the pool terminate if this was the last meter
+	pthread_cond_broadcast(&m_wakeup);
+	pthread_cond_broadcast(&m_idle);
+	pthread_mutex_unlock(&m_lock);
 	
 	return 1; // Success
 }
@@ -152,15 +481,129 @@ int meter_join(MeterHandle* handle)
 		return 0;
 	}
 
-	// Join thread
-	int error = pthread_join(handle->thread, NULL);
-	if (error != 0) {
-		LOG(0, "Failed to join thread: %s\n", strerror(error));
-		return 0;
+	// Wait until stopped and no callback is in progress
+	pthread_mutex_lock(&m_lock);
+	while (handle->running || handle->state != STATE_IDLE) {
+		pthread_cond_wait(&m_idle, &m_lock);
 	}
+	pthread_mutex_unlock(&m_lock);
 	
 	// Cleanup
 	free(handle);
 	
 	return 1; // Success
 }
+
+int meter_setThreads(int count)
+{
+	if (count < 1) {
+		LOG(0, "Invalid number of threads: %d\n", count);
+		return 0;
+	}
+
+	pthread_mutex_lock(&m_lock);
+	m_maxThreads = count;
+	pthread_mutex_unlock(&m_lock);
+	return 1; // Success
+}
+
+int meter_setPrepare(MeterHandle* handle, meter_proc prepare, int lead)
+{
+	if (!handle) {
+		LOG(0, "No handle specified\n");
+		return 0;
+	}
+	
+	handle->lead    = lead > 0 ? lead : 0;
+	handle->prepare = prepare;
+	
+	return 1; // Success
+}
+
+int meter_setAdaptive(MeterHandle* handle, int minInterval, int maxInterval, double threshold)
+{
+	if (!handle) {
+		LOG(0, "No handle specified\n");
+		return 0;
+	}
+	if (maxInterval > 0 && (minInterval <= 0 || minInterval > maxInterval)) {
+		LOG(0, "Invalid interval range %d..%d ms\n", minInterval, maxInterval);
+		return 0;
+	}
+
+	handle->minInterval = minInterval;
+	handle->maxInterval = maxInterval;
+	handle->threshold   = threshold;
+	handle->tracking    = 0;
+
+	// Start fast until the signal is known to be steady
+	if (maxInterval > 0) {
+		handle->interval = minInterval;
+	}
+
+	return 1; // Success
+}
+
+void meter_track(MeterHandle* handle, double value)
+{
+	if (!handle || handle->maxInterval <= 0) {
+		return;
+	}
+
+	// The first value serves as reference
+	if (!handle->tracking) {
+		handle->reference = value;
+		handle->tracking = 1;
+		return;
+	}
+
+	if (fabs(value - handle->reference) > handle->threshold) {
+
+		// Sample fast while the value changes
+		if (handle->interval != handle->minInterval) {
+			LOG(3, "Change of %.3f detected, interval %d ms\n",
+				value - handle->reference, handle->minInterval);
+		}
+		handle->interval = handle->minInterval;
+		handle->reference = value;
+
+	} else if (handle->interval < handle->maxInterval) {
+
+		// Back off by half the interval while the value is steady
+		int interval = handle->interval + handle->interval / 2;
+		handle->interval = interval < handle->maxInterval ? interval : handle->maxInterval;
+		LOG(4, "Steady, interval %d ms\n", handle->interval);
+	}
+}
+
+int meter_getInterval(const MeterHandle* handle)
+{
+	return handle ? handle->interval : -1;
+}
+
+int meter_setSchedule(MeterHandle* handle, Meter_Schedule schedule)
+{
+	if (!handle) {
+		LOG(0, "No handle specified\n");
+		return 0;
+	}
+
+	handle->schedule = schedule;
+	return 1; // Success
+}
+
+unsigned int meter_getMissedTicks(const MeterHandle* handle)
+{
+	return handle ? handle->missedTicks : 0;
+}
+
+int meter_setAlignment(MeterHandle* handle, int phase)
+{
+	if (!handle) {
+		LOG(0, "No handle specified\n");
+		return 0;
+	}
+
+	handle->phase = phase < 0 ? -1 : phase;
+	return 1; // Success
+}
@@ -54,20 +54,76 @@ typedef struct MeterHandle_s MeterHandle;
 // Callback function
 typedef void (*meter_proc)(MeterHandle* handle);
 
+// Policies to schedule the measurements
+typedef enum {
+	METER_RELATIVE = 0, // Wait 'interval' after the start of the last measurement (default)
+	METER_SKIP,         // Measure at fixed deadlines, skip the ticks missed by an overrun
+	METER_CATCH_UP      // Measure at fixed deadlines, perform missed ticks in a burst
+} Meter_Schedule;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTIONS
 ////////////////////////////////////////////////////////////////////////////////
 
-// Starts a new thread that periodically invokes the specified callback function
-// every 'interval' milliseconds.
+// Registers the specified callback function to be invoked periodically every
+// 'interval' milliseconds, or continuously if negative. The callbacks of all
+// meters are invoked by a small pool of threads (see meter_setThreads()), so
+// a callback blocking for long delays the other meters unless the pool is
+// large enough.
 MeterHandle* meter_start(int interval, meter_proc measure);
 
-// Stops the metering thread with the specified handle
+// Like meter_start() but does not register the callback yet, so that the
+// options below apply from the first measurement on. Start it with meter_run().
+MeterHandle* meter_create(int interval, meter_proc measure);
+
+// Registers the callback of a handle created by meter_create()
+int meter_run(MeterHandle* handle);
+
+// Unregisters the callback of the meter with the specified handle, e.g.
+// from within the callback
 int meter_stop(MeterHandle* handle);
 
-// Waits for the metering thread with the specified handle to terminate
+// Waits for the meter with the specified handle to be stopped and its last
+// callback to return and releases the handle
 int meter_join(MeterHandle* handle);
 
+// Sets the maximum number of threads invoking the callbacks of all meters
+// (default 1). Threads are created as meters are started, up to one per meter.
+int meter_setThreads(int count);
+
+// Specifies a callback to be invoked 'lead' milliseconds before each
+// measurement, e.g. to establish a connection ahead of time.
+// Pass NULL to remove a previously set callback.
+int meter_setPrepare(MeterHandle* handle, meter_proc prepare, int lead);
+
+// Enables adaptive scheduling: the interval drops to 'minInterval' as soon as
+// the value passed to meter_track() differs by more than 'threshold' from the
+// value at the last change, and grows gradually up to 'maxInterval' as long
+// as it does not. Pass a 'maxInterval' of zero to disable.
+int meter_setAdaptive(MeterHandle* handle, int minInterval, int maxInterval, double threshold);
+
+// Reports the current value of the tracked variable, typically from within
+// the measurement callback, to adapt the interval
+void meter_track(MeterHandle* handle, double value);
+
+// Returns the current interval between two measurements in milliseconds
+int meter_getInterval(const MeterHandle* handle);
+
+// Selects the policy to schedule the measurements. With fixed deadlines the
+// measurements stay on the grid 'start + k * interval' regardless of the time
+// they take or the latency of waking up.
+int meter_setSchedule(MeterHandle* handle, Meter_Schedule schedule);
+
+// Returns the number of ticks that were skipped or performed at least one
+// interval late
+unsigned int meter_getMissedTicks(const MeterHandle* handle);
+
+// Aligns the measurements to the wall clock: they take place whenever the
+// wall-clock time is a multiple of the interval plus 'phase' milliseconds, so
+// that the measurements of different meters and hosts coincide. Implies fixed
+// deadlines (METER_SKIP unless METER_CATCH_UP). Pass a negative phase to disable.
+int meter_setAlignment(MeterHandle* handle, int phase);
+
 #endif // __METER_H
 
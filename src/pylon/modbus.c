@@ -0,0 +1,527 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : modbus
+  Used by   : smlogger
+  Purpose   : Provides operations to read data from Modbus TCP meters. The
+              registers are read in as few blocks as possible, pipelined
+              over one persistent connection.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "modbus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "meter.h"
+#include "io.h"
+#include "timer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Function code to read holding registers
+#define READ_HOLDING_REGISTERS 0x03
+
+// Maximum number of registers per request imposed by the protocol
+#define MAX_BLOCK_SIZE 125
+
+// Maximum number of unused registers between two mapped ones read in the
+// same request, since reading them is cheaper than another request
+#define MAX_GAP 16
+
+// Size of the MBAP header and of a request
+#define HEADER_SIZE  7
+#define REQUEST_SIZE 12
+
+// Receive timeout in milliseconds
+#define RECEIVE_TIMEOUT 2000
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Consecutive registers read with a single request
+typedef struct Block_s {
+	uint16_t address;             // Address of the first register
+	uint16_t count;               // Number of registers
+	int first;                    // Index of the first mapped register in the block
+	int last;                     // Index after the last mapped register in the block
+} Block;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Stores context for the thread performing the measurements
+static MeterHandle* m_handle;
+
+// Address and unit identifier of the meter
+static const char* m_host;
+static char m_port[16];
+static uint8_t m_unit;
+static int m_interval;
+
+// Persistent connection to the meter
+static int m_socket = INVALID_SOCKET;
+
+// Transaction identifier of the next request
+static uint16_t m_transaction;
+
+// Register map sorted by address and the blocks to read
+static Modbus_Register m_registers[MODBUS_MAX_REGISTERS];
+static int m_numRegisters;
+static Block m_blocks[MODBUS_MAX_REGISTERS];
+static int m_numBlocks;
+
+// Callback to notify the client module about measurements
+static modbus_cb m_callback;
+
+// Default register map, the layout of the measurements of an Eastron SDM630
+// served as holding registers by modsim
+static const Modbus_Register defaultRegisters[] = {
+	{VOLTAGE_L1,       0, MODBUS_FLOAT32, 1},
+	{VOLTAGE_L2,       2, MODBUS_FLOAT32, 1},
+	{VOLTAGE_L3,       4, MODBUS_FLOAT32, 1},
+	{CURRENT_L1,       6, MODBUS_FLOAT32, 1},
+	{CURRENT_L2,       8, MODBUS_FLOAT32, 1},
+	{CURRENT_L3,      10, MODBUS_FLOAT32, 1},
+	{POWER_L1,        12, MODBUS_FLOAT32, 1},
+	{POWER_L2,        14, MODBUS_FLOAT32, 1},
+	{POWER_L3,        16, MODBUS_FLOAT32, 1},
+	{PHASE_ANGLE_CURRENT_VOLTAGE_L1, 36, MODBUS_FLOAT32, 1},
+	{PHASE_ANGLE_CURRENT_VOLTAGE_L2, 38, MODBUS_FLOAT32, 1},
+	{PHASE_ANGLE_CURRENT_VOLTAGE_L3, 40, MODBUS_FLOAT32, 1},
+	{POWER_ALL_PHASES, 52, MODBUS_FLOAT32, 1},
+	{CURRENT_NEUTRAL, 224, MODBUS_FLOAT32, 1}
+};
+
+// Names of the encodings
+static const char* typeNames[] = {
+	"int16", "uint16", "int32", "uint32", "float32", "int32sw", "uint32sw", "float32sw"
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Callback function invoked by the meter thread
+static void performMeasurement(MeterHandle* handle);
+
+// Merges the mapped registers into as few blocks as possible
+static void planBlocks(void);
+
+// Returns the number of registers holding a value of the specified type
+static int getSize(Modbus_Type type);
+
+// Compares two mapped registers by address
+static int compareRegisters(const void* a, const void* b);
+
+// Sends the requests of all blocks at once
+static int sendRequests(uint16_t transaction);
+
+// Receives exactly the specified number of bytes
+static int receiveAll(unsigned char* buffer, size_t size);
+
+// Decodes the values of the registers of a block
+static void decodeBlock(const Block* block, const unsigned char* data, SmartMeter_Data* m);
+
+// Closes the connection, e.g. to reconnect after errors
+static void disconnect(void);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int modbus_init(const char* host, const char* port, int unit, int interval,
+	modbus_cb callback)
+{
+	if (!host) {
+		LOG(0, "Address of the Modbus meter not specified\n");
+		return 0;
+	}
+
+	m_host     = host;
+	strncpy(m_port, port ? port : MODBUS_DEFAULT_PORT, sizeof(m_port) - 1);
+	m_unit     = unit;
+	m_interval = interval;
+	m_callback = callback;
+
+	// Use the default register map unless specified
+	if (!m_numRegisters) {
+		return modbus_setRegisters(defaultRegisters,
+			sizeof(defaultRegisters) / sizeof(defaultRegisters[0]));
+	}
+	return 1; // Success
+}
+
+int modbus_setRegisters(const Modbus_Register* map, int count)
+{
+	if (count <= 0 || count > MODBUS_MAX_REGISTERS) {
+		LOG(0, "Invalid number of registers: %d\n", count);
+		return 0;
+	}
+	for (int i = 0; i < count; i++) {
+		if (map[i].id <= TIMESTAMP || map[i].id >= NUM_VARIABLES ||
+			map[i].type < MODBUS_INT16 || map[i].type > MODBUS_FLOAT32_SWAPPED)
+		{
+			LOG(0, "Invalid register mapping at %u\n", map[i].address);
+			return 0;
+		}
+	}
+
+	memcpy(m_registers, map, count * sizeof(Modbus_Register));
+	m_numRegisters = count;
+	planBlocks();
+	return 1;
+}
+
+int modbus_loadRegisters(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		LOG(0, "Failed to open '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	// Parse lines of the form: variable address type [scale]
+	Modbus_Register map[MODBUS_MAX_REGISTERS];
+	int count = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+
+		// Skip empty lines and comments
+		char name[64], type[16];
+		unsigned int address = 0;
+		double scale = 1;
+		int fields = sscanf(line, "%63s %u %15s %lf", name, &address, type, &scale);
+		if (fields <= 0 || name[0] == '#') {
+			continue;
+		}
+
+		// Look up the variable by name
+		SmartMeter_VarID id = INVALID_VARIABLE;
+		for (SmartMeter_VarID it = TIMESTAMP + 1; it < NUM_VARIABLES; it++) {
+			if (strcmp(smartmeter_getVarName(it), name) == 0) {
+				id = it;
+			}
+		}
+
+		if (fields < 3 || id == INVALID_VARIABLE || address > 0xffff ||
+			modbus_parseType(type) < 0 || count == MODBUS_MAX_REGISTERS)
+		{
+			LOG(0, "Invalid register mapping: %s", line);
+			fclose(file);
+			return 0;
+		}
+
+		map[count].id      = id;
+		map[count].address = address;
+		map[count].type    = modbus_parseType(type);
+		map[count].scale   = scale;
+		count++;
+	}
+
+	fclose(file);
+	return modbus_setRegisters(map, count);
+}
+
+int modbus_parseType(const char* name)
+{
+	for (int i = 0; i < sizeof(typeNames) / sizeof(typeNames[0]); i++) {
+		if (strcmp(typeNames[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const Modbus_Register* modbus_getDefaultRegisters(int* count)
+{
+	*count = sizeof(defaultRegisters) / sizeof(defaultRegisters[0]);
+	return defaultRegisters;
+}
+
+int modbus_getNumRequests(void)
+{
+	return m_numBlocks;
+}
+
+int modbus_measure(SmartMeter_Data* m)
+{
+	// Keep the connection across measurements
+	if (m_socket == INVALID_SOCKET) {
+		m_socket = io_createClientSocket(m_host, m_port, RECEIVE_TIMEOUT);
+		if (m_socket == INVALID_SOCKET) {
+			LOG(1, "Failed to connect to %s:%s\n", m_host, m_port);
+			return 0;
+		}
+	}
+
+	// Pipeline the requests of all blocks
+	uint16_t transaction = m_transaction;
+	m_transaction += m_numBlocks;
+	uint64_t requestTime = timer_nowUs();
+	if (!sendRequests(transaction)) {
+		disconnect();
+		return 0;
+	}
+
+	// Responses may arrive in any order
+	m->valid = 0;
+	int pending = m_numBlocks;
+	while (pending > 0) {
+		unsigned char header[HEADER_SIZE];
+		unsigned char pdu[2 + 2 * MAX_BLOCK_SIZE + 1];
+		if (!receiveAll(header, sizeof(header))) {
+			disconnect();
+			return 0;
+		}
+		uint16_t id     = (header[0] << 8) | header[1];
+		uint16_t length = (header[4] << 8) | header[5];
+		if (length < 2 || length - 1 > sizeof(pdu) || !receiveAll(pdu, length - 1)) {
+			LOG(1, "Invalid response from %s\n", m_host);
+			disconnect();
+			return 0;
+		}
+
+		// Match the response with its request
+		uint16_t index = id - transaction;
+		if (index >= m_numBlocks) {
+			LOG(2, "Unexpected transaction %u\n", id);
+			continue;
+		}
+		const Block* block = &m_blocks[index];
+		if (pdu[0] != READ_HOLDING_REGISTERS) {
+			LOG(1, "Exception %u reading %u registers at %u\n",
+				pdu[0] & 0x80 ? pdu[1] : 0, block->count, block->address);
+			disconnect();
+			return 0;
+		}
+		if (pdu[1] != 2 * block->count || length - 3 < pdu[1]) {
+			LOG(1, "Unexpected response size %u\n", pdu[1]);
+			disconnect();
+			return 0;
+		}
+		decodeBlock(block, pdu + 2, m);
+		pending--;
+	}
+	uint64_t receiveTime = timer_nowUs();
+
+	// Stamp with the middle of the round trip
+	m->val[TIMESTAMP] = timer_toWallclock(requestTime + (receiveTime - requestTime) / 2);
+	m->uncertainty = (receiveTime - requestTime) / 1e6;
+	m->valid |= SMARTMETER_VAR(TIMESTAMP);
+
+	return 1; // Success
+}
+
+void performMeasurement(MeterHandle* handle)
+{
+	// Perform measurement
+	SmartMeter_Data m = {{0}};
+	if (!modbus_measure(&m)) {
+		LOG(0, "Failed to perform measurement\n");
+		return;
+	}
+
+	// Invoke callback
+	if (m_callback) {
+		m_callback(&m);
+	}
+}
+
+int modbus_start(void)
+{
+	m_handle = meter_start(m_interval, performMeasurement);
+	return m_handle != NULL;
+}
+
+int modbus_stop(void)
+{
+	return meter_stop(m_handle);
+}
+
+int modbus_join(void)
+{
+	int ret = meter_join(m_handle);
+	disconnect();
+	return ret;
+}
+
+void planBlocks(void)
+{
+	qsort(m_registers, m_numRegisters, sizeof(Modbus_Register), compareRegisters);
+
+	// Extend the current block as long as the gap is small and the
+	// size within the limit of the protocol
+	m_numBlocks = 0;
+	Block* block = NULL;
+	for (int i = 0; i < m_numRegisters; i++) {
+		const Modbus_Register* reg = &m_registers[i];
+		int end = reg->address + getSize(reg->type);
+		if (block && reg->address <= block->address + block->count + MAX_GAP &&
+			end - block->address <= MAX_BLOCK_SIZE)
+		{
+			if (end > block->address + block->count) {
+				block->count = end - block->address;
+			}
+			block->last = i + 1;
+			continue;
+		}
+
+		block = &m_blocks[m_numBlocks++];
+		block->address = reg->address;
+		block->count   = end - reg->address;
+		block->first   = i;
+		block->last    = i + 1;
+	}
+
+	LOG(2, "Reading %d registers with %d requests\n", m_numRegisters, m_numBlocks);
+}
+
+int getSize(Modbus_Type type)
+{
+	return type == MODBUS_INT16 || type == MODBUS_UINT16 ? 1 : 2;
+}
+
+int compareRegisters(const void* a, const void* b)
+{
+	return (int)((const Modbus_Register*)a)->address - (int)((const Modbus_Register*)b)->address;
+}
+
+int sendRequests(uint16_t transaction)
+{
+	unsigned char buffer[MODBUS_MAX_REGISTERS * REQUEST_SIZE];
+	for (int i = 0; i < m_numBlocks; i++) {
+		unsigned char* req = buffer + i * REQUEST_SIZE;
+		uint16_t id = transaction + i;
+		req[0]  = id >> 8;
+		req[1]  = id & 0xff;
+		req[2]  = 0;                       // Protocol identifier
+		req[3]  = 0;
+		req[4]  = 0;                       // Length of the rest
+		req[5]  = 6;
+		req[6]  = m_unit;
+		req[7]  = READ_HOLDING_REGISTERS;
+		req[8]  = m_blocks[i].address >> 8;
+		req[9]  = m_blocks[i].address & 0xff;
+		req[10] = m_blocks[i].count >> 8;
+		req[11] = m_blocks[i].count & 0xff;
+	}
+
+	size_t size = m_numBlocks * REQUEST_SIZE;
+	if (send(m_socket, buffer, size, MSG_NOSIGNAL) != (ssize_t)size) {
+		LOG(1, "Failed to send requests: %s\n", strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+int receiveAll(unsigned char* buffer, size_t size)
+{
+	size_t received = 0;
+	while (received < size) {
+		ssize_t ret = recv(m_socket, buffer + received, size - received, 0);
+		if (ret <= 0) {
+			LOG(1, "Failed to receive response: %s\n",
+				ret == 0 ? "Peer performed orderly shutdown" : strerror(errno));
+			return 0;
+		}
+		received += ret;
+	}
+	return 1;
+}
+
+void decodeBlock(const Block* block, const unsigned char* data, SmartMeter_Data* m)
+{
+	for (int i = block->first; i < block->last; i++) {
+		const Modbus_Register* reg = &m_registers[i];
+		const unsigned char* p = data + 2 * (reg->address - block->address);
+		uint16_t high = (p[0] << 8) | p[1];
+		uint16_t low  = getSize(reg->type) > 1 ? (p[2] << 8) | p[3] : 0;
+		if (reg->type >= MODBUS_INT32_SWAPPED) {
+			uint16_t tmp = high;
+			high = low;
+			low = tmp;
+		}
+		uint32_t raw = ((uint32_t)high << 16) | low;
+
+		double value = 0;
+		switch (reg->type) {
+		case MODBUS_INT16:
+			value = (int16_t)high;
+			break;
+		case MODBUS_UINT16:
+			value = high;
+			break;
+		case MODBUS_INT32:
+		case MODBUS_INT32_SWAPPED:
+			value = (int32_t)raw;
+			break;
+		case MODBUS_UINT32:
+		case MODBUS_UINT32_SWAPPED:
+			value = raw;
+			break;
+		case MODBUS_FLOAT32:
+		case MODBUS_FLOAT32_SWAPPED: {
+			float f;
+			memcpy(&f, &raw, sizeof(f));
+			value = f;
+			break;
+		}
+		}
+
+		m->val[reg->id] = value * reg->scale;
+		m->valid |= SMARTMETER_VAR(reg->id);
+	}
+}
+
+void disconnect(void)
+{
+	io_closeSocket(&m_socket);
+}
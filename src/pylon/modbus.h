@@ -0,0 +1,135 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : modbus
+  Used by   : smlogger
+  Purpose   : Provides operations to read data from Modbus TCP meters. The
+              registers are read in as few blocks as possible, pipelined
+              over one persistent connection.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#ifndef __MODBUS_H
+#define __MODBUS_H
+
+#include <stdint.h>
+
+#include "smartmeter.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Default port of Modbus TCP servers
+#define MODBUS_DEFAULT_PORT "502"
+
+// Maximum number of registers mapped to variables
+#define MODBUS_MAX_REGISTERS 64
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Encodings of the values in the registers. Values of 32 bits span two
+// registers, the high word first unless swapped.
+typedef enum {
+	MODBUS_INT16,
+	MODBUS_UINT16,
+	MODBUS_INT32,
+	MODBUS_UINT32,
+	MODBUS_FLOAT32,
+	MODBUS_INT32_SWAPPED,
+	MODBUS_UINT32_SWAPPED,
+	MODBUS_FLOAT32_SWAPPED
+} Modbus_Type;
+
+// Maps a holding register to a variable
+typedef struct Modbus_Register_s {
+	SmartMeter_VarID id;     // Variable held by the register
+	uint16_t address;        // Address of the (first) register
+	Modbus_Type type;        // Encoding of the value
+	double scale;            // Factor to convert the value to the unit of the variable
+} Modbus_Register;
+
+// Callback used to notify about incoming data
+typedef void(*modbus_cb)(const SmartMeter_Data* m);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Initializes the modbus module
+//   host     : Hostname/IP of the meter
+//   port     : Port of the meter or NULL for the default port
+//   unit     : Unit identifier of the meter
+//   interval : Time interval between two measurements in milliseconds
+//   callback : Function to be called upon data received
+int modbus_init(const char* host, const char* port, int unit, int interval,
+	modbus_cb callback);
+
+// Replaces the register map, by default the one served by modsim
+int modbus_setRegisters(const Modbus_Register* map, int count);
+
+// Loads the register map from the specified file, one 'variable address type
+// [scale]' per line, e.g. 'power-l1 12 float32 1' (see modbus_parseType())
+int modbus_loadRegisters(const char* path);
+
+// Returns the encoding with the specified name (e.g. 'int16', 'float32',
+// 'uint32sw' for swapped words) or -1 if unknown
+int modbus_parseType(const char* name);
+
+// Returns the default register map and its number of entries
+const Modbus_Register* modbus_getDefaultRegisters(int* count);
+
+// Returns the number of requests needed to read all mapped registers
+int modbus_getNumRequests(void);
+
+// Starts the modbus thread in order to perform
+// measurements at the specified time interval
+int modbus_start(void);
+
+// Stops the modbus thread
+int modbus_stop(void);
+
+// Waits for the modbus thread to terminate
+int modbus_join(void);
+
+// Reads a measurement
+int modbus_measure(SmartMeter_Data* m);
+
+#endif // __MODBUS_H
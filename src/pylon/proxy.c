@@ -0,0 +1,620 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : proxy
+  Used by   : smlogger
+  Purpose   : Serves the requests of local clients from the most recent
+              response of a Smart Meter, so the load of the meter does not
+              depend on the number of clients.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "proxy.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <sml/sml_transport.h>
+
+#include "io.h"
+#include "timer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Maximum size of a request
+#define MAX_REQUEST_SIZE 4096
+
+// Maximum size of a response forwarded from the Smart Meter
+#define MAX_RESPONSE_SIZE 65536
+
+// Time in milliseconds to connect to the Smart Meter to forward a request
+#define CONNECT_TIMEOUT 5000
+
+// Time in milliseconds to wait for a session of the proxy to end before
+// forwarding the next request
+#define FORWARD_RETRY_DELAY 100
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Context of a client connection
+typedef struct Client_s {
+	int socket;                       // Socket of the connection
+	IP_Address addr;                  // Address of the client
+	u32 type;                         // Type of the response requested, zero until requested
+	size_t received;                  // Number of bytes in the request buffer
+	unsigned char request[MAX_REQUEST_SIZE];
+	size_t requestLength;             // Length of the pending request
+	unsigned char* response;          // Response to send, NULL while waiting for the meter
+	size_t length;                    // Length of the response
+	size_t sent;                      // Number of bytes sent so far
+	int forwarded;                    // Flag if the request is forwarded to the meter
+	int upstream;                     // Socket to the meter to forward the request
+	int connectId;                    // Pending connection attempt to the meter, 0 if none
+	struct Client_s* nextForward;     // Next client in the queue of forwarded requests
+	struct Client_s* prev;            // Neighbours in the list of clients
+	struct Client_s* next;
+} Client;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Socket accepting connections
+static int m_server = INVALID_SOCKET;
+
+// The Smart Meter served and the maximum age of its responses in milliseconds
+static SmartMeter* m_meter;
+static int m_maxAge;
+
+// The last response of the Smart Meter, its type and the time it was received
+static unsigned char* m_cache;
+static size_t m_cacheLength;
+static u32 m_cacheType;
+static uint64_t m_cacheTime;
+
+// Time a session was last started on behalf of the clients
+static uint64_t m_lastPoll;
+
+// List of connected clients
+static Client* m_clients;
+
+// Number of connected clients
+static int m_count;
+
+// Queue of the requests waiting to be forwarded to the Smart Meter, which
+// handles one connection at a time
+static Client* m_forwardHead;
+static Client* m_forwardTail;
+
+// Client whose request is being forwarded, NULL if none
+static Client* m_forwarding;
+
+// Timer to retry forwarding while a session of the proxy is in progress
+static int m_forwardTimer;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Callback function invoked by the io module upon incoming connections
+static void handleAccept(int sfd);
+
+// Callback function invoked by the io module upon events of a client
+static void handleClient(int sfd, int events, void* arg);
+
+// Handles a complete request of the specified client
+static void handleRequest(Client* client, size_t length);
+
+// Callback function invoked by the smartmeter module upon responses
+static void updateCache(SmartMeter* sm, const unsigned char* frame, size_t length);
+
+// Answers the waiting clients from the cache, closing those it cannot serve
+static void serveClients(void);
+
+// Sends the cached response to the specified client, adapted to its request
+static void respond(Client* client);
+
+// Queues the request of the specified client to be passed on to the Smart
+// Meter, e.g. if the cached response does not answer it
+static void forwardRequest(Client* client);
+
+// Forwards the next queued request unless one is in flight or the proxy polls
+// the Smart Meter
+static void forwardNext(void);
+
+// Callback function invoked by the io module to retry forwarding
+static void handleForwardTimer(int id, void* arg);
+
+// Callback function invoked by the io module once connected to the meter
+static void handleUpstreamConnect(int sfd, void* arg);
+
+// Callback function invoked by the io module upon the response of the meter
+static void handleUpstream(int sfd, int events, void* arg);
+
+// Sends (the rest of) the response to the specified client
+static void sendResponse(Client* client);
+
+// Closes the connection of the specified client and releases its context
+static void closeClient(Client* client);
+
+// Determines the type of the response to the values request in the specified
+// frame, or of the values response in the frame. Returns zero if none.
+static u32 getResponseType(const unsigned char* frame, size_t length);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int proxy_start(SmartMeter* sm, int port, int maxAge)
+{
+	if (m_server != INVALID_SOCKET) {
+		LOG(1, "Proxy already started\n");
+		return 0;
+	}
+
+	// Accept connections on the io loop
+	m_server = io_createServerSocket(port);
+	if (m_server == INVALID_SOCKET || !io_multiplexRead(m_server, "proxy", handleAccept)) {
+		io_closeSocket(&m_server);
+		return 0;
+	}
+
+	// Keep the responses of the Smart Meter
+	m_meter  = sm;
+	m_maxAge = maxAge;
+	smartmeter_setResponseHook(sm, updateCache);
+
+	return 1; // Success
+}
+
+int proxy_count(void)
+{
+	return m_count;
+}
+
+void proxy_stop(void)
+{
+	io_closeSocket(&m_server);
+	if (m_forwardTimer) {
+		io_cancelTimer(m_forwardTimer);
+		m_forwardTimer = 0;
+	}
+	while (m_clients) {
+		closeClient(m_clients);
+	}
+	if (m_meter) {
+		smartmeter_setResponseHook(m_meter, NULL);
+		m_meter = NULL;
+	}
+
+	free(m_cache);
+	m_cache = NULL;
+	m_cacheLength = 0;
+}
+
+void handleAccept(int sfd)
+{
+	// Accept all pending connections
+	struct sockaddr_in sa = {0};
+	socklen_t len = sizeof(sa);
+	int cfd;
+	while ((cfd = accept4(sfd, (struct sockaddr*) &sa, &len, SOCK_NONBLOCK)) != INVALID_SOCKET) {
+		len = sizeof(sa);
+
+		Client* client = calloc(1, sizeof(Client));
+		if (!client) {
+			LOG(0, "Failed to allocate client\n");
+			close(cfd);
+			continue;
+		}
+		client->socket   = cfd;
+		client->addr     = sa.sin_addr;
+		client->upstream = INVALID_SOCKET;
+
+		if (!io_multiplex(cfd, "proxy", IO_READ, handleClient, client)) {
+			close(cfd);
+			free(client);
+			continue;
+		}
+
+		// Add to the list of clients
+		client->next = m_clients;
+		if (m_clients) {
+			m_clients->prev = client;
+		}
+		m_clients = client;
+		m_count++;
+		LOG(3, "Client %s connected (%d connected)\n", inet_ntoa(client->addr), m_count);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		LOG(1, "Failed to accept connection: %s\n", strerror(errno));
+	}
+}
+
+void handleClient(int sfd, int events, void* arg)
+{
+	Client* client = (Client*) arg;
+
+	if (events & IO_WRITE) {
+		sendResponse(client);
+		return;
+	}
+
+	// Read all data available
+	for (;;) {
+		ssize_t ret = recv(sfd, client->request + client->received,
+			sizeof(client->request) - client->received, 0);
+		if (ret == 0) {
+			closeClient(client);
+			return;
+		}
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LOG(1, "Failed to receive from %s: %s\n", inet_ntoa(client->addr), strerror(errno));
+				closeClient(client);
+			}
+			return;
+		}
+		client->received += ret;
+
+		// Ignore further requests while one is pending
+		if (client->type || client->forwarded) {
+			client->received = 0;
+			continue;
+		}
+
+		// Wait until the request is complete
+		size_t length = 0;
+		int found = smartmeter_findFrame(client->request, client->received, &length);
+		if (found < 0 || (found == 0 && client->received == sizeof(client->request))) {
+			LOG(1, "Invalid request from %s\n", inet_ntoa(client->addr));
+			closeClient(client);
+			return;
+		}
+		if (found > 0) {
+			handleRequest(client, length);
+			return;
+		}
+	}
+}
+
+void handleRequest(Client* client, size_t length)
+{
+	client->type = getResponseType(client->request, length);
+	client->requestLength = length;
+	client->received = 0;
+
+	// Leave requests of anything but the values to the Smart Meter
+	if (!client->type || (m_cache && m_cacheType != client->type)) {
+		forwardRequest(client);
+		return;
+	}
+
+	// Answer from the cache if fresh enough
+	uint64_t now = timer_now();
+	if (m_cache && now <= m_cacheTime + m_maxAge) {
+		respond(client);
+		return;
+	}
+
+	// Poll the Smart Meter right away, but at most once per maximum age
+	if (!m_lastPoll || now >= m_lastPoll + m_maxAge) {
+		smartmeter_schedule(m_meter, now);
+		m_lastPoll = now;
+	}
+}
+
+void updateCache(SmartMeter* sm, const unsigned char* frame, size_t length)
+{
+	// Keep the stale response if the session failed
+	if (frame) {
+		unsigned char* cache = realloc(m_cache, length);
+		if (!cache) {
+			LOG(0, "Failed to allocate %d bytes\n", (int)length);
+			return;
+		}
+		memcpy(cache, frame, length);
+		m_cache       = cache;
+		m_cacheLength = length;
+		m_cacheType   = getResponseType(frame, length);
+		m_cacheTime   = timer_now();
+	}
+
+	serveClients();
+
+	// Forward the requests held back during the session
+	forwardNext();
+}
+
+void serveClients(void)
+{
+	Client* client = m_clients;
+	while (client) {
+		Client* next = client->next;
+		if (client->type && !client->response && !client->forwarded) {
+			if (!m_cache) {
+				closeClient(client);
+			} else if (m_cacheType == client->type) {
+				respond(client);
+			} else {
+				forwardRequest(client);
+			}
+		}
+		client = next;
+	}
+}
+
+void respond(Client* client)
+{
+	// Encode the response anew, the client checks the IDs of its request. The
+	// IDs are copied from the request, so the response grows by its size at most.
+	size_t size = m_cacheLength + client->requestLength;
+	client->response = malloc(size);
+	if (!client->response) {
+		LOG(0, "Failed to allocate %d bytes\n", (int)size);
+		closeClient(client);
+		return;
+	}
+	client->length = smartmeter_answer(client->request, client->requestLength,
+		m_cache, m_cacheLength, client->response, size);
+	client->sent   = 0;
+	if (!client->length) {
+		free(client->response);
+		client->response = NULL;
+		forwardRequest(client);
+		return;
+	}
+	sendResponse(client);
+}
+
+void forwardRequest(Client* client)
+{
+	client->forwarded = 1;
+	if (m_forwardTail) {
+		m_forwardTail->nextForward = client;
+	} else {
+		m_forwardHead = client;
+	}
+	m_forwardTail = client;
+	forwardNext();
+}
+
+void forwardNext(void)
+{
+	while (!m_forwarding && m_forwardHead && m_server != INVALID_SOCKET) {
+
+		// Do not compete with the sessions of the proxy for the Smart Meter
+		if (smartmeter_isBusy(m_meter)) {
+			if (!m_forwardTimer) {
+				m_forwardTimer = io_addTimer(FORWARD_RETRY_DELAY, 0, handleForwardTimer, NULL);
+			}
+			return;
+		}
+
+		Client* client = m_forwardHead;
+		m_forwardHead = client->nextForward;
+		if (!m_forwardHead) {
+			m_forwardTail = NULL;
+		}
+		client->nextForward = NULL;
+		m_forwarding = client;
+
+		LOG(3, "Forwarding request of %s\n", inet_ntoa(client->addr));
+		int sfd = io_connect(smartmeter_getHost(m_meter), smartmeter_getPort(m_meter),
+			CONNECT_TIMEOUT, handleUpstreamConnect, client, &client->connectId);
+		if (sfd != INVALID_SOCKET) {
+			handleUpstreamConnect(sfd, client);
+		} else if (!client->connectId) {
+			closeClient(client);
+		}
+	}
+}
+
+void handleForwardTimer(int id, void* arg)
+{
+	m_forwardTimer = 0;
+	forwardNext();
+}
+
+void handleUpstreamConnect(int sfd, void* arg)
+{
+	Client* client = (Client*) arg;
+	client->connectId = 0;
+	client->upstream  = sfd;
+	if (sfd == INVALID_SOCKET) {
+		LOG(1, "Failed to connect to %s to forward a request\n", smartmeter_getHost(m_meter));
+		closeClient(client);
+		return;
+	}
+
+	// The request fits into the send buffer of the fresh connection
+	client->response = malloc(MAX_RESPONSE_SIZE);
+	if (!client->response ||
+		send(sfd, client->request, client->requestLength, MSG_NOSIGNAL) != (ssize_t)client->requestLength ||
+		!io_multiplex(sfd, "proxy-upstream", IO_READ, handleUpstream, client))
+	{
+		LOG(1, "Failed to forward request to %s\n", smartmeter_getHost(m_meter));
+		closeClient(client);
+		return;
+	}
+	client->length = 0;
+	client->sent   = 0;
+}
+
+void handleUpstream(int sfd, int events, void* arg)
+{
+	Client* client = (Client*) arg;
+
+	// Collect the response of the meter to pass it on at once
+	ssize_t ret = recv(sfd, client->response + client->length, MAX_RESPONSE_SIZE - client->length, 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (ret > 0) {
+		client->length += ret;
+		size_t length = 0;
+		int found = smartmeter_findFrame(client->response, client->length, &length);
+		if (found == 0 && client->length < MAX_RESPONSE_SIZE) {
+			return;
+		}
+		if (found > 0) {
+			client->length = length;
+		}
+	}
+
+	// The meter closes the connection after the response anyway
+	io_closeSocket(&client->upstream);
+	m_forwarding = NULL;
+	if (!client->length) {
+		LOG(1, "No response from %s to the forwarded request\n", smartmeter_getHost(m_meter));
+		closeClient(client);
+	} else {
+		sendResponse(client);
+	}
+	forwardNext();
+}
+
+void sendResponse(Client* client)
+{
+	while (client->sent < client->length) {
+		ssize_t size = send(client->socket, client->response + client->sent,
+			client->length - client->sent, MSG_NOSIGNAL);
+		if (size == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				io_multiplex(client->socket, "proxy", IO_WRITE, handleClient, client);
+			} else {
+				LOG(1, "Failed to send to %s: %s\n", inet_ntoa(client->addr), strerror(errno));
+				closeClient(client);
+			}
+			return;
+		}
+		client->sent += size;
+	}
+
+	// Like the Smart Meter, close the connection after the response
+	closeClient(client);
+}
+
+void closeClient(Client* client)
+{
+	if (client->connectId) {
+		io_cancelConnect(client->connectId);
+	}
+	io_closeSocket(&client->upstream);
+	io_closeSocket(&client->socket);
+
+	// Remove from the queue of forwarded requests
+	int forwarding = client == m_forwarding;
+	if (forwarding) {
+		m_forwarding = NULL;
+	} else if (client->forwarded) {
+		Client* prev = NULL;
+		for (Client* it = m_forwardHead; it; prev = it, it = it->nextForward) {
+			if (it == client) {
+				if (prev) {
+					prev->nextForward = client->nextForward;
+				} else {
+					m_forwardHead = client->nextForward;
+				}
+				if (m_forwardTail == client) {
+					m_forwardTail = prev;
+				}
+				break;
+			}
+		}
+	}
+
+	// Remove from the list of clients
+	if (client->prev) {
+		client->prev->next = client->next;
+	} else {
+		m_clients = client->next;
+	}
+	if (client->next) {
+		client->next->prev = client->prev;
+	}
+	m_count--;
+	free(client->response);
+	free(client);
+
+	// Let the next request through if this one was in flight
+	if (forwarding) {
+		forwardNext();
+	}
+}
+
+u32 getResponseType(const unsigned char* frame, size_t length)
+{
+	// Skip start and end sequence of the transport protocol
+	if (length < 16) {
+		return 0;
+	}
+	sml_file* file = sml_file_parse((unsigned char*) frame + 8, length - 16);
+	if (!file) {
+		return 0;
+	}
+
+	u32 type = 0;
+	for (int i = 0; i < file->messages_len && !type; i++) {
+		const sml_message_body* body = file->messages[i] ? file->messages[i]->message_body : NULL;
+		switch (body && body->tag ? *body->tag : 0) {
+		case SML_MESSAGE_GET_PROC_PARAMETER_REQUEST:
+		case SML_MESSAGE_GET_PROC_PARAMETER_RESPONSE:
+			type = SML_MESSAGE_GET_PROC_PARAMETER_RESPONSE;
+			break;
+		case SML_MESSAGE_GET_LIST_REQUEST:
+		case SML_MESSAGE_GET_LIST_RESPONSE:
+			type = SML_MESSAGE_GET_LIST_RESPONSE;
+			break;
+		}
+	}
+
+	sml_file_free(file);
+	return type;
+}
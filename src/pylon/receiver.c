@@ -0,0 +1,349 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : receiver
+  Used by   : smlogger
+  Purpose   : Receives the SML files pushed by Smart Meters and IR readers on
+              their own over TCP or UDP, without polling them.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "receiver.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "io.h"
+#include "timer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Maximum size of an SML transport frame
+#define MAX_FRAME_SIZE 16384
+
+// Time in seconds after which silent connections are probed by the kernel,
+// so connections of devices that went away are closed eventually
+#define KEEPALIVE_IDLE 60
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Context of a connection of a pushing device
+typedef struct Connection_s {
+	int socket;                       // Socket of the connection
+	IP_Address addr;                  // Address of the device
+	uint64_t receiveTime;             // Time in microseconds the current frame began to arrive
+	size_t received;                  // Number of bytes in the buffer
+	unsigned char buffer[MAX_FRAME_SIZE];
+	struct Connection_s* prev;        // Neighbours in the list of connections
+	struct Connection_s* next;
+} Connection;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Sockets accepting connections and receiving datagrams
+static int m_server = INVALID_SOCKET;
+static int m_datagram = INVALID_SOCKET;
+
+// Callback to notify client module about measurements
+static receiver_cb m_callback;
+
+// List of open connections
+static Connection* m_connections;
+
+// Number of open connections
+static int m_count;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Creates the non-blocking socket to receive datagrams
+static int createDatagramSocket(int port);
+
+// Callback function invoked by the io module upon incoming connections
+static void handleAccept(int sfd);
+
+// Callback function invoked by the io module upon data of a connection
+static void handleConnection(int sfd, int events, void* arg);
+
+// Callback function invoked by the io module upon batches of datagrams
+static void handleDatagrams(int sfd, const IO_Datagram* datagrams, int count);
+
+// Passes on all complete frames at the beginning of the buffer and returns the
+// number of bytes consumed
+static size_t handleFrames(unsigned char* buffer, size_t size, IP_Address addr,
+	uint64_t receiveTime);
+
+// Closes the specified connection and releases its context
+static void closeConnection(Connection* conn);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int receiver_start(int port, int protocols, receiver_cb callback)
+{
+	if (m_server != INVALID_SOCKET || m_datagram != INVALID_SOCKET) {
+		LOG(1, "Receiver already started\n");
+		return 0;
+	}
+	m_callback = callback;
+
+	// Accept connections on the io loop
+	if (protocols & RECEIVER_TCP) {
+		m_server = io_createServerSocket(port);
+		if (m_server == INVALID_SOCKET || !io_multiplexRead(m_server, "receiver", handleAccept)) {
+			receiver_stop();
+			return 0;
+		}
+	}
+
+	// Receive datagrams on the io loop
+	if (protocols & RECEIVER_UDP) {
+		m_datagram = createDatagramSocket(port);
+		if (m_datagram == INVALID_SOCKET || !io_multiplexBatch(m_datagram, "receiver",
+			MAX_FRAME_SIZE, handleDatagrams))
+		{
+			receiver_stop();
+			return 0;
+		}
+	}
+
+	return 1; // Success
+}
+
+int receiver_count(void)
+{
+	return m_count;
+}
+
+void receiver_stop(void)
+{
+	io_closeSocket(&m_server);
+	io_closeSocket(&m_datagram);
+	while (m_connections) {
+		closeConnection(m_connections);
+	}
+}
+
+int createDatagramSocket(int port)
+{
+	// Create new UDP socket
+	int sfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	if (sfd == INVALID_SOCKET) {
+		LOG(0, "Failed to initialize socket: %s\n", strerror(errno));
+		return INVALID_SOCKET;
+	}
+
+	// Bind socket to all local addresses
+	struct sockaddr_in sa = {0};
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sfd, (struct sockaddr*) &sa, sizeof(sa)) == -1) {
+		LOG(0, "Failed to bind socket to port %d: %s\n", port, strerror(errno));
+		close(sfd);
+		return INVALID_SOCKET;
+	}
+
+	io_enableTimestamps(sfd);
+	return sfd;
+}
+
+void handleAccept(int sfd)
+{
+	// Accept all pending connections
+	struct sockaddr_in sa = {0};
+	socklen_t len = sizeof(sa);
+	int cfd;
+	while ((cfd = accept4(sfd, (struct sockaddr*) &sa, &len, SOCK_NONBLOCK)) != INVALID_SOCKET) {
+		len = sizeof(sa);
+
+		Connection* conn = malloc(sizeof(Connection));
+		if (!conn) {
+			LOG(0, "Failed to allocate connection\n");
+			close(cfd);
+			continue;
+		}
+		conn->socket   = cfd;
+		conn->addr     = sa.sin_addr;
+		conn->received = 0;
+		conn->prev     = NULL;
+		conn->next     = m_connections;
+
+		// Detect devices that went away without closing the connection
+		int on = 1, idle = KEEPALIVE_IDLE;
+		setsockopt(cfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+		setsockopt(cfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		io_enableTimestamps(cfd);
+
+		if (!io_multiplex(cfd, "receiver", IO_READ, handleConnection, conn)) {
+			close(cfd);
+			free(conn);
+			continue;
+		}
+
+		// Add to the list of connections
+		if (m_connections) {
+			m_connections->prev = conn;
+		}
+		m_connections = conn;
+		m_count++;
+		LOG(2, "Device at %s connected (%d connected)\n", inet_ntoa(conn->addr), m_count);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		LOG(1, "Failed to accept connection: %s\n", strerror(errno));
+	}
+}
+
+void handleConnection(int sfd, int events, void* arg)
+{
+	Connection* conn = (Connection*) arg;
+
+	// Read all data available
+	for (;;) {
+		uint64_t time;
+		ssize_t ret = io_recvTimestamp(sfd, conn->buffer + conn->received,
+			sizeof(conn->buffer) - conn->received, 0, &time);
+		if (ret == 0) {
+			LOG(2, "Device at %s disconnected\n", inet_ntoa(conn->addr));
+			closeConnection(conn);
+			return;
+		}
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LOG(1, "Failed to receive from %s: %s\n", inet_ntoa(conn->addr), strerror(errno));
+				closeConnection(conn);
+			}
+			return;
+		}
+
+		// A frame is stamped with the time its first bytes arrived
+		if (!conn->received) {
+			conn->receiveTime = time;
+		}
+		conn->received += ret;
+
+		// Keep the incomplete frame at the end
+		size_t consumed = handleFrames(conn->buffer, conn->received, conn->addr, conn->receiveTime);
+		if (consumed) {
+			memmove(conn->buffer, conn->buffer + consumed, conn->received - consumed);
+			conn->received -= consumed;
+			conn->receiveTime = time;
+		}
+
+		// Resynchronize on garbage
+		if (conn->received == sizeof(conn->buffer)) {
+			LOG(1, "Frame from %s too long, dropping data\n", inet_ntoa(conn->addr));
+			conn->received = 0;
+		}
+	}
+}
+
+void handleDatagrams(int sfd, const IO_Datagram* datagrams, int count)
+{
+	// Every datagram holds complete frames
+	for (int i = 0; i < count; i++) {
+		const IO_Datagram* d = &datagrams[i];
+		if (handleFrames(d->data, d->size, d->from.sin_addr, d->time) < d->size) {
+			LOG(1, "Incomplete frame from %s\n", inet_ntoa(d->from.sin_addr));
+		}
+	}
+}
+
+size_t handleFrames(unsigned char* buffer, size_t size, IP_Address addr,
+	uint64_t receiveTime)
+{
+	size_t pos = 0;
+	while (pos < size) {
+
+		// Skip data up to the next start sequence
+		pos += smartmeter_seekFrame(buffer + pos, size - pos);
+
+		size_t length = 0;
+		if (smartmeter_findFrame(buffer + pos, size - pos, &length) != 1) {
+			break;
+		}
+
+		// Pass on the measurement
+		SmartMeter_Data m = {{0}};
+		if (smartmeter_decode(buffer + pos, length, &m)) {
+			m.val[TIMESTAMP] = timer_toWallclock(receiveTime);
+			m.valid |= SMARTMETER_VAR(TIMESTAMP);
+			if (m_callback) {
+				m_callback(addr, &m);
+			}
+		} else {
+			LOG(1, "Invalid frame from %s\n", inet_ntoa(addr));
+		}
+		pos += length;
+	}
+
+	return pos;
+}
+
+void closeConnection(Connection* conn)
+{
+	io_closeSocket(&conn->socket);
+
+	// Remove from the list of connections
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		m_connections = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+	m_count--;
+	free(conn);
+}
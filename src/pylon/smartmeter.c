@@ -50,16 +50,86 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <sml/sml_transport.h>
+#include <sml/sml_crc16.h>
 
 #include "io.h"
+#include "uring.h"
+#include "discovery.h"
 #include "common.h"
 #include "timer.h"
 
 ////////////////////////////////////////////////////////////////////////////////
-// STATIC VARIABLES
-///////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Time in milliseconds to establish the connection ahead of a measurement
+#define PRECONNECT_LEAD 250
+
+// Initial and maximum size of the buffer to receive responses
+#define RESPONSE_BUFFER_SIZE 4096
+#define MAX_RESPONSE_SIZE (256 * 1024)
+
+// Maximum size of a request sent by io_uring, which is encoded up front
+#define MAX_REQUEST_SIZE 2048
+
+// Size of the scratch buffer to encode SML files in. libsml writes without
+// bounds checks and integers at their full width, so re-encoded responses may
+// grow to several times their size.
+#define ENCODE_BUFFER_SIZE MAX_RESPONSE_SIZE
+#define MAX_ANSWER_SIZE (ENCODE_BUFFER_SIZE / 8)
+
+// Maximum number of intervals to back off after consecutive failed sessions
+#define MAX_BACKOFF 32
+
+// Parameter tree path of the load profile used to backfill gaps
+// NOTE: This is probably vendor-specific (1-0:99.1.0)
+#define PROFILE_TREE_PATH "0100630100FF"
+
+// Maximum time span in seconds requested from the load profile at once
+#define BACKFILL_CHUNK 3600
+
+// Maximum time span in seconds to backfill after an outage
+#define MAX_BACKFILL (7 * 24 * 3600)
+
+// Maximum time in milliseconds to wait for a load profile response
+#define PROFILE_TIMEOUT 5000
+
+// Minimum time in milliseconds until the next session to request a chunk of
+// the load profile in between
+#define PROFILE_MIN_TIME 250
+
+// Number of times a chunk of the load profile is requested again after the
+// request was aborted for the next session
+#define MAX_PREEMPTIONS 3
+
+// Time in seconds between saving the timestamp of the latest measurement,
+// i.e. at most the part of the history backfilled twice after a crash
+#define TIMELINE_SAVE_INTERVAL 60
+
+// Time in milliseconds after which the Smart Meter is assumed to have moved
+// if it is not heard at its address anymore, but at another one
+#define ADDRESS_TIMEOUT 30000
+
+// Time in milliseconds to wait for multicasts at once
+#define DISCOVERY_TIMEOUT 10000
+
+// Maximum number of variable groups per Smart Meter
+#define MAX_GROUPS 8
+
+// Parameter tree path of the current values
+// NOTE: This is probably vendor-specific
+#define VALUES_TREE_PATH "8181C78501FF"
+
+// Mask of all variables that can be requested
+#define ALL_VALUES (SMARTMETER_ALL & ~SMARTMETER_VAR(TIMESTAMP))
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
 
 // Struct to hold OBIS identification strings
 typedef union OBIS_s {
@@ -72,6 +142,79 @@ typedef struct OBIS_Entry_s {
 	OBIS obis;
 } OBIS_Entry;
 
+// States of a non-blocking session with the Smart Meter
+typedef enum {
+	SESSION_IDLE,        // Waiting for the next poll
+	SESSION_CONNECTING,  // Connection being established
+	SESSION_RECEIVING    // Request sent, waiting for the response
+} SessionState;
+
+// Group of variables polled at its own interval
+typedef struct VariableGroup_s {
+	uint32_t mask;                    // Variables of the group
+	int interval;                     // Time in milliseconds between two measurements
+	uint64_t nextDue;                 // Time in milliseconds the group is due next
+} VariableGroup;
+
+// Types of requests sent to the Smart Meter
+typedef enum {
+	REQUEST_VALUES,      // Current values of the variables
+	REQUEST_PROFILE      // Part of the load profile to backfill a gap
+} RequestType;
+
+// Context of a single Smart Meter
+struct SmartMeter_s {
+	Hostname host;                    // Address of the Smart Meter
+	char port[NI_MAXSERV];            // Port to connect to
+	char* token;                      // Token to identify the measurements
+	int interval;                     // Time in milliseconds between two measurements
+	smartmeter_instance_cb callback;  // Callback to notify about measurements
+	smartmeter_response_cb hook;      // Callback to pass on the raw responses
+	smartmeter_wakeup_cb wakeup;      // Callback to request polling again
+	void* wakeupArg;                  // Argument passed to the wakeup callback
+	int socket;                       // Socket for the TCP connection
+	uint64_t connectTime;             // Time in microseconds to establish the connection
+	int preconnected;                 // Flag if connection was established in advance
+	SmartMeter_Stats stats;           // Timing statistics about the sessions
+
+	// Context of non-blocking sessions
+	SessionState state;               // State of the current session
+	int connectId;                    // Pending connection attempt, zero if none
+	struct addrinfo* addrs;           // Addresses resolved, NULL if unresolved
+	struct sockaddr_storage addr;     // First address for sessions on io_uring
+	socklen_t addrLen;                // Length of the address, zero if unresolved
+	uint64_t nextPoll;                // Time in milliseconds to start the next session
+	int phase;                        // Offset in ms of the wall-clock grid, negative if not aligned
+	uint64_t timeout;                 // Time in milliseconds to abort the current session
+	uint64_t startTime;               // Time in microseconds the current step started
+	uint64_t receiveTime;             // Time in microseconds the response arrived
+	int failures;                     // Number of consecutive failed sessions
+	RequestType request;              // Type of request of the current session
+	uint32_t requested;               // Variables requested in the current session
+	int uring;                        // Flag if the current session runs on io_uring
+	unsigned char requestData[MAX_REQUEST_SIZE]; // Request of the session on io_uring
+
+	// Variables polled at their own intervals, the others are polled every time
+	VariableGroup groups[MAX_GROUPS];
+	int numGroups;
+
+	SmartMeter_Method method;         // Method to request the current values
+
+	// Buffer to receive responses, grows for load profiles
+	unsigned char* buffer;            // Received data
+	size_t capacity;                  // Size of the buffer
+	size_t received;                  // Number of bytes in the buffer
+
+	// Backfilling of gaps from the load profile
+	int minGap;                       // Gap in seconds to backfill, zero if disabled
+	double lastTimestamp;             // Timestamp of the latest measurement
+	double savedTimestamp;            // Timestamp of the latest measurement saved
+	uint32_t backfillBegin;           // Start of the time span still to backfill
+	uint32_t backfillEnd;             // End of the time span still to backfill
+	int preempted;                    // Flag if the profile session is aborted for the next one
+	int preemptions;                  // Number of times the current chunk was aborted
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // STATIC VARIABLES
 ////////////////////////////////////////////////////////////////////////////////
@@ -79,23 +222,41 @@ typedef struct OBIS_Entry_s {
 // Stores context for the thread performing the measurements
 static MeterHandle* m_handle;
 
-// Socket for the TCP connection
-static int m_socket;
+// The Smart Meter accessed through the module functions
+static SmartMeter* m_meter;
 
-// Address of the Smart Meter
-static char m_host[32];
+// Callback to notify client module about measurements
+static smartmeter_cb m_callback;
 
-// Port to connect to
-static const char* m_port;
+// Path of the file to cache the detected address, NULL if disabled
+static const char* m_addressCache;
 
-// Flag to indicate if module was initialized
-static int m_initialized;
+// Directory to save the timelines of the Smart Meters in, NULL if disabled
+static const char* m_timelineCache;
 
-// Time in milliseconds between two measurements
-static int m_interval;
+// Thread processing the multicasts of the Smart Meter while measuring, on an
+// io loop of its own
+static pthread_t m_discoveryThread;
+static IO_Loop* m_discoveryLoop;
+static int m_discovering;
+static int m_discoveryThreadStarted;
 
-// Callback to notify client module about measurements
-static smartmeter_cb m_callback;
+// Another address the Smart Meter has been heard at and the time it was last
+// heard at the address in use, guarded by the lock
+static Hostname m_movedAddress;
+static uint64_t m_lastAnnounced;
+static pthread_mutex_t m_addressLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Flag if the last measurement failed (meter thread only)
+static int m_lastFailed;
+
+// Parameters of the adaptive interval, disabled if the maximum is zero
+static int m_maxInterval;
+static SmartMeter_VarID m_trackedVar;
+static double m_threshold;
+
+// Policy to schedule the measurements
+static Meter_Schedule m_schedule;
 
 // Holds the mappings for OBIS ID to Var ID
 static const OBIS_Entry obisTable[] = {
@@ -114,8 +275,14 @@ static const OBIS_Entry obisTable[] = {
 	{PHASE_ANGLE_VOLTAGE_L3_L1, {"\x01\x00\x51\x07\x02\xff"}},
 	{PHASE_ANGLE_CURRENT_VOLTAGE_L1, {"\x01\x00\x51\x07\x04\xff"}},
 	{PHASE_ANGLE_CURRENT_VOLTAGE_L2, {"\x01\x00\x51\x07\x0f\xff"}},
-	{PHASE_ANGLE_CURRENT_VOLTAGE_L3, {"\x01\x00\x51\x07\x1a\xff"}},	
-	{0}
+	{PHASE_ANGLE_CURRENT_VOLTAGE_L3, {"\x01\x00\x51\x07\x1a\xff"}},
+
+	// Aliases for the power as pushed by many meters (signed, 16.7.0 etc.)
+	{POWER_ALL_PHASES, {"\x01\x00\x10\x07\x00\xff"}},
+	{POWER_L1, {"\x01\x00\x24\x07\x00\xff"}},
+	{POWER_L2, {"\x01\x00\x38\x07\x00\xff"}},
+	{POWER_L3, {"\x01\x00\x4c\x07\x00\xff"}},
+	{INVALID_VARIABLE}
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -123,254 +290,1709 @@ static const OBIS_Entry obisTable[] = {
 ////////////////////////////////////////////////////////////////////////////////
 
 // Connects to the Smart Meter
-static int smartmeter_connect(void);
+static int smartmeter_connect(SmartMeter* sm);
+
+// Disconnects from the Smart Meter
+static void smartmeter_disconnect(SmartMeter* sm);
+
+// Checks if the current connection is still usable
+static int isConnected(SmartMeter* sm);
+
+// Waits for the multicast of the Smart Meter to detect its address
+int detectAddress(Hostname host);
+
+// Functions to cache the detected address
+static int loadAddress(Hostname host);
+static void saveAddress(const char* host);
+
+// Callback function invoked by the discovery module
+static void handleAnnouncement(IP_Address addr);
+
+// Switches to the address the Smart Meter moved to, if any (meter thread only)
+static void applyAddress(void);
+
+// Thread function processing the multicasts of the Smart Meter
+static void* discoveryProc(void* arg);
+
+// Requests the specified variables from the Smart Meter
+static int sendRequest(int sfd, uint32_t variables, SmartMeter_Method method);
+static sml_file* createRequest(uint32_t variables, SmartMeter_Method method);
+
+// Determines the variables due at the specified time
+static uint32_t selectVariables(const SmartMeter* sm, uint64_t now);
+
+// Moves the time (see timer_now()) of a session onto the wall-clock grid if aligned
+static uint64_t alignPoll(const SmartMeter* sm, uint64_t time);
+
+// Schedules the groups of the specified variables measured at the specified time
+static void advanceGroups(SmartMeter* sm, uint32_t measured, uint64_t now);
+
+// Requests the load profile of the specified time span from the Smart Meter
+static int sendProfileRequest(int sfd, uint32_t begin, uint32_t end);
+static sml_file* createProfileRequest(uint32_t begin, uint32_t end);
+
+// Encodes the SML file like sml_transport_write() into the buffer and frees
+// it. Returns the size of the encoded file, or zero if it does not fit. The
+// file must be small enough for the scratch buffer (see ENCODE_BUFFER_SIZE).
+static size_t encodeFile(sml_file* sml, unsigned char* buffer, size_t size);
+
+// Adapts the response to the request of another client, see smartmeter_answer()
+static int adaptResponse(sml_file* response, const sml_file* request);
+
+// Returns the first message with the specified tag in the file, or NULL
+static const sml_message* findMessage(const sml_file* sml, u32 tag);
+
+// Replaces the octet string by a copy of another one
+static void copyString(octet_string** dst, const octet_string* src);
+
+// Checks if the tree paths are equal
+static int equalPaths(const sml_tree_path* a, const sml_tree_path* b);
+
+// Functions to create the parts of SML requests
+static sml_message* createOpenRequest(void);
+static sml_message* createProcParamRequest(u8 groupId, const unsigned char* obis);
+static sml_message* createListRequest(u8 groupId);
+static sml_message* createCloseRequest(u8 groupId);
+static sml_time* createTime(uint32_t timestamp);
+
+// Callback function invoked by the meter thread
+static void performMeasurement(MeterHandle* handle);
+
+// Callback function invoked by the meter thread ahead of a measurement
+static void prepareMeasurement(MeterHandle* handle);
+
+// Forwards measurements of the module's Smart Meter to the client module
+static void notifyClient(SmartMeter* sm, const SmartMeter_Data* m);
+
+// Updates the timing statistics after a successful session
+static void updateStats(SmartMeter* sm, uint64_t responseTime, size_t size,
+	uint64_t decodeTime);
+
+// Decodes the measurement from a complete SML transport frame and checks
+// if all requested variables are included, or any if none requested
+static int decodeResponse(unsigned char* buffer, size_t size, SmartMeter_Data* m,
+	uint32_t requested);
+
+// Returns the number of variables in the specified mask
+static int countVariables(uint32_t mask);
+
+// Returns the variables a response of the current session must hold
+static uint32_t requiredVariables(const SmartMeter* sm);
+
+// Makes room to receive more data into the response buffer
+static int reserveBuffer(SmartMeter* sm);
+
+// Receives a complete SML transport frame into the response buffer (blocking)
+static int receiveFrame(SmartMeter* sm, size_t* length);
+
+// Sets the timestamp of the measurement to the middle of the round trip,
+// as the Smart Meter samples sometime between request and response
+static void stampMeasurement(SmartMeter_Data* m, uint64_t sendTime, uint64_t receiveTime);
+
+// Keeps track of the timestamps of the measurements to detect gaps
+static void trackTimeline(SmartMeter* sm, double timestamp);
+
+// Functions to save the timestamp of the latest measurement, so the gap
+// spanning a restart is detected as well
+static double loadTimeline(const SmartMeter* sm);
+static void saveTimeline(SmartMeter* sm);
+static int getTimelinePath(const SmartMeter* sm, char* path, size_t size);
+
+// Returns the end of the next chunk of the time span to backfill
+static uint32_t backfillChunkEnd(const SmartMeter* sm);
+
+// Reads the next chunk of the time span to backfill (blocking)
+static int readProfile(SmartMeter* sm);
+
+// Decodes a load profile response and passes the entries within the
+// specified time span to the callback
+static int decodeProfile(SmartMeter* sm, unsigned char* buffer, size_t size,
+	uint32_t begin, uint32_t end);
+
+// Functions to perform non-blocking sessions
+static void beginSession(SmartMeter* sm, uint64_t now, RequestType request);
+static void endSession(SmartMeter* sm, int success);
+
+// Resolves the host of the Smart Meter unless done before, returns 0 on failure
+static int resolveHost(SmartMeter* sm);
+
+// Drops the resolved addresses, so the host is resolved again next session
+static void forgetHost(SmartMeter* sm);
+static void handleSocketEvent(int sfd, int events, void* arg);
+static void handleConnect(int sfd, void* arg);
+static void handleConnected(SmartMeter* sm);
+static void handleResponse(SmartMeter* sm);
+
+// Processes the response received so far, returns 0 if incomplete
+static int processResponse(SmartMeter* sm);
+
+// Functions to perform the sessions on io_uring, which connect, send the
+// request and receive the response as a single chain of operations
+static int submitSession(SmartMeter* sm);
+static void handleUringConnect(int result, void* arg);
+static void handleUringSend(int result, void* arg);
+static void handleUringReceive(int result, void* arg);
+
+// Lookup the specified OBIS ID in the table
+static const OBIS_Entry* lookupObis(const octet_string* obis);
+
+// Functions to process SML responses
+static int handleSmlFile(sml_file* file, SmartMeter_Data* m);
+static int handleProcParamResponse(const sml_get_proc_parameter_response* data, SmartMeter_Data* m);
+static int handleListResponse(const sml_get_list_response* data, SmartMeter_Data* m);
+static int handleTree(const sml_tree* tree, SmartMeter_Data* m);
+static int handleParameterValue(const sml_proc_par_value* ppv, SmartMeter_Data* m);
+static int handlePeriodEntry(const sml_period_entry* entry, SmartMeter_Data* m);
+static int handleProfileListResponse(const sml_get_profile_list_response* data,
+	double now, SmartMeter_Data* m);
+
+// Converts the time of an SML entry into a UNIX timestamp, relating second
+// indexes to the local clock by the reference time of the response
+static double convertTime(const sml_time* time, const sml_time* reference, double now);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int smartmeter_init(const char* address, const char* port, int interval,
+	smartmeter_cb callback)
+{
+	// Check if IP of Smart Meter specified
+	Hostname host;
+	if (!address) {
+
+		// Keep listening for the Smart Meter, its address may change. The
+		// multicasts are processed by a thread of their own, so they get a
+		// loop of their own, not to share the sockets of the caller.
+		m_discoveryLoop = io_createLoop();
+		if (!m_discoveryLoop) {
+			return 0;
+		}
+		IO_Loop* loop = io_getLoop();
+		io_setLoop(m_discoveryLoop);
+		if (!discovery_start(handleAnnouncement)) {
+			LOG(0, "Failed to start discovery. Try route add -net 224.0.0.0 netmask 224.0.0.0 eth0\n");
+			io_setLoop(loop);
+			return 0;
+		}
+		m_discovering = 1;
+
+		// Start right away with the address of the last run if available
+		int found = loadAddress(host);
+		if (found) {
+			LOG(2, "Using cached address %s\n", host);
+			m_lastAnnounced = timer_now();
+		} else {
+			found = detectAddress(host);
+		}
+		io_setLoop(loop);
+		if (!found) {
+			LOG(0, "Failed to detect network address\n");
+			return 0;
+		}
+
+		// Use detected address
+		address = host;
+	}
+
+	// Create context
+	m_meter = smartmeter_create(address, port, interval, NULL, notifyClient);
+	if (!m_meter) {
+		return 0;
+	}
+
+	// Set parameters
+	m_callback = callback;
+	return 1;
+}
+
+void performMeasurement(MeterHandle* handle)
+{
+	applyAddress();
+
+	// Perform measurement
+	SmartMeter_Data m = {{0}};
+	m_lastFailed = !smartmeter_read(m_meter, &m);
+	if (m_lastFailed) {
+		LOG(0, "Failed to perform measurement\n");
+		return;
+	}
+
+	// Nothing measured if all variables are polled at lower rates
+	if (!m.valid) {
+		return;
+	}
+
+	// Adapt the interval to the changes of the tracked variable
+	if (m.valid & SMARTMETER_VAR(m_trackedVar)) {
+		meter_track(handle, m.val[m_trackedVar]);
+	}
+
+	// Invoke callback
+	notifyClient(m_meter, &m);
+
+	// Backfill part of a gap in the remaining time of the interval
+	if (m_meter->backfillEnd > m_meter->backfillBegin) {
+		readProfile(m_meter);
+	}
+}
+
+void prepareMeasurement(MeterHandle* handle)
+{
+	applyAddress();
+
+	// Establish the connection for the next measurement, so the request
+	// can be sent right away when it is due
+	if (smartmeter_connect(m_meter)) {
+		m_meter->preconnected = 1;
+	}
+}
+
+void notifyClient(SmartMeter* sm, const SmartMeter_Data* m)
+{
+	if (m_callback) {
+		m_callback(m);
+	} else {
+		LOG(1, "No callback specified\n");
+	}
+}
+
+int smartmeter_start(void)
+{
+	if (!m_meter) {
+		LOG(0, "Module not initialized\n");
+		return 0;
+	}
+
+	m_handle = meter_create(m_meter->interval, performMeasurement);
+	if (!m_handle) {
+		return 0;
+	}
+
+	// Connect in the idle part of the interval
+	int lead = m_meter->interval / 2 < PRECONNECT_LEAD ?
+		m_meter->interval / 2 : PRECONNECT_LEAD;
+	meter_setPrepare(m_handle, prepareMeasurement, lead);
+	meter_setSchedule(m_handle, m_schedule);
+	meter_setAlignment(m_handle, m_meter->phase);
+
+	// Vary the interval between the specified one and the maximum
+	if (m_maxInterval > 0) {
+		meter_setAdaptive(m_handle, m_meter->interval, m_maxInterval, m_threshold);
+	}
+
+	if (!meter_run(m_handle)) {
+		meter_join(m_handle);
+		m_handle = NULL;
+		return 0;
+	}
+
+	// Keep processing the multicasts of the Smart Meter
+	if (m_discovering && !m_discoveryThreadStarted) {
+		int error = pthread_create(&m_discoveryThread, NULL, discoveryProc, NULL);
+		if (error) {
+			LOG(1, "Failed to create discovery thread: %s\n", strerror(error));
+		} else {
+			m_discoveryThreadStarted = 1;
+		}
+	}
+
+	return 1; // Success
+}
+
+int smartmeter_stop(void)
+{
+	__atomic_store_n(&m_discovering, 0, __ATOMIC_RELAXED);
+	return meter_stop(m_handle);
+}
+
+int smartmeter_join(void)
+{
+	int ret = meter_join(m_handle);
+
+	// Wait for the discovery thread as well
+	if (m_discoveryThreadStarted) {
+		pthread_join(m_discoveryThread, NULL);
+		m_discoveryThreadStarted = 0;
+	}
+	if (m_discoveryLoop) {
+		IO_Loop* loop = io_getLoop();
+		io_setLoop(m_discoveryLoop);
+		discovery_stop();
+		io_setLoop(loop);
+		io_freeLoop(m_discoveryLoop);
+		m_discoveryLoop = NULL;
+	}
+
+	return ret;
+}
+
+int smartmeter_setAdaptive(int maxInterval, SmartMeter_VarID id, double threshold)
+{
+	if (id <= TIMESTAMP || id >= NUM_VARIABLES) {
+		LOG(0, "Invalid variable to track: %d\n", id);
+		return 0;
+	}
+
+	m_maxInterval = maxInterval;
+	m_trackedVar  = id;
+	m_threshold   = threshold;
+	return 1; // Success
+}
+
+void smartmeter_setSchedule(Meter_Schedule schedule)
+{
+	m_schedule = schedule;
+}
+
+void smartmeter_setAddressCache(const char* path)
+{
+	m_addressCache = path;
+}
+
+void smartmeter_setTimelineCache(const char* path)
+{
+	if (path && mkdir(path, 0755) == -1 && errno != EEXIST) {
+		LOG(1, "Failed to create '%s': %s\n", path, strerror(errno));
+	}
+	m_timelineCache = path;
+}
+
+int smartmeter_measure(SmartMeter_Data* m)
+{
+	if (!m_meter) {
+		LOG(0, "Module not initialized\n");
+		return 0;
+	}
+
+	return smartmeter_read(m_meter, m);
+}
+
+const char* smartmeter_address(void)
+{
+	return m_meter ? m_meter->host : NULL;
+}
+
+int smartmeter_getStats(SmartMeter_Stats* stats)
+{
+	if (!m_meter || !smartmeter_getMeterStats(m_meter, stats)) {
+		return 0;
+	}
+	stats->missedTicks = meter_getMissedTicks(m_handle);
+	return 1; // Success
+}
+
+SmartMeter* smartmeter_instance(void)
+{
+	return m_meter;
+}
+
+SmartMeter* smartmeter_create(const char* address, const char* port, int interval,
+	const char* token, smartmeter_instance_cb callback)
+{
+	if (!address || !port) {
+		LOG(0, "Address or port not specified\n");
+		return NULL;
+	}
+
+	// Create context
+	SmartMeter* sm = calloc(1, sizeof(SmartMeter));
+	if (!sm) {
+		LOG(0, "Failed to allocate context\n");
+		return NULL;
+	}
+
+	// Copy the provided parameters
+	strncpy(sm->host, address, sizeof(sm->host) - 1);
+	strncpy(sm->port, port, sizeof(sm->port) - 1);
+	if (token) {
+		sm->token = strdup(token);
+		if (!sm->token) {
+			LOG(0, "Failed to copy token\n");
+			free(sm);
+			return NULL;
+		}
+	}
+
+	// Set parameters
+	sm->interval = interval;
+	sm->callback = callback;
+	sm->socket   = INVALID_SOCKET;
+	sm->state    = SESSION_IDLE;
+	sm->phase    = -1;
+
+	return sm;
+}
+
+void smartmeter_free(SmartMeter* sm)
+{
+	if (sm) {
+		if (sm->uring) {
+			uring_cancel(sm);
+		}
+		if (sm->connectId) {
+			io_cancelConnect(sm->connectId);
+		}
+		io_closeSocket(&sm->socket);
+		forgetHost(sm);
+		if (sm->minGap && sm->lastTimestamp > sm->savedTimestamp) {
+			saveTimeline(sm);
+		}
+		free(sm->buffer);
+		free(sm->token);
+		free(sm);
+	}
+}
+
+void smartmeter_setBackfill(SmartMeter* sm, int minGap)
+{
+	sm->minGap = minGap > 0 ? minGap : 0;
+	if (!sm->minGap) {
+		sm->backfillBegin = sm->backfillEnd;
+		return;
+	}
+
+	// Continue the timeline of the previous run, so that an outage of the
+	// gateway is backfilled like one of the Smart Meter
+	if (sm->lastTimestamp <= 0) {
+		sm->lastTimestamp = loadTimeline(sm);
+		sm->savedTimestamp = sm->lastTimestamp;
+	}
+}
+
+int smartmeter_addGroup(SmartMeter* sm, uint32_t mask, int interval)
+{
+	mask &= ALL_VALUES;
+	if (sm->numGroups >= MAX_GROUPS || !mask || interval <= 0) {
+		return 0;
+	}
+
+	// Remove the variables from the existing groups
+	for (int i = 0; i < sm->numGroups; i++) {
+		sm->groups[i].mask &= ~mask;
+	}
+
+	VariableGroup* g = &sm->groups[sm->numGroups++];
+	g->mask = mask;
+	g->interval = interval;
+	g->nextDue = 0;
+	return 1;
+}
+
+void smartmeter_setMethod(SmartMeter* sm, SmartMeter_Method method)
+{
+	sm->method = method;
+}
+
+void smartmeter_setResponseHook(SmartMeter* sm, smartmeter_response_cb hook)
+{
+	sm->hook = hook;
+}
+
+void smartmeter_setWakeupHook(SmartMeter* sm, smartmeter_wakeup_cb hook, void* arg)
+{
+	sm->wakeup    = hook;
+	sm->wakeupArg = arg;
+}
+
+int smartmeter_isBusy(const SmartMeter* sm)
+{
+	return sm->state != SESSION_IDLE;
+}
+
+const char* smartmeter_getHost(const SmartMeter* sm)
+{
+	return sm->host;
+}
+
+const char* smartmeter_getPort(const SmartMeter* sm)
+{
+	return sm->port;
+}
+
+const char* smartmeter_getToken(const SmartMeter* sm)
+{
+	return sm->token ? sm->token : sm->host;
+}
+
+int smartmeter_getMeterStats(const SmartMeter* sm, SmartMeter_Stats* stats)
+{
+	if (!stats) {
+		return 0;
+	}
+
+	*stats = sm->stats;
+	return 1; // Success
+}
+
+int smartmeter_connect(SmartMeter* sm)
+{
+	if (sm->socket != INVALID_SOCKET) {
+
+		// Reuse connection unless dropped by the Smart Meter in the meantime
+		if (isConnected(sm)) {
+			return 1;
+		}
+
+		LOG(3, "Connection went stale, reconnecting\n");
+		smartmeter_disconnect(sm);
+	}
+
+	// Create TCP client socket
+	uint64_t start = timer_nowUs();
+	sm->socket = io_createClientSocket(sm->host, sm->port, sm->interval);
+	sm->connectTime = timer_nowUs() - start;
+	if (sm->socket == INVALID_SOCKET) {
+		return 0;
+	}
+
+	// Timestamp the responses as they arrive
+	io_enableTimestamps(sm->socket);
+	return 1;
+}
+
+void smartmeter_disconnect(SmartMeter* sm)
+{
+	io_closeSocket(&sm->socket);
+	sm->preconnected = 0;
+}
+
+int isConnected(SmartMeter* sm)
+{
+	// Peek without blocking: the Smart Meter is not supposed to send anything
+	// before the request, so only EAGAIN indicates a healthy connection
+	char c;
+	ssize_t ret = recv(sm->socket, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+	return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int detectAddress(Hostname host)
+{
+	// Process the multicasts until the Smart Meter is heard
+	int cnt = 0;
+	while (1) {
+		pthread_mutex_lock(&m_addressLock);
+		int found = m_movedAddress[0] != '\0';
+		if (found) {
+			strcpy(host, m_movedAddress);
+			m_movedAddress[0] = '\0';
+			m_lastAnnounced = timer_now();
+		}
+		pthread_mutex_unlock(&m_addressLock);
+
+		if (found) {
+			break;
+		}
+
+		uint64_t start = timer_now();
+		if (!io_processTimeout(DISCOVERY_TIMEOUT)) {
+			return 0;
+		}
+
+		// Report timeouts
+		if (timer_now() - start >= DISCOVERY_TIMEOUT) {
+			if (cnt == 0) {
+				LOG(1, "Waiting for Smart Meter...\n");
+			}
+			++cnt;
+		}
+	}
+
+	if (cnt > 0) {
+		LOG(1, "Found after retrying %d times\n", cnt);
+	}
+
+	LOG(2, "Found at %s\n", host);
+
+	saveAddress(host);
+	return 1;
+}
+
+int loadAddress(Hostname host)
+{
+	if (!m_addressCache) {
+		return 0;
+	}
+
+	FILE* file = fopen(m_addressCache, "r");
+	if (!file) {
+		return 0;
+	}
+
+	// The file holds a single line with the address
+	int ret = fgets(host, sizeof(Hostname), file) != NULL;
+	fclose(file);
+	if (ret) {
+		host[strcspn(host, " \t\r\n")] = '\0';
+	}
+
+	return ret && host[0] != '\0';
+}
+
+void saveAddress(const char* host)
+{
+	if (!m_addressCache) {
+		return;
+	}
+
+	FILE* file = fopen(m_addressCache, "w");
+	if (!file) {
+		LOG(1, "Failed to cache address in '%s': %s\n", m_addressCache, strerror(errno));
+		return;
+	}
+	fprintf(file, "%s\n", host);
+	fclose(file);
+}
+
+void handleAnnouncement(IP_Address addr)
+{
+	Hostname host;
+	ip_toStr(&addr, host, sizeof(host));
+
+	pthread_mutex_lock(&m_addressLock);
+
+	// The host of the module's Smart Meter is only changed under the lock
+	if (m_meter && strcmp(host, m_meter->host) == 0) {
+		m_lastAnnounced = timer_now();
+		m_movedAddress[0] = '\0';
+	} else if (strcmp(host, m_movedAddress) != 0) {
+		LOG(2, "Smart Meter heard at %s\n", host);
+		strcpy(m_movedAddress, host);
+	}
+
+	pthread_mutex_unlock(&m_addressLock);
+}
+
+void applyAddress(void)
+{
+	pthread_mutex_lock(&m_addressLock);
+
+	// Switch if the current address failed or went silent, e.g. after the
+	// Smart Meter obtained a new address by DHCP
+	if (m_movedAddress[0] != '\0' &&
+		(m_lastFailed || timer_now() - m_lastAnnounced > ADDRESS_TIMEOUT))
+	{
+		LOG(1, "Smart Meter moved from %s to %s\n", m_meter->host, m_movedAddress);
+		smartmeter_disconnect(m_meter);
+		strcpy(m_meter->host, m_movedAddress);
+		forgetHost(m_meter);
+		m_movedAddress[0] = '\0';
+		m_lastAnnounced = timer_now();
+		m_lastFailed = 0;
+		saveAddress(m_meter->host);
+	}
+
+	pthread_mutex_unlock(&m_addressLock);
+}
+
+void* discoveryProc(void* arg)
+{
+	io_setLoop(m_discoveryLoop);
+	while (__atomic_load_n(&m_discovering, __ATOMIC_RELAXED)) {
+		if (!io_processTimeout(1000)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+int smartmeter_read(SmartMeter* sm, SmartMeter_Data* m)
+{
+	// Re-establish connection
+	if (!smartmeter_connect(sm)) {
+		return 0;
+	}
+
+	// Nothing to do if all variables are polled at lower rates
+	uint64_t now = timer_now();
+	m->valid = 0;
+	sm->requested = selectVariables(sm, now);
+	if (!sm->requested) {
+		return 1;
+	}
+
+	// Send request for data
+	uint64_t requestTime = timer_nowUs();
+	if (!sendRequest(sm->socket, sm->requested, sm->method)) {
+		LOG(0, "Failed to send data request\n");
+		smartmeter_disconnect(sm);
+		return 0;
+	}
+
+	// Receive measurement data
+	size_t length = 0;
+	int received = receiveFrame(sm, &length);
+	uint64_t responseTime = timer_nowUs() - requestTime;
+
+	// Retrieve measurement
+	uint64_t decodeTime = timer_nowUs();
+	if (!received || !decodeResponse(sm->buffer, length, m, requiredVariables(sm))) {
+		smartmeter_disconnect(sm);
+		return 0;
+	}
+	decodeTime = timer_nowUs() - decodeTime;
+	stampMeasurement(m, requestTime, sm->receiveTime);
+	advanceGroups(sm, m->valid, now);
+
+	// Keep track of connection and response times
+	updateStats(sm, responseTime, length, decodeTime);
+	trackTimeline(sm, m->val[TIMESTAMP]);
+
+	// The Smart Meter seems to drop the connection after every
+	// measurement, so we need to do it as well
+	smartmeter_disconnect(sm);
+
+	// Success
+	return 1;
+}
+
+int decodeResponse(unsigned char* buffer, size_t size, SmartMeter_Data* m,
+	uint32_t requested)
+{
+	// Skip start and end sequence of the transport protocol
+	if (size < 16) {
+		LOG(0, "Response too short: %d bytes\n", (int)size);
+		return 0;
+	}
+
+	// Parse data using libsml
+	sml_file *file = sml_file_parse(buffer + 8, size - 16);
+	if (!file) {
+		LOG(0, "Failed to parse SML file\n");
+		return 0;
+	}
+
+	// Retrieve measurement
+	handleSmlFile(file, m);
+
+	// Free resources
+	sml_file_free(file);
+
+	// Check if all variables measured
+	if ((m->valid & requested) != requested) {
+		LOG(1, "Only %d of %d variables measured\n",
+			countVariables(m->valid & requested), countVariables(requested));
+		return 0;
+	}
+	if (!(m->valid & ALL_VALUES)) {
+		LOG(1, "No variables measured\n");
+		return 0;
+	}
+
+	return 1; // Success
+}
+
+uint32_t requiredVariables(const SmartMeter* sm)
+{
+	// The values of a list cannot be selected
+	return sm->method == SMARTMETER_GET_LIST ? 0 : sm->requested;
+}
+
+int smartmeter_decode(unsigned char* buffer, size_t size, SmartMeter_Data* m)
+{
+	m->valid = 0;
+	return decodeResponse(buffer, size, m, 0);
+}
+
+size_t smartmeter_answer(const unsigned char* request, size_t requestLength,
+	const unsigned char* response, size_t responseLength,
+	unsigned char* buffer, size_t size)
+{
+	// Skip start and end sequence of the transport protocol
+	if (requestLength < 16 || responseLength < 16) {
+		return 0;
+	}
+
+	// Even written at full width, the IDs and values fit the scratch buffer
+	if (requestLength + responseLength > MAX_ANSWER_SIZE) {
+		LOG(1, "Response of %d bytes too large to answer requests\n", (int)responseLength);
+		return 0;
+	}
+	sml_file* req = sml_file_parse((unsigned char*) request + 8, requestLength - 16);
+	sml_file* res = sml_file_parse((unsigned char*) response + 8, responseLength - 16);
+
+	// The encoding frees the response
+	size_t length = 0;
+	if (req && res && adaptResponse(res, req)) {
+		length = encodeFile(res, buffer, size);
+		res = NULL;
+	}
+
+	if (req) {
+		sml_file_free(req);
+	}
+	if (res) {
+		sml_file_free(res);
+	}
+	return length;
+}
+
+int adaptResponse(sml_file* response, const sml_file* request)
+{
+	const sml_message* open   = findMessage(request, SML_MESSAGE_OPEN_REQUEST);
+	const sml_message* close  = findMessage(request, SML_MESSAGE_CLOSE_REQUEST);
+	const sml_message* params = findMessage(request, SML_MESSAGE_GET_PROC_PARAMETER_REQUEST);
+	const sml_message* list   = findMessage(request, SML_MESSAGE_GET_LIST_REQUEST);
+	if (!open || !close || (!params && !list)) {
+		return 0;
+	}
+	const sml_open_request* openReq = open->message_body->data;
+
+	// Answer every message of the request with the transaction ID it expects
+	int answered = 0;
+	for (int i = 0; i < response->messages_len; i++) {
+		sml_message* msg = response->messages[i];
+		if (!msg || !msg->message_body || !msg->message_body->tag) {
+			return 0;
+		}
+		switch (*msg->message_body->tag) {
+		case SML_MESSAGE_OPEN_RESPONSE: {
+			sml_open_response* openRes = msg->message_body->data;
+			copyString(&openRes->client_id, openReq->client_id);
+			copyString(&openRes->req_file_id, openReq->req_file_id);
+			copyString(&msg->transaction_id, open->transaction_id);
+			break;
+		}
+		case SML_MESSAGE_GET_PROC_PARAMETER_RESPONSE: {
+			// Only the whole tree of the values requested by the session is
+			// known, not other parts of the tree the client may ask for
+			const sml_get_proc_parameter_request* paramsReq = params ? params->message_body->data : NULL;
+			const sml_get_proc_parameter_response* paramsRes = msg->message_body->data;
+			if (!paramsReq || !equalPaths(paramsReq->parameter_tree_path, paramsRes->parameter_tree_path)) {
+				return 0;
+			}
+			copyString(&msg->transaction_id, params->transaction_id);
+			answered = 1;
+			break;
+		}
+		case SML_MESSAGE_GET_LIST_RESPONSE: {
+			// The default list only, other lists may hold other values
+			const sml_get_list_request* listReq = list ? list->message_body->data : NULL;
+			sml_get_list_response* listRes = msg->message_body->data;
+			if (!listReq || listReq->list_name) {
+				return 0;
+			}
+			copyString(&listRes->client_id, listReq->client_id);
+			copyString(&msg->transaction_id, list->transaction_id);
+			answered = 1;
+			break;
+		}
+		case SML_MESSAGE_CLOSE_RESPONSE:
+			copyString(&msg->transaction_id, close->transaction_id);
+			break;
+		default:
+			return 0;
+		}
+	}
+	return answered;
+}
+
+const sml_message* findMessage(const sml_file* sml, u32 tag)
+{
+	for (int i = 0; i < sml->messages_len; i++) {
+		const sml_message* msg = sml->messages[i];
+		if (msg && msg->message_body && msg->message_body->tag &&
+			*msg->message_body->tag == tag && msg->message_body->data)
+		{
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+void copyString(octet_string** dst, const octet_string* src)
+{
+	if (*dst) {
+		sml_octet_string_free(*dst);
+	}
+	*dst = src ? sml_octet_string_init(src->str, src->len) : NULL;
+}
+
+int equalPaths(const sml_tree_path* a, const sml_tree_path* b)
+{
+	if (!a || !b || a->path_entries_len != b->path_entries_len) {
+		return 0;
+	}
+	for (int i = 0; i < a->path_entries_len; i++) {
+		const octet_string* x = a->path_entries[i];
+		const octet_string* y = b->path_entries[i];
+		if (!x || !y || x->len != y->len || memcmp(x->str, y->str, x->len)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int countVariables(uint32_t mask)
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1) {
+		count++;
+	}
+	return count;
+}
+
+uint32_t selectVariables(const SmartMeter* sm, uint64_t now)
+{
+	// Groups due within half an interval are coalesced into this request
+	uint32_t grouped = 0, due = 0;
+	for (int i = 0; i < sm->numGroups; i++) {
+		const VariableGroup* g = &sm->groups[i];
+		grouped |= g->mask;
+		if (g->nextDue <= now + sm->interval / 2) {
+			due |= g->mask;
+		}
+	}
+	return (ALL_VALUES & ~grouped) | due;
+}
+
+void advanceGroups(SmartMeter* sm, uint32_t measured, uint64_t now)
+{
+	for (int i = 0; i < sm->numGroups; i++) {
+		VariableGroup* g = &sm->groups[i];
+		if ((measured & g->mask) == g->mask) {
+
+			// Keep the grid if possible
+			g->nextDue += g->interval;
+			if (g->nextDue <= now) {
+				g->nextDue = now + g->interval;
+			}
+		}
+	}
+}
+
+int reserveBuffer(SmartMeter* sm)
+{
+	if (sm->received < sm->capacity) {
+		return 1;
+	}
+	if (sm->capacity >= MAX_RESPONSE_SIZE) {
+		LOG(1, "%s: Response exceeds %d bytes\n", sm->host, MAX_RESPONSE_SIZE);
+		return 0;
+	}
+
+	// Double the size of the buffer
+	size_t capacity = sm->capacity ? 2 * sm->capacity : RESPONSE_BUFFER_SIZE;
+	unsigned char* buffer = realloc(sm->buffer, capacity);
+	if (!buffer) {
+		LOG(0, "Failed to allocate response buffer\n");
+		return 0;
+	}
+	sm->buffer = buffer;
+	sm->capacity = capacity;
+
+	return 1; // Success
+}
+
+int receiveFrame(SmartMeter* sm, size_t* length)
+{
+	sm->received = 0;
+	while (1) {
+		if (!reserveBuffer(sm)) {
+			return 0;
+		}
+
+		// Receive available data
+		uint64_t time = 0;
+		ssize_t size = io_recvTimestamp(sm->socket, sm->buffer + sm->received,
+			sm->capacity - sm->received, 0, &time);
+
+		LOG(3, "Bytes received: %d\n", (int)size);
+
+		// Check if packet could be read
+		if (size == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(0, "Failed to receive response: %s\n", strerror(errno));
+			return 0;
+		}
+		if (size == 0) {
+			LOG(0, "Failed to receive response: Peer performed orderly shutdown\n");
+			return 0;
+		}
+		if (sm->received == 0) {
+			sm->receiveTime = time;
+		}
+		sm->received += size;
+
+		// Check if the response is complete
+		int ret = smartmeter_findFrame(sm->buffer, sm->received, length);
+		if (ret < 0) {
+			LOG(0, "Invalid response\n");
+			return 0;
+		}
+		if (ret > 0) {
+			return 1; // Success
+		}
+	}
+}
+
+void stampMeasurement(SmartMeter_Data* m, uint64_t sendTime, uint64_t receiveTime)
+{
+	uint64_t roundTrip = receiveTime > sendTime ? receiveTime - sendTime : 0;
+	m->val[TIMESTAMP] = timer_toWallclock(sendTime + roundTrip / 2);
+	m->valid |= SMARTMETER_VAR(TIMESTAMP);
+	m->uncertainty = roundTrip / 1e6;
+}
+
+void trackTimeline(SmartMeter* sm, double timestamp)
+{
+	// Check for a gap since the latest measurement, e.g. after an outage
+	if (sm->minGap && sm->lastTimestamp > 0 &&
+		timestamp - sm->lastTimestamp >= sm->minGap)
+	{
+		uint32_t begin = (uint32_t)sm->lastTimestamp + 1;
+		uint32_t end   = (uint32_t)timestamp;
+
+		// Extend a pending time span, so nothing gets lost
+		if (sm->backfillEnd > sm->backfillBegin && sm->backfillBegin < begin) {
+			begin = sm->backfillBegin;
+		}
+
+		// Limit the history to fetch
+		if (end - begin > MAX_BACKFILL) {
+			LOG(1, "%s: Backfilling only the last %d s of a gap of %u s\n",
+				sm->host, MAX_BACKFILL, end - begin);
+			begin = end - MAX_BACKFILL;
+		}
+
+		LOG(2, "%s: Backfilling gap of %u s from load profile\n", sm->host, end - begin);
+		sm->backfillBegin = begin;
+		sm->backfillEnd   = end;
+	}
+
+	// Ignore measurements older than the latest one
+	if (timestamp > sm->lastTimestamp) {
+		sm->lastTimestamp = timestamp;
+	}
+
+	// Save the timeline now and then rather than with every measurement
+	if (sm->minGap && sm->lastTimestamp - sm->savedTimestamp >= TIMELINE_SAVE_INTERVAL) {
+		saveTimeline(sm);
+	}
+}
+
+double loadTimeline(const SmartMeter* sm)
+{
+	char path[PATH_MAX];
+	if (!getTimelinePath(sm, path, sizeof(path))) {
+		return 0;
+	}
+
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		return 0;
+	}
+
+	// The file holds a single line with the timestamp
+	double timestamp = 0;
+	if (fscanf(file, "%lf", &timestamp) != 1 || timestamp < 0) {
+		LOG(1, "%s: Invalid timeline in '%s'\n", sm->host, path);
+		timestamp = 0;
+	}
+	fclose(file);
+
+	return timestamp;
+}
+
+void saveTimeline(SmartMeter* sm)
+{
+	char path[PATH_MAX], temp[PATH_MAX];
+	if (!getTimelinePath(sm, path, sizeof(path)) ||
+		snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+	{
+		return;
+	}
+
+	// Replace the file at once, so a crash does not leave it truncated
+	FILE* file = fopen(temp, "w");
+	if (!file) {
+		LOG(1, "Failed to save timeline in '%s': %s\n", temp, strerror(errno));
+		return;
+	}
+	int success = fprintf(file, "%.3f\n", sm->lastTimestamp) > 0;
+	success = fclose(file) == 0 && success;
+	if (!success || rename(temp, path) == -1) {
+		LOG(1, "Failed to save timeline in '%s': %s\n", path, strerror(errno));
+		remove(temp);
+		return;
+	}
+	sm->savedTimestamp = sm->lastTimestamp;
+}
+
+int getTimelinePath(const SmartMeter* sm, char* path, size_t size)
+{
+	if (!m_timelineCache) {
+		return 0;
+	}
+
+	// One file per Smart Meter named after its address
+	int length = snprintf(path, size, "%s/", m_timelineCache);
+	if (length < 0 || length + strlen(sm->host) >= size) {
+		return 0;
+	}
+	for (const char* c = sm->host; *c; c++) {
+		path[length++] = *c == '/' ? '_' : *c;
+	}
+	path[length] = '\0';
+	return 1;
+}
+
+uint32_t backfillChunkEnd(const SmartMeter* sm)
+{
+	return sm->backfillEnd - sm->backfillBegin > BACKFILL_CHUNK ?
+		sm->backfillBegin + BACKFILL_CHUNK : sm->backfillEnd;
+}
+
+int readProfile(SmartMeter* sm)
+{
+	uint32_t end = backfillChunkEnd(sm);
+
+	// Request the next chunk of the load profile
+	size_t length = 0;
+	int success = smartmeter_connect(sm) &&
+		sendProfileRequest(sm->socket, sm->backfillBegin, end) &&
+		receiveFrame(sm, &length) &&
+		decodeProfile(sm, sm->buffer, length, sm->backfillBegin, end);
+	smartmeter_disconnect(sm);
+
+	// Do not insist, e.g. if the Smart Meter does not record a load profile
+	if (!success) {
+		LOG(1, "%s: Failed to backfill, dropping %u s of history\n",
+			sm->host, sm->backfillEnd - sm->backfillBegin);
+		sm->backfillBegin = sm->backfillEnd;
+		return 0;
+	}
+
+	sm->backfillBegin = end;
+	return 1; // Success
+}
+
+int decodeProfile(SmartMeter* sm, unsigned char* buffer, size_t size,
+	uint32_t begin, uint32_t end)
+{
+	// Skip start and end sequence of the transport protocol
+	if (size < 16) {
+		LOG(0, "Response too short: %d bytes\n", (int)size);
+		return 0;
+	}
+
+	// Parse data using libsml
+	sml_file *file = sml_file_parse(buffer + 8, size - 16);
+	if (!file) {
+		LOG(0, "Failed to parse SML file\n");
+		return 0;
+	}
+
+	// Every profile list response holds the values of one period
+	double now = time(NULL);
+	int success = 1, count = 0;
+	for (int i = 0; i < file->messages_len; i++) {
+		const sml_message_body* body = file->messages[i] ?
+			file->messages[i]->message_body : NULL;
+		u32 tag = body && body->tag ? *body->tag : 0;
+
+		if (tag == SML_MESSAGE_ATTENTION_RESPONSE) {
+			LOG(1, "%s: Load profile request refused\n", sm->host);
+			success = 0;
+			break;
+		}
+		if (tag != SML_MESSAGE_GET_PROFILE_LIST_RESPONSE) {
+			continue;
+		}
+
+		// Retrieve measurement
+		SmartMeter_Data m = {{0}};
+		if (!handleProfileListResponse((const sml_get_profile_list_response*) body->data, now, &m)) {
+			continue;
+		}
+
+		// Skip periods outside the requested time span
+		if (m.val[TIMESTAMP] < begin || m.val[TIMESTAMP] >= end) {
+			continue;
+		}
+
+		// Pass on with the original timestamp
+		if (sm->callback) {
+			sm->callback(sm, &m);
+		}
+		count++;
+	}
+
+	// Free resources
+	sml_file_free(file);
+
+	LOG(3, "%s: Backfilled %d measurements\n", sm->host, count);
+	return success;
+}
+
+int smartmeter_findFrame(const unsigned char* buffer, size_t size, size_t* length)
+{
+	static const unsigned char escape[] = {0x1b, 0x1b, 0x1b, 0x1b};
+	static const unsigned char begin[]  = {0x01, 0x01, 0x01, 0x01};
+
+	// Check for the start sequence
+	if (size < 8) {
+		return 0;
+	}
+	if (memcmp(buffer, escape, 4) || memcmp(buffer + 4, begin, 4)) {
+		return -1;
+	}
+
+	// Frames are padded to a multiple of four bytes, so escape sequences
+	// can only occur at aligned positions
+	for (size_t pos = 8; pos + 8 <= size; pos += 4) {
+		if (memcmp(buffer + pos, escape, 4) == 0) {
+
+			// Check for the end sequence: 1b1b1b1b 1a <padding> <crc16>
+			if (buffer[pos + 4] == 0x1a) {
+				*length = pos + 8;
+				return 1;
+			}
+
+			// Skip escaped data
+			pos += 4;
+		}
+	}
+
+	return 0; // Incomplete
+}
+
+size_t smartmeter_seekFrame(const unsigned char* buffer, size_t size)
+{
+	static const unsigned char start[] = {0x1b, 0x1b, 0x1b, 0x1b, 0x01, 0x01, 0x01, 0x01};
+
+	const unsigned char* begin = memmem(buffer, size, start, sizeof(start));
+	if (begin) {
+		return begin - buffer;
+	}
+
+	// Keep the bytes that may start a frame with the next data
+	size_t pos = size > sizeof(start) - 1 ? size - (sizeof(start) - 1) : 0;
+	while (pos < size && memcmp(buffer + pos, start, size - pos)) {
+		pos++;
+	}
+	return pos;
+}
+
+uint64_t smartmeter_poll(SmartMeter* sm, uint64_t now)
+{
+	if (sm->state != SESSION_IDLE && now >= sm->timeout) {
+		// Abort session so the schedule is kept
+		if (sm->request == REQUEST_PROFILE && now >= sm->nextPoll) {
+			LOG(3, "%s: Backfilling preempted by the next session\n", sm->host);
+			sm->preempted = 1;
+		} else {
+			LOG(1, "%s: Session timed out\n", sm->host);
+		}
+		endSession(sm, 0);
+	}
+
+	if (sm->state == SESSION_IDLE) {
+		// Start new session if due
+		if (now >= sm->nextPoll) {
+			beginSession(sm, now, REQUEST_VALUES);
+		} else if (sm->backfillEnd > sm->backfillBegin && !sm->failures &&
+			sm->nextPoll - now >= PROFILE_MIN_TIME)
+		{
+			// Use the time until then to backfill a gap
+			beginSession(sm, now, REQUEST_PROFILE);
+		}
+	}
+
+	return sm->state == SESSION_IDLE ? sm->nextPoll : sm->timeout;
+}
+
+void smartmeter_schedule(SmartMeter* sm, uint64_t time)
+{
+	sm->nextPoll = time;
+	if (sm->wakeup) {
+		sm->wakeup(sm, sm->wakeupArg);
+	}
+}
+
+void smartmeter_setAlignment(SmartMeter* sm, int phase)
+{
+	sm->phase = phase < 0 ? -1 : phase;
+
+	// Start at the next tick of the grid
+	if (sm->phase >= 0) {
+		sm->nextPoll = alignPoll(sm, timer_now() + sm->interval / 2);
+	}
+}
+
+int smartmeter_getPhase(const SmartMeter* sm)
+{
+	return sm->phase;
+}
+
+uint64_t alignPoll(const SmartMeter* sm, uint64_t time)
+{
+	if (sm->phase < 0) {
+		return time;
+	}
+	return timer_alignUs(time * 1000, sm->interval, sm->phase) / 1000;
+}
+
+void beginSession(SmartMeter* sm, uint64_t now, RequestType request)
+{
+	sm->request = request;
+	if (request == REQUEST_PROFILE) {
+		// Load profiles may take a while, but must not delay the next session
+		sm->timeout = now + PROFILE_TIMEOUT;
+		if (sm->timeout > sm->nextPoll) {
+			sm->timeout = sm->nextPoll;
+		}
+	} else {
+		// Schedule the next session, keeping the grid if possible
+		sm->nextPoll += sm->interval;
+		if (sm->nextPoll <= now) {
+			sm->nextPoll = now + sm->interval;
+		}
+		sm->nextPoll = alignPoll(sm, sm->nextPoll);
+		sm->timeout = now + sm->interval;
+
+		// Nothing to do if all variables are polled at lower rates
+		sm->requested = selectVariables(sm, now);
+		if (!sm->requested) {
+			return;
+		}
+	}
 
-// Disconnects from the Smart Meter
-static void smartmeter_disconnect(void);
+	// The host is resolved only once as long as sessions succeed, so that
+	// the lookup does not block the event loop every time
+	sm->startTime = timer_nowUs();
+	sm->received = 0;
+	if (!resolveHost(sm)) {
+		endSession(sm, 0);
+		return;
+	}
 
-// Detects the IP of the Smart Meter
-int detectAddress(IP_Address* addr);
+	// Connect, send and receive in one go on io_uring if available. The chain
+	// takes a single address.
+	if (uring_isEnabled()) {
+		if (!submitSession(sm)) {
+			endSession(sm, 0);
+		}
+		return;
+	}
 
-// Requests measurement data from the Smart Meter
-static int sendRequest(void);
+	// Otherwise race all addresses of the host within the session
+	sm->state = SESSION_CONNECTING;
+	int sfd = io_connectTo(sm->addrs, sm->host, (int)(sm->timeout - now),
+		handleConnect, sm, &sm->connectId);
+	if (sfd != INVALID_SOCKET) {
+		handleConnect(sfd, sm);
+	} else if (!sm->connectId) {
+		endSession(sm, 0);
+	}
+}
 
-// Callback function invoked by the meter thread
-static void performMeasurement(MeterHandle* handle);
+void endSession(SmartMeter* sm, int success)
+{
+	if (sm->connectId) {
+		io_cancelConnect(sm->connectId);
+		sm->connectId = 0;
+	}
 
-// Lookup the specified OBIS ID in the table
-static const OBIS_Entry* lookupObis(const octet_string* obis);
+	// Drop the operations still in flight and close along with the next
+	// submission
+	if (sm->uring) {
+		uring_cancel(sm);
+		if (sm->socket != INVALID_SOCKET && !uring_close(sm->socket, 0, NULL, NULL)) {
+			close(sm->socket);
+		}
+		sm->socket = INVALID_SOCKET;
+		sm->uring = 0;
+	}
 
-// Functions to process SML responses
-static int handleSmlFile(sml_file* file, SmartMeter_Data* m);
-static int handleProcParamResponse(const sml_get_proc_parameter_response* data, SmartMeter_Data* m);
-static int handleTree(const sml_tree* tree, SmartMeter_Data* m);
-static int handleParameterValue(const sml_proc_par_value* ppv, SmartMeter_Data* m);
-static int handlePeriodEntry(const sml_period_entry* entry, SmartMeter_Data* m);
+	// The Smart Meter drops the connection after every session anyway
+	io_closeSocket(&sm->socket);
+	sm->state = SESSION_IDLE;
 
+	// The next session may start earlier than the current one timed out
+	if (sm->wakeup) {
+		sm->wakeup(sm, sm->wakeupArg);
+	}
 
-////////////////////////////////////////////////////////////////////////////////
-// IMPLEMENTATION
-////////////////////////////////////////////////////////////////////////////////
+	// Do not insist on backfilling, e.g. if the Smart Meter does not record
+	// a load profile
+	if (sm->request == REQUEST_PROFILE) {
+		int preempted = sm->preempted;
+		sm->preempted = 0;
+		if (success) {
+			sm->preemptions = 0;
+		} else if (preempted && ++sm->preemptions < MAX_PREEMPTIONS) {
+			LOG(3, "%s: Retrying to backfill later\n", sm->host);
+		} else {
+			LOG(1, "%s: Failed to backfill, dropping %u s of history\n",
+				sm->host, sm->backfillEnd - sm->backfillBegin);
+			sm->backfillBegin = sm->backfillEnd;
+			sm->preemptions = 0;
+		}
+		return;
+	}
 
-int smartmeter_init(const char* address, const char* port, int interval, 
-	smartmeter_cb callback)
-{
-	// Check if IP of Smart Meter specified
-	if (!address) {
-	
-		IP_Address ip = NULL_IP;
-		if (!detectAddress(&ip)) {
-			LOG(0, "Failed to detect network address\n");
-			return 0;
+	if (success) {
+		if (sm->failures > 0) {
+			LOG(1, "%s: Recovered after %d failed sessions\n", sm->host, sm->failures);
 		}
-		
-		// Copy detected address
-		ip_toStr(&ip, m_host, sizeof(m_host));
-		
-	} else {
-		// Copy the provided address
-		strncpy(m_host, address, sizeof(m_host));
+		sm->failures = 0;
+		return;
 	}
 
-	// Set parameters
-	m_port = port;
-	m_interval = interval;
-	m_callback = callback;
-	m_socket = INVALID_SOCKET;
-	m_initialized = 1;
-	return 1;
+	// Resolve again next time, the address may have changed
+	forgetHost(sm);
+	if (sm->hook) {
+		sm->hook(sm, NULL, 0);
+	}
+
+	// Back off exponentially so a broken meter does not eat up resources
+	sm->failures++;
+	if (sm->failures > 1) {
+		int factor = sm->failures <= 6 ? 1 << (sm->failures - 1) : MAX_BACKOFF;
+		sm->nextPoll = alignPoll(sm, timer_now() + (uint64_t)factor * sm->interval);
+		LOG(3, "%s: Backing off for %d intervals\n", sm->host, factor);
+	}
 }
 
-void performMeasurement(MeterHandle* handle)
+int resolveHost(SmartMeter* sm)
 {
-	// Perform measurement
-	SmartMeter_Data m = {{0}};
-	if (!smartmeter_measure(&m)) {
-		LOG(0, "Failed to perform measurement\n");
-		return;
+	if (sm->addrs) {
+		return 1;
 	}
-	
-	// Invoke callback
-	if (m_callback) {
-		m_callback(&m);
-	} else {
-		LOG(1, "No callback specified\n");
+	sm->addrs = io_resolveAll(sm->host, sm->port);
+	if (!sm->addrs) {
+		return 0;
 	}
-}
 
-int smartmeter_start(void)
-{
-	if (!m_initialized) {
-		LOG(0, "Module not initialized\n");
+	// Keep a copy of the first address, as operations on io_uring may
+	// outlive the list
+	if (sm->addrs->ai_addrlen > sizeof(sm->addr)) {
+		forgetHost(sm);
 		return 0;
 	}
-	
-	m_handle = meter_start(m_interval, performMeasurement);
-	return m_handle != NULL;
+	memcpy(&sm->addr, sm->addrs->ai_addr, sm->addrs->ai_addrlen);
+	sm->addrLen = sm->addrs->ai_addrlen;
+	return 1;
 }
 
-int smartmeter_stop(void)
+void forgetHost(SmartMeter* sm)
 {
-	return meter_stop(m_handle);
+	io_freeAddresses(sm->addrs);
+	sm->addrs = NULL;
+	sm->addrLen = 0;
 }
 
-int smartmeter_join(void)
+void handleSocketEvent(int sfd, int events, void* arg)
 {
-	return meter_join(m_handle);
+	SmartMeter* sm = (SmartMeter*)arg;
+
+	// Dispatch over session state
+	switch (sm->state) {
+	case SESSION_RECEIVING:
+		if (events & IO_READ) {
+			handleResponse(sm);
+		}
+		break;
+	default:
+		LOG(1, "%s: Unexpected socket event\n", sm->host);
+	}
 }
 
-int smartmeter_connect(void)
+void handleConnect(int sfd, void* arg)
 {
-	if (m_socket != INVALID_SOCKET) {
-		LOG(1, "Already connected\n");
-		return 1;
+	SmartMeter* sm = (SmartMeter*)arg;
+	sm->connectId = 0;
+	if (sfd == INVALID_SOCKET) {
+		LOG(1, "%s: Failed to connect\n", sm->host);
+		endSession(sm, 0);
+		return;
 	}
+	sm->socket = sfd;
+	io_enableTimestamps(sm->socket);
+	handleConnected(sm);
+}
 
-	// Create TCP client socket
-	m_socket = io_createClientSocket(m_host, m_port, m_interval);
+void handleConnected(SmartMeter* sm)
+{
+	uint64_t now = timer_nowUs();
+	sm->connectTime = now - sm->startTime;
+	sm->startTime = now;
+
+	// Send request for data
+	// The request easily fits into the empty send buffer of the new connection
+	int sent = sm->request == REQUEST_PROFILE ?
+		sendProfileRequest(sm->socket, sm->backfillBegin, backfillChunkEnd(sm)) :
+		sendRequest(sm->socket, sm->requested, sm->method);
+	if (!sent) {
+		LOG(1, "%s: Failed to send data request\n", sm->host);
+		endSession(sm, 0);
+		return;
+	}
 
-	return m_socket != INVALID_SOCKET;
+	// Wait for the response
+	io_multiplex(sm->socket, sm->host, IO_READ, handleSocketEvent, sm);
+	sm->state = SESSION_RECEIVING;
 }
 
-void smartmeter_disconnect(void)
+void handleResponse(SmartMeter* sm)
 {
-	io_closeSocket(&m_socket);
+	// Receive available data
+	if (!reserveBuffer(sm)) {
+		endSession(sm, 0);
+		return;
+	}
+	uint64_t time = 0;
+	ssize_t size = io_recvTimestamp(sm->socket, sm->buffer + sm->received,
+		sm->capacity - sm->received, 0, &time);
+	if (size == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return; // Try again later
+		}
+		LOG(1, "%s: Failed to receive response: %s\n", sm->host, strerror(errno));
+		endSession(sm, 0);
+		return;
+	}
+	if (size == 0) {
+		LOG(1, "%s: Failed to receive response: Peer performed orderly shutdown\n", sm->host);
+		endSession(sm, 0);
+		return;
+	}
+	if (sm->received == 0) {
+		sm->receiveTime = time;
+	}
+	sm->received += size;
+	processResponse(sm);
 }
 
-int detectAddress(IP_Address* addr)
+int processResponse(SmartMeter* sm)
 {
-	/* NOTE: 
-	
-     This feature exhibits the fact that the Smart Meter frequently performs 
-	   BRE multicasts.
-	
-	   If no packets are received, the problem may be that the socket
-	   is bound to the wrong interface. In Java, this can be fixed using
-	  
-	   socket.setNetworkInterface(NetworkInterface.getByName("eth0"));
-	  
-	   but I haven't found a way yet to achieve the same in C.
-	         
-	   A workaround is to add a route for the multicast traffic:
-	   
-	   route add -net 224.0.0.0 netmask 224.0.0.0 eth0
-	
-	*/
-
-	struct sockaddr_in sa = {0};
-	
-	// Retry upon timeout to increase robustness
-	int cnt = 0;
-	while (1) {
-	
-		// Create socket to receive BRE multicast
-		int sfd = io_createBroadcastSocket(7259, 10000, "232.0.100.0");
-		if (sfd == INVALID_SOCKET) {
-			LOG(0, "Failed to create multicast socket. Try route add -net 224.0.0.0 netmask 224.0.0.0 eth0\n");
-			return 0;
+	// Wait until the response is complete
+	size_t length = 0;
+	int ret = smartmeter_findFrame(sm->buffer, sm->received, &length);
+	if (ret == 0) {
+		return 0;
+	}
+	uint64_t responseTime = timer_nowUs() - sm->startTime;
+
+	// Pass on the entries of the load profile
+	if (sm->request == REQUEST_PROFILE) {
+		uint32_t end = backfillChunkEnd(sm);
+		int success = ret > 0 && decodeProfile(sm, sm->buffer, length, sm->backfillBegin, end);
+		if (success) {
+			sm->backfillBegin = end;
 		}
-	
-		// Receive a packet
-		size_t len = sizeof(sa);
-		size_t size = recvfrom(sfd, NULL, 0, 0, (struct sockaddr*) &sa, &len);
-	
-		// Cleanup
-		close(sfd);
-	
-		// Check for error
-		if (size == -1) {
-			if (errno == EAGAIN) {
-
-				if (cnt == 0) {
-					LOG(1, "Waiting for Smart Meter...\n");
-				}
-				++cnt;
-				
-				continue; // Try again
-			}
+		endSession(sm, success);
+		return 1;
+	}
 
-			LOG(0, "Failed to receive from socket: %s\n", strerror(errno));
-			return 0;
-		}
-		
-		break; // Success
+	// Retrieve measurement
+	SmartMeter_Data m = {{0}};
+	uint64_t decodeTime = timer_nowUs();
+	if (ret < 0 || !decodeResponse(sm->buffer, length, &m, requiredVariables(sm))) {
+		LOG(1, "%s: Invalid response\n", sm->host);
+		endSession(sm, 0);
+		return 1;
 	}
-	
-	if (cnt > 0) {
-		LOG(1, "Found after retrying %d times\n", cnt);
+	decodeTime = timer_nowUs() - decodeTime;
+	stampMeasurement(&m, sm->startTime, sm->receiveTime);
+	advanceGroups(sm, m.valid, timer_now());
+
+	// Keep track of connection and response times
+	updateStats(sm, responseTime, length, decodeTime);
+	trackTimeline(sm, m.val[TIMESTAMP]);
+	endSession(sm, 1);
+
+	// Pass on responses of all values as they are
+	if (sm->hook && (sm->method == SMARTMETER_GET_LIST ||
+		(sm->requested & ALL_VALUES) == ALL_VALUES))
+	{
+		sm->hook(sm, sm->buffer, length);
+	}
+
+	// Invoke callback
+	if (sm->callback) {
+		sm->callback(sm, &m);
 	}
-	
-	LOG(2, "Found at %s\n", inet_ntoa(sa.sin_addr));
-		
-	*addr = sa.sin_addr;
 	return 1;
 }
 
-int smartmeter_measure(SmartMeter_Data* m)
+int submitSession(SmartMeter* sm)
 {
-	// Re-establish connection
-	if (!smartmeter_connect()) {
+	// Encode the request up front, it is sent as soon as connected
+	sml_file* sml = sm->request == REQUEST_PROFILE ?
+		createProfileRequest(sm->backfillBegin, backfillChunkEnd(sm)) :
+		createRequest(sm->requested, sm->method);
+	size_t size = encodeFile(sml, sm->requestData, sizeof(sm->requestData));
+	if (!size || !reserveBuffer(sm)) {
 		return 0;
 	}
 
-	// Send request for data
-	if (!sendRequest()) {
-		LOG(0, "Failed to send data request\n");
+	sm->socket = socket(sm->addr.ss_family, SOCK_STREAM, 0);
+	if (sm->socket == INVALID_SOCKET) {
+		LOG(0, "Failed to create socket: %s\n", strerror(errno));
 		return 0;
 	}
+	sm->uring = 1;
+	sm->state = SESSION_RECEIVING;
+
+	// The connection completes silently, so its time is not known
+	sm->connectTime = 0;
+
+	// Only a failure or the response wake up the event loop
+	return uring_connect(sm->socket, (struct sockaddr*) &sm->addr, sm->addrLen,
+			URING_LINK | URING_QUIET, handleUringConnect, sm) &&
+		uring_send(sm->socket, sm->requestData, size,
+			URING_LINK | URING_QUIET, handleUringSend, sm) &&
+		uring_recv(sm->socket, sm->buffer, sm->capacity, 0, handleUringReceive, sm);
+}
 
-	// Receive measurement data
-	unsigned char buffer[MTU];
-	size_t size = recv(m_socket, buffer, sizeof(buffer), 0);
+void handleUringConnect(int result, void* arg)
+{
+	SmartMeter* sm = (SmartMeter*)arg;
+	LOG(1, "%s: Failed to connect: %s\n", sm->host, strerror(-result));
+	endSession(sm, 0);
+}
 
-	// Set timestamp of measurement
-	m->val[TIMESTAMP] = time(NULL);
+void handleUringSend(int result, void* arg)
+{
+	SmartMeter* sm = (SmartMeter*)arg;
+	LOG(1, "%s: Failed to send data request: %s\n", sm->host, strerror(-result));
+	endSession(sm, 0);
+}
 
-	LOG(3, "Bytes received: %d\n", size);
-	
-	// Check if packet could be read
-	if (size == -1) {
-		LOG(0, "Failed to receive response: %s\n", strerror(errno));
-		smartmeter_disconnect();
-		return 0;
-	}
-	if (size == 0) {
-		LOG(0, "Failed to receive response: Peer performed orderly shutdown\n");
-		smartmeter_disconnect();
-		return 0;
+void handleUringReceive(int result, void* arg)
+{
+	SmartMeter* sm = (SmartMeter*)arg;
+	if (result <= 0) {
+		LOG(1, "%s: Failed to receive response: %s\n", sm->host,
+			result ? strerror(-result) : "Peer performed orderly shutdown");
+		endSession(sm, 0);
+		return;
 	}
 
-	// Parse data using libsml
-	sml_file *file = sml_file_parse(buffer + 8, size - 16);
-	if (!file) {
-		LOG(0, "Failed to parse SML file\n");
-		smartmeter_disconnect();
-		return 0;
+	// The kernel timestamps are not available, take the time of completion
+	if (sm->received == 0) {
+		sm->receiveTime = timer_nowUs();
 	}
-
-	// Retrieve measurement
-	int numVariables = handleSmlFile(file, m) + 1; // Add one for timestamp
-	
-	// Free resources
-	sml_file_free(file);
-	
-	// Check if all variables measured
-	if (numVariables < NUM_VARIABLES) {
-		LOG(1, "Only %d of %d variables measured\n", numVariables, NUM_VARIABLES);
-		return 0;
+	sm->received += result;
+
+	// Receive the rest of the response
+	if (!processResponse(sm) && (!reserveBuffer(sm) ||
+		!uring_recv(sm->socket, sm->buffer + sm->received, sm->capacity - sm->received,
+			0, handleUringReceive, sm)))
+	{
+		endSession(sm, 0);
 	}
-
-	// The Smart Meter seems to drop the connection after every
-	// measurement, so we need to do it as well
-	smartmeter_disconnect();
-
-	// Success
-	return 1;
 }
 
 int handleSmlFile(sml_file* file, SmartMeter_Data* m)
 {
-	// Iterate over all messages
+	// Iterate over all messages, the variables may be spread over several responses
+	int count = 0, responses = 0;
 	for (int i = 0; i < file->messages_len; i++) {
 
 		// Check message		
@@ -418,7 +2040,9 @@ int handleSmlFile(sml_file* file, SmartMeter_Data* m)
 			break;
 		case SML_MESSAGE_GET_PROC_PARAMETER_RESPONSE:
 			LOG(4, "[SML_MESSAGE_GET_PROC_PARAMETER_RESPONSE]\n");
-			return handleProcParamResponse((const sml_get_proc_parameter_response*) body->data, m);
+			count += handleProcParamResponse((const sml_get_proc_parameter_response*) body->data, m);
+			responses++;
+			break;
 		case SML_MESSAGE_SET_PROC_PARAMETER_REQUEST:
 			LOG(4, "[SML_MESSAGE_SET_PROC_PARAMETER_REQUEST]\n");
 			break;
@@ -430,6 +2054,8 @@ int handleSmlFile(sml_file* file, SmartMeter_Data* m)
 			break;
 		case SML_MESSAGE_GET_LIST_RESPONSE:
 			LOG(4, "[SML_MESSAGE_GET_LIST_RESPONSE]\n");
+			count += handleListResponse((const sml_get_list_response*) body->data, m);
+			responses++;
 			break;
 		case SML_MESSAGE_ATTENTION_RESPONSE:
 			LOG(4, "[SML_MESSAGE_ATTENTION_RESPONSE]\n");
@@ -439,8 +2065,10 @@ int handleSmlFile(sml_file* file, SmartMeter_Data* m)
 		}
 	}	
 
-	LOG(0, "Failed to handle SML file\n");
-	return 0; // Failed
+	if (!responses) {
+		LOG(0, "Failed to handle SML file\n");
+	}
+	return count;
 }
 
 int handleProcParamResponse(const sml_get_proc_parameter_response* data, SmartMeter_Data* m)
@@ -448,6 +2076,20 @@ int handleProcParamResponse(const sml_get_proc_parameter_response* data, SmartMe
 	return handleTree(data->parameter_tree, m);
 }
 
+int handleListResponse(const sml_get_list_response* data, SmartMeter_Data* m)
+{
+	// Entries are handled like those of a period, unknown ones are skipped
+	int count = 0;
+	for (const sml_list* entry = data->val_list; entry; entry = entry->next) {
+		sml_period_entry period = {0};
+		period.obj_name = entry->obj_name;
+		period.scaler   = entry->scaler;
+		period.value    = entry->value;
+		count += handlePeriodEntry(&period, m);
+	}
+	return count;
+}
+
 int handleTree(const sml_tree* tree, SmartMeter_Data* m)
 {
 	if (tree) {
@@ -512,6 +2154,7 @@ int handlePeriodEntry(const sml_period_entry* entry, SmartMeter_Data* m)
 		
 		// Success
 		m->val[obis->id] = value;
+		m->valid |= SMARTMETER_VAR(obis->id);
 		return 1;
 	
 	} else {
@@ -521,57 +2164,247 @@ int handlePeriodEntry(const sml_period_entry* entry, SmartMeter_Data* m)
 	}
 }
 
-int sendRequest(void)
+int handleProfileListResponse(const sml_get_profile_list_response* data,
+	double now, SmartMeter_Data* m)
 {
-	// NOTE: Parts of this code are probably vendor-specific
+	// Determine the original timestamp of the period
+	m->val[TIMESTAMP] = convertTime(data->val_time, data->act_time, now);
+	if (m->val[TIMESTAMP] <= 0) {
+		LOG(1, "Profile entry without timestamp\n");
+		return 0;
+	}
+	m->valid |= SMARTMETER_VAR(TIMESTAMP);
+
+	// Retrieve the values of the period
+	int count = 0;
+	if (data->period_list) {
+		for (int i = 0; i < data->period_list->elems_len; i++) {
+			count += handlePeriodEntry((const sml_period_entry*) data->period_list->elems[i], m);
+		}
+	}
+	return count;
+}
+
+double convertTime(const sml_time* time, const sml_time* reference, double now)
+{
+	if (!time || !time->tag || !time->data.timestamp) {
+		return 0;
+	}
+
+	switch (*time->tag) {
+	case SML_TIME_TIMESTAMP:
+		return *time->data.timestamp;
+	case SML_TIME_SEC_INDEX:
+		// The second index counts from an arbitrary point in time
+		if (reference && reference->tag && *reference->tag == SML_TIME_SEC_INDEX &&
+			reference->data.sec_index)
+		{
+			return now - ((double)*reference->data.sec_index - *time->data.sec_index);
+		}
+		return 0;
+	default:
+		LOG(1, "Unknown time tag: %d\n", *time->tag);
+		return 0;
+	}
+}
+
+int sendRequest(int sfd, uint32_t variables, SmartMeter_Method method)
+{
+	sml_file* sml = createRequest(variables, method);
+	size_t written = sml_transport_write(sfd, sml);
+	sml_file_free(sml);
+	return written > 0;
+}
+
+sml_file* createRequest(uint32_t variables, SmartMeter_Method method)
+{
+	// Create SML file
+	sml_file* sml = sml_file_init();
+	u8 groupId = 2;
+
+	// Open request
+	sml_file_add_message(sml, createOpenRequest());
 
+	// List request, process parameter request for the whole tree of current
+	// values or a request for each single value if only some of them are due
+	if (method == SMARTMETER_GET_LIST) {
+		sml_file_add_message(sml, createListRequest(groupId++));
+	} else if ((variables & ALL_VALUES) == ALL_VALUES) {
+		sml_file_add_message(sml, createProcParamRequest(groupId++, NULL));
+	} else {
+		for (int id = 0; id < NUM_VARIABLES; id++) {
+			const unsigned char* obis = smartmeter_getObis(id);
+			if ((variables & SMARTMETER_VAR(id)) && obis) {
+				sml_file_add_message(sml, createProcParamRequest(groupId++, obis));
+			}
+		}
+	}
+
+	// Close request
+	sml_file_add_message(sml, createCloseRequest(groupId));
+
+	return sml;
+}
+
+int sendProfileRequest(int sfd, uint32_t begin, uint32_t end)
+{
+	sml_file* sml = createProfileRequest(begin, end);
+	size_t written = sml_transport_write(sfd, sml);
+	sml_file_free(sml);
+	return written > 0;
+}
+
+sml_file* createProfileRequest(uint32_t begin, uint32_t end)
+{
 	// Create SML file
 	sml_file* sml = sml_file_init();
 	sml_message* msg = NULL;
 
-	// Open request	
+	// Open request
+	sml_file_add_message(sml, createOpenRequest());
+
+	// Profile list request for the specified time span
 	msg = sml_message_init();
+	msg->group_id = sml_u8_init(2);
+	msg->abort_on_error = sml_u8_init(0);
+	sml_get_profile_list_request* profileReq = sml_get_profile_list_request_init();
+	profileReq->server_id  = sml_octet_string_init_from_hex("FFFFFFFFFFFF");
+	profileReq->begin_time = createTime(begin);
+	profileReq->end_time   = createTime(end);
+	profileReq->parameter_tree_path = sml_tree_path_init();
+	sml_tree_path_add_path_entry(profileReq->parameter_tree_path,
+		sml_octet_string_init_from_hex(PROFILE_TREE_PATH));
+	msg->message_body = sml_message_body_init(SML_MESSAGE_GET_PROFILE_LIST_REQUEST, profileReq);
+	sml_file_add_message(sml, msg);
+
+	// Close request
+	sml_file_add_message(sml, createCloseRequest(3));
+
+	return sml;
+}
+
+size_t encodeFile(sml_file* sml, unsigned char* buffer, size_t size)
+{
+	static const unsigned char escape[] = {0x1b, 0x1b, 0x1b, 0x1b};
+	static const unsigned char begin[]  = {0x01, 0x01, 0x01, 0x01};
+
+	// Encode behind the start sequence into a buffer large enough for any
+	// file accepted, the size of the result is only known afterwards
+	sml_buffer_free(sml->buf);
+	sml->buf = sml_buffer_init(ENCODE_BUFFER_SIZE);
+	sml_buffer* buf = sml->buf;
+	memcpy(buf->buffer, escape, 4);
+	memcpy(buf->buffer + 4, begin, 4);
+	buf->cursor = 8;
+	sml_file_write(sml);
+
+	// Pad and append the end sequence with the checksum
+	size_t length = 0;
+	int padding = buf->cursor % 4 ? 4 - buf->cursor % 4 : 0;
+	if (buf->cursor + padding + 8 <= size) {
+		memset(buf->buffer + buf->cursor, 0, padding);
+		buf->cursor += padding;
+		memcpy(buf->buffer + buf->cursor, escape, 4);
+		buf->cursor += 4;
+		buf->buffer[buf->cursor++] = 0x1a;
+		buf->buffer[buf->cursor++] = padding;
+		u16 crc = sml_crc16_calculate(buf->buffer, buf->cursor);
+		buf->buffer[buf->cursor++] = (crc & 0xff00) >> 8;
+		buf->buffer[buf->cursor++] = crc & 0x00ff;
+
+		length = buf->cursor;
+		memcpy(buffer, buf->buffer, length);
+	} else {
+		LOG(1, "Encoded SML file exceeds %d bytes\n", (int)size);
+	}
+
+	sml_file_free(sml);
+	return length;
+}
+
+sml_message* createOpenRequest(void)
+{
+	sml_message* msg = sml_message_init();
 	msg->group_id = sml_u8_init(1);
 	msg->abort_on_error = sml_u8_init(0);
 	sml_open_request* openReq = sml_open_request_init();
 	openReq->client_id   = sml_octet_string_init_from_hex("010203040506");
-	openReq->req_file_id = sml_octet_string_init_from_hex("51");	
+	openReq->req_file_id = sml_octet_string_init_from_hex("51");
 	openReq->server_id   = sml_octet_string_init_from_hex("FFFFFFFFFFFF");
 	msg->message_body = sml_message_body_init(SML_MESSAGE_OPEN_REQUEST, openReq);
-	sml_file_add_message(sml, msg);
-	
-	// Process parameter request
-	msg = sml_message_init();
-	msg->group_id = sml_u8_init(2);
+	return msg;
+}
+
+sml_message* createProcParamRequest(u8 groupId, const unsigned char* obis)
+{
+	// NOTE: Parts of this code are probably vendor-specific
+	sml_message* msg = sml_message_init();
+	msg->group_id = sml_u8_init(groupId);
 	msg->abort_on_error = sml_u8_init(0);
 	sml_get_proc_parameter_request* procParamReq = sml_get_proc_parameter_request_init();
 	procParamReq->server_id = sml_octet_string_init_from_hex("FFFFFFFFFFFF");
 	procParamReq->parameter_tree_path = sml_tree_path_init();
-	sml_tree_path_add_path_entry(procParamReq->parameter_tree_path, 
-		sml_octet_string_init_from_hex("8181C78501FF"));
+	sml_tree_path_add_path_entry(procParamReq->parameter_tree_path,
+		sml_octet_string_init_from_hex(VALUES_TREE_PATH));
+	if (obis) {
+		sml_tree_path_add_path_entry(procParamReq->parameter_tree_path,
+			sml_octet_string_init((unsigned char*) obis, 6));
+	}
 	msg->message_body = sml_message_body_init(SML_MESSAGE_GET_PROC_PARAMETER_REQUEST, procParamReq);
-	sml_file_add_message(sml, msg);
+	return msg;
+}
 
-	// Close request	
-	msg = sml_message_init();
-	msg->group_id = sml_u8_init(3);
+sml_message* createListRequest(u8 groupId)
+{
+	// Without a list name, the meter responds with its default list
+	sml_message* msg = sml_message_init();
+	msg->group_id = sml_u8_init(groupId);
+	msg->abort_on_error = sml_u8_init(0);
+	sml_get_list_request* listReq = sml_get_list_request_init();
+	listReq->client_id = sml_octet_string_init_from_hex("010203040506");
+	listReq->server_id = sml_octet_string_init_from_hex("FFFFFFFFFFFF");
+	msg->message_body = sml_message_body_init(SML_MESSAGE_GET_LIST_REQUEST, listReq);
+	return msg;
+}
+
+sml_message* createCloseRequest(u8 groupId)
+{
+	sml_message* msg = sml_message_init();
+	msg->group_id = sml_u8_init(groupId);
 	msg->abort_on_error = sml_u8_init(0);
 	sml_close_request* closeReq = sml_close_request_init();
 	msg->message_body = sml_message_body_init(SML_MESSAGE_CLOSE_REQUEST, closeReq);
-	sml_file_add_message(sml, msg);
+	return msg;
+}
 
-	// Send SML file
-	size_t written = sml_transport_write(m_socket, sml);	
-	
-	// Cleanup
-	sml_file_free(sml);
-	
-	return written > 0;
+sml_time* createTime(uint32_t timestamp)
+{
+	sml_time* t = sml_time_init();
+	t->tag = sml_u8_init(SML_TIME_TIMESTAMP);
+	t->data.timestamp = sml_u32_init(timestamp);
+	return t;
 }
 
-const char* smartmeter_address(void)
+void updateStats(SmartMeter* sm, uint64_t responseTime, size_t size,
+	uint64_t decodeTime)
 {
-	return m_host;
+	SmartMeter_Stats* stats = &sm->stats;
+	stats->numSessions++;
+	if (sm->preconnected) {
+		stats->numPreconnected++;
+	}
+	
+	stats->connectTime  = sm->connectTime / 1000.0;
+	stats->responseTime = responseTime / 1000.0;
+	stats->totalConnectTime  += stats->connectTime;
+	stats->totalResponseTime += stats->responseTime;
+	stats->responseSize = size;
+	stats->decodeTime   = decodeTime / 1000.0;
+	stats->totalResponseSize += size;
+	stats->totalDecodeTime   += stats->decodeTime;
+	
+	LOG(3, "%s: Connect: %.3f ms%s, response: %.3f ms\n", sm->host, stats->connectTime, 
+		sm->preconnected ? " (in advance)" : "", stats->responseTime);
 }
 
 const OBIS_Entry* lookupObis(const octet_string* obis)
@@ -579,7 +2412,7 @@ const OBIS_Entry* lookupObis(const octet_string* obis)
 	if (!obis || obis->len > sizeof(OBIS)) {
 		return NULL;
 	}
-	for (const OBIS_Entry* e = obisTable; e->obis.raw; e++) {
+	for (const OBIS_Entry* e = obisTable; e->id != INVALID_VARIABLE; e++) {
 		if (memcmp(obis->str, e->obis.raw, obis->len) == 0) {
 			return e;
 		}
@@ -587,6 +2420,16 @@ const OBIS_Entry* lookupObis(const octet_string* obis)
 	return NULL;
 }
 
+const unsigned char* smartmeter_getObis(SmartMeter_VarID id)
+{
+	for (const OBIS_Entry* e = obisTable; e->id != INVALID_VARIABLE; e++) {
+		if (e->id == id) {
+			return e->obis.raw;
+		}
+	}
+	return NULL;
+}
+
 const char* smartmeter_getVarName(SmartMeter_VarID id)
 {
 	switch (id) {
@@ -44,6 +44,11 @@
 #ifndef __SMARTMETER_H
 #define __SMARTMETER_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include "meter.h"
+
 ////////////////////////////////////////////////////////////////////////////////
 // TYPES
 ////////////////////////////////////////////////////////////////////////////////
@@ -71,14 +76,57 @@ typedef enum {
 	NUM_VARIABLES
 } SmartMeter_VarID;
 
+// Bit of the specified variable in the mask of valid variables
+#define SMARTMETER_VAR(id) (1u << (id))
+
+// Mask of all variables
+#define SMARTMETER_ALL (SMARTMETER_VAR(NUM_VARIABLES) - 1)
+
 // Structure to hold measurement data
 typedef struct SmartMeter_Data_s {
 	double val[NUM_VARIABLES];
+	double uncertainty;  // Uncertainty of the timestamp in seconds, i.e. the round-trip time
+	uint32_t valid;      // Mask of the variables measured (see SMARTMETER_VAR)
 } SmartMeter_Data;
 
+// Opaque type holding the context of a single Smart Meter
+typedef struct SmartMeter_s SmartMeter;
+
 // Callback used to notify about incoming data
 typedef void(*smartmeter_cb)(const SmartMeter_Data* m);
 
+// Callback used to notify about incoming data of a specific Smart Meter
+typedef void(*smartmeter_instance_cb)(SmartMeter* sm, const SmartMeter_Data* m);
+
+// Callback used to pass on the raw SML transport frame of every response of a
+// specific Smart Meter holding all current values, or NULL if a session failed
+typedef void(*smartmeter_response_cb)(SmartMeter* sm, const unsigned char* frame, size_t length);
+
+// Callback used to notify that the time to call smartmeter_poll() again on a
+// specific Smart Meter moved, e.g. as a session ended upon a socket event
+typedef void(*smartmeter_wakeup_cb)(SmartMeter* sm, void* arg);
+
+// Structure to hold timing statistics about the sessions with the Smart Meter
+typedef struct SmartMeter_Stats_s {
+	unsigned int numSessions;      // Number of successful sessions
+	unsigned int numPreconnected;  // Sessions using a connection established in advance
+	double connectTime;            // Time in ms to connect in the last session
+	double responseTime;           // Time in ms between request and response in the last session
+	double totalConnectTime;       // Accumulated connection times in ms
+	double totalResponseTime;      // Accumulated response times in ms
+	size_t responseSize;           // Size in bytes of the response in the last session
+	double decodeTime;             // Time in ms to decode the response in the last session
+	double totalResponseSize;      // Accumulated response sizes in bytes
+	double totalDecodeTime;        // Accumulated decoding times in ms
+	unsigned int missedTicks;      // Ticks skipped or performed late (see meter_getMissedTicks())
+} SmartMeter_Stats;
+
+// Methods to request the current values from a Smart Meter
+typedef enum {
+	SMARTMETER_PROC_PARAMETER = 0, // GetProcParameter request of the parameter tree (default)
+	SMARTMETER_GET_LIST            // GetList request of the flat list of values
+} SmartMeter_Method;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTIONS
@@ -86,17 +134,38 @@ typedef void(*smartmeter_cb)(const SmartMeter_Data* m);
 
 // Initializes the smartmeter module
 //   address  : The IP/Hostname of the Smart Meter to connect or NULL
-//              to detect it automatically
+//              to detect it automatically and follow address changes
 //   port     : The port number/service name of the Smart Meter to connect
 //   interval : The time between two measurements in milliseconds
 //   callback : Function to be called upon data received
 int smartmeter_init(const char* address, const char* port, int interval, 
 	smartmeter_cb callback);
 
+// Sets the path of the file to cache the detected address of the Smart Meter
+// in, so the next start does not have to wait for its multicast. Must be
+// called before smartmeter_init().
+void smartmeter_setAddressCache(const char* path);
+
+// Sets the directory to save the timestamp of the latest measurement of every
+// Smart Meter with backfilling enabled in, so that the gap spanning a restart
+// is backfilled as well (see smartmeter_setBackfill()). The directory is
+// created if missing. Must be called before enabling backfilling.
+void smartmeter_setTimelineCache(const char* path);
+
 // Starts the smartmeter thread in order to perform
 // measurements at the specified time interval
 int smartmeter_start(void);
 
+// Makes the smartmeter thread adapt its interval: it stays at the interval
+// passed to smartmeter_init() while the specified variable changes by more
+// than 'threshold' and backs off up to 'maxInterval' while it does not.
+// Must be called before smartmeter_start().
+int smartmeter_setAdaptive(int maxInterval, SmartMeter_VarID id, double threshold);
+
+// Selects the policy to schedule the measurements (see meter_setSchedule()).
+// Must be called before smartmeter_start().
+void smartmeter_setSchedule(Meter_Schedule schedule);
+
 // Stops the smartmeter thread
 int smartmeter_stop(void);
 
@@ -109,8 +178,116 @@ int smartmeter_measure(SmartMeter_Data* m);
 // Returns the network address of the Smart Meter as a string
 const char* smartmeter_address(void);
 
+// Retrieves the timing statistics about the sessions with the Smart Meter
+int smartmeter_getStats(SmartMeter_Stats* stats);
+
+// Returns the 6-byte OBIS ID of the specified variable or NULL if unknown
+const unsigned char* smartmeter_getObis(SmartMeter_VarID id);
+
+// Checks if the buffer starts with a complete SML transport frame and
+// determines its length. Returns 1 if complete, 0 if more data is required
+// or -1 if the buffer does not start with a frame.
+int smartmeter_findFrame(const unsigned char* buffer, size_t size, size_t* length);
+
+// Returns the offset of the first start sequence of an SML transport frame in
+// the buffer, or of the partial start sequence at its end if there is none.
+// Used to resynchronize on streams that do not start with a frame.
+size_t smartmeter_seekFrame(const unsigned char* buffer, size_t size);
+
+// Decodes the values of a complete SML transport frame as sent by a Smart Meter
+// on its own, e.g. GetList responses. Only the mask of valid variables and their
+// values are set. Returns 1 if at least one variable was decoded.
+int smartmeter_decode(unsigned char* buffer, size_t size, SmartMeter_Data* m);
+
+// Re-encodes the response frame of a session, e.g. as passed to the response
+// hook, as the answer to the request frame of another client, i.e. with the
+// transaction IDs, file ID and client ID of its request. Returns the length of
+// the frame written into the buffer, or zero if the request does not ask for
+// the values in the response, e.g. of another tree path, or if it does not fit.
+size_t smartmeter_answer(const unsigned char* request, size_t requestLength,
+	const unsigned char* response, size_t responseLength,
+	unsigned char* buffer, size_t size);
+
+// Returns the context of the module's Smart Meter or NULL if not initialized
+SmartMeter* smartmeter_instance(void);
+
 // Returns the name of the specified variable ID as a string
 const char* smartmeter_getVarName(SmartMeter_VarID id);
 
+// Creates the context for a single Smart Meter, independent of the 
+// module's Smart Meter used by the functions above
+//   address  : The IP/Hostname of the Smart Meter to connect
+//   port     : The port number/service name of the Smart Meter to connect
+//   interval : The time between two measurements in milliseconds
+//   token    : Token to identify the measurements or NULL to use the address
+//   callback : Function to be called upon data received
+SmartMeter* smartmeter_create(const char* address, const char* port, int interval,
+	const char* token, smartmeter_instance_cb callback);
+
+// Releases the context of the specified Smart Meter
+void smartmeter_free(SmartMeter* sm);
+
+// Receives a measurement from the specified Smart Meter (blocking). The mask of
+// valid variables is empty if no variable was due (see smartmeter_addGroup)
+int smartmeter_read(SmartMeter* sm, SmartMeter_Data* m);
+
+// Advances the non-blocking session with the specified Smart Meter: starts a
+// new session if due or aborts the current one on timeout. Socket events are
+// handled through io_process(). 'now' is the current time as returned by
+// timer_now(). Returns the time when the function needs to be called again.
+uint64_t smartmeter_poll(SmartMeter* sm, uint64_t now);
+
+// Sets the time (see timer_now()) of the next non-blocking session
+void smartmeter_schedule(SmartMeter* sm, uint64_t time);
+
+// Aligns the measurements of the specified Smart Meter to the wall clock at
+// multiples of its interval plus 'phase' milliseconds (see meter_setAlignment()),
+// e.g. to stagger the meters on one bus. Pass a negative phase to disable.
+void smartmeter_setAlignment(SmartMeter* sm, int phase);
+
+// Returns the phase of the specified Smart Meter, negative if not aligned
+int smartmeter_getPhase(const SmartMeter* sm);
+
+// Enables backfilling of gaps of at least 'minGap' seconds between two
+// measurements from the load profile of the specified Smart Meter, or disables
+// it if zero. The history is passed to the callback with its original timestamps
+// in the idle time between measurements.
+void smartmeter_setBackfill(SmartMeter* sm, int minGap);
+
+// Polls the variables in 'mask' only every 'interval' milliseconds instead of
+// in every measurement of the specified Smart Meter. Groups due at about the
+// same time are requested together. Returns 1 on success, 0 if too many groups
+int smartmeter_addGroup(SmartMeter* sm, uint32_t mask, int interval);
+
+// Selects the method to request the current values of the specified Smart Meter.
+// GetList responses are smaller and faster to decode, but hold whatever values
+// the meter lists, so a measurement fails only if none of them is known.
+void smartmeter_setMethod(SmartMeter* sm, SmartMeter_Method method);
+
+// Sets the callback to pass on the raw responses of the non-blocking sessions
+// with the specified Smart Meter, e.g. to serve them to other clients
+void smartmeter_setResponseHook(SmartMeter* sm, smartmeter_response_cb hook);
+
+// Sets the callback invoked when the non-blocking sessions with the specified
+// Smart Meter need to be polled earlier than smartmeter_poll() returned, so
+// that callers need not poll every Smart Meter upon every event
+void smartmeter_setWakeupHook(SmartMeter* sm, smartmeter_wakeup_cb hook, void* arg);
+
+// Returns 1 while a non-blocking session with the specified Smart Meter is in
+// progress, or else 0
+int smartmeter_isBusy(const SmartMeter* sm);
+
+// Returns the network address of the specified Smart Meter
+const char* smartmeter_getHost(const SmartMeter* sm);
+
+// Returns the port or service name of the specified Smart Meter
+const char* smartmeter_getPort(const SmartMeter* sm);
+
+// Returns the token to identify the measurements of the specified Smart Meter
+const char* smartmeter_getToken(const SmartMeter* sm);
+
+// Retrieves the timing statistics about the sessions with the specified Smart Meter
+int smartmeter_getMeterStats(const SmartMeter* sm, SmartMeter_Stats* stats);
+
 #endif // __SMARTMETER_H
 
@@ -0,0 +1,412 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : sniffer
+  Used by   : smlogger
+  Purpose   : Captures the SML responses other clients (e.g. the head-end of
+              the utility) receive from Smart Meters, so measurements are
+              obtained without putting any load on the meters.
+  
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "sniffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include "io.h"
+#include "timer.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Maximum size of a captured packet
+#define MAX_PACKET_SIZE 65536
+
+// Maximum size of an SML transport frame
+#define MAX_FRAME_SIZE 16384
+
+// Maximum size of a segment held back until a reordered segment before it
+// arrives, about the MSS of Ethernet
+#define MAX_HELD_SIZE 2048
+
+// Time in milliseconds after which silent connections are forgotten
+#define FLOW_TIMEOUT 60000
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Direction of a TCP connection from a Smart Meter to a client
+typedef struct Flow_s {
+	IP_Address meter;                 // Address of the Smart Meter
+	IP_Address client;                // Address of the client
+	uint16_t clientPort;              // Port of the client (network byte order)
+	uint32_t expected;                // Sequence number of the next byte
+	uint64_t lastSeen;                // Time in milliseconds of the last segment
+	uint64_t receiveTime;             // Time in microseconds the current frame began to arrive
+	size_t received;                  // Number of bytes in the buffer
+	unsigned char buffer[MAX_FRAME_SIZE];
+	uint32_t heldSeq;                 // Sequence number of the segment held back
+	uint64_t heldTime;                // Time in microseconds the segment arrived
+	size_t heldSize;                  // Size of the segment held back, zero if none
+	unsigned char held[MAX_HELD_SIZE];
+	struct Flow_s* next;              // Next flow in the list
+} Flow;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Socket capturing the packets
+static int m_socket = INVALID_SOCKET;
+
+// Port of the Smart Meters
+static int m_port;
+
+// Callback to notify client module about measurements
+static sniffer_cb m_callback;
+
+// List of the connections followed
+static Flow* m_flows;
+
+// Number of connections followed
+static int m_count;
+
+// Timer to scan the list for silent connections
+static int m_expiryTimer;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Callback function invoked by the io module upon captured packets
+static void handlePacket(int sfd);
+
+// Handles the TCP segment in the specified IP packet
+static void handleSegment(const unsigned char* packet, size_t size, uint64_t time);
+
+// Appends the payload of a segment to the reassembled stream of the flow
+static void appendPayload(Flow* flow, uint32_t seq, const unsigned char* data,
+	size_t size, uint64_t time);
+
+// Passes on all complete frames at the beginning of the buffer of the flow
+static void handleFrames(Flow* flow);
+
+// Looks up the flow of the specified connection, optionally creating it
+static Flow* lookupFlow(IP_Address meter, IP_Address client, uint16_t clientPort,
+	int create);
+
+// Removes the specified flow
+static void removeFlow(Flow* flow);
+
+// Removes the flows that have been silent for too long, invoked by a timer
+// of the io module also while no packets are captured
+static void expireFlows(int id, void* arg);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int sniffer_start(const char* interface, int port, sniffer_cb callback)
+{
+	if (m_socket != INVALID_SOCKET) {
+		LOG(1, "Sniffer already started\n");
+		return 0;
+	}
+
+	m_socket = io_createRawSocket(interface, port);
+	if (m_socket == INVALID_SOCKET) {
+		return 0;
+	}
+	io_enableTimestamps(m_socket);
+
+	// Capture on the io loop
+	m_port = port;
+	m_callback = callback;
+	if (!io_multiplexRead(m_socket, "sniffer", handlePacket)) {
+		io_closeSocket(&m_socket);
+		return 0;
+	}
+	m_expiryTimer = io_addTimer(FLOW_TIMEOUT, FLOW_TIMEOUT, expireFlows, NULL);
+
+	return 1; // Success
+}
+
+int sniffer_count(void)
+{
+	return m_count;
+}
+
+void sniffer_stop(void)
+{
+	io_closeSocket(&m_socket);
+	io_cancelTimer(m_expiryTimer);
+	m_expiryTimer = 0;
+	while (m_flows) {
+		removeFlow(m_flows);
+	}
+}
+
+void handlePacket(int sfd)
+{
+	// Handle all pending packets
+	static unsigned char packet[MAX_PACKET_SIZE];
+	uint64_t time;
+	ssize_t size;
+	while ((size = io_recvTimestamp(sfd, packet, sizeof(packet), 0, &time)) >= 0) {
+		handleSegment(packet, size, time);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		LOG(1, "Failed to receive from socket: %s\n", strerror(errno));
+	}
+}
+
+void handleSegment(const unsigned char* packet, size_t size, uint64_t time)
+{
+	// Check the IP header, the length excludes the padding of short frames
+	const struct iphdr* ip = (const struct iphdr*) packet;
+	if (size < sizeof(struct iphdr) || ip->version != 4 || ip->protocol != IPPROTO_TCP) {
+		return;
+	}
+	size_t ipLength = ip->ihl * 4;
+	size_t totalLength = ntohs(ip->tot_len);
+	if (totalLength > size || ipLength + sizeof(struct tcphdr) > totalLength) {
+		return;
+	}
+
+	// Check the TCP header
+	const struct tcphdr* tcp = (const struct tcphdr*)(packet + ipLength);
+	size_t tcpLength = tcp->doff * 4;
+	if (ntohs(tcp->source) != m_port || ipLength + tcpLength > totalLength) {
+		return;
+	}
+	IP_Address meter  = {ip->saddr};
+	IP_Address client = {ip->daddr};
+
+	// Aborted connections are forgotten right away
+	if (tcp->rst) {
+		Flow* flow = lookupFlow(meter, client, tcp->dest, 0);
+		if (flow) {
+			removeFlow(flow);
+		}
+		return;
+	}
+
+	// Follow new connections from their beginning
+	uint32_t seq = ntohl(tcp->seq);
+	size_t payload = totalLength - ipLength - tcpLength;
+	Flow* flow = lookupFlow(meter, client, tcp->dest, tcp->syn || payload > 0);
+	if (!flow) {
+		return;
+	}
+	flow->lastSeen = time / 1000;
+	if (tcp->syn) {
+		flow->expected = seq + 1;
+		flow->received = 0;
+		flow->heldSize = 0;
+	}
+
+	// Reassemble the stream
+	if (payload > 0) {
+		appendPayload(flow, seq, packet + ipLength + tcpLength, payload, time);
+		handleFrames(flow);
+	}
+
+	if (tcp->fin) {
+		removeFlow(flow);
+	}
+}
+
+void appendPayload(Flow* flow, uint32_t seq, const unsigned char* data,
+	size_t size, uint64_t time)
+{
+	// Start following connections captured in the middle at any segment
+	if (flow->received == 0 && flow->expected == 0) {
+		flow->expected = seq;
+	}
+
+	// Trim retransmitted data
+	int32_t offset = (int32_t)(seq - flow->expected);
+	if (offset < 0) {
+		if ((size_t)-offset >= size) {
+			return;
+		}
+		data += -offset;
+		size -= -offset;
+	} else if (offset > 0) {
+		// Hold a single segment back, in case the one before it was merely
+		// reordered
+		if (!flow->heldSize && size <= sizeof(flow->held)) {
+			memcpy(flow->held, data, size);
+			flow->heldSeq  = seq;
+			flow->heldTime = time;
+			flow->heldSize = size;
+			return;
+		}
+
+		// Segments missed cannot be recovered, resynchronize on the next frame
+		LOG(2, "Missed %d bytes from %s\n", (int)offset, inet_ntoa(flow->meter));
+		flow->received = 0;
+		flow->heldSize = 0;
+	}
+	flow->expected = seq + (offset < 0 ? -offset : 0) + size;
+
+	// Drop data exceeding the buffer, e.g. load profiles
+	if (flow->received + size > sizeof(flow->buffer)) {
+		LOG(2, "Response from %s too long, dropping data\n", inet_ntoa(flow->meter));
+		flow->received = 0;
+		if (size > sizeof(flow->buffer)) {
+			return;
+		}
+	}
+
+	// A frame is stamped with the time its first bytes arrived
+	if (flow->received == 0) {
+		flow->receiveTime = time;
+	}
+	memcpy(flow->buffer + flow->received, data, size);
+	flow->received += size;
+
+	// Append the segment held back once the gap before it is filled
+	if (flow->heldSize && (int32_t)(flow->heldSeq - flow->expected) <= 0) {
+		size_t heldSize = flow->heldSize;
+		flow->heldSize = 0;
+		appendPayload(flow, flow->heldSeq, flow->held, heldSize, flow->heldTime);
+	}
+}
+
+void handleFrames(Flow* flow)
+{
+	size_t pos = 0;
+	while (pos < flow->received) {
+
+		// Skip data up to the next start sequence, e.g. after segments missed
+		pos += smartmeter_seekFrame(flow->buffer + pos, flow->received - pos);
+
+		size_t length = 0;
+		if (smartmeter_findFrame(flow->buffer + pos, flow->received - pos, &length) != 1) {
+			break;
+		}
+
+		// Pass on the measurement
+		SmartMeter_Data m = {{0}};
+		if (smartmeter_decode(flow->buffer + pos, length, &m)) {
+			m.val[TIMESTAMP] = timer_toWallclock(flow->receiveTime);
+			m.valid |= SMARTMETER_VAR(TIMESTAMP);
+			if (m_callback) {
+				m_callback(flow->meter, &m);
+			}
+		} else {
+			LOG(3, "Frame from %s without values\n", inet_ntoa(flow->meter));
+		}
+		pos += length;
+	}
+
+	// Keep the incomplete frame
+	if (pos > 0) {
+		memmove(flow->buffer, flow->buffer + pos, flow->received - pos);
+		flow->received -= pos;
+	}
+}
+
+Flow* lookupFlow(IP_Address meter, IP_Address client, uint16_t clientPort,
+	int create)
+{
+	for (Flow* flow = m_flows; flow; flow = flow->next) {
+		if (flow->meter.s_addr == meter.s_addr && flow->client.s_addr == client.s_addr &&
+			flow->clientPort == clientPort)
+		{
+			return flow;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	// Add new flow
+	Flow* flow = calloc(1, sizeof(Flow));
+	if (!flow) {
+		LOG(0, "Failed to allocate flow\n");
+		return NULL;
+	}
+	flow->meter      = meter;
+	flow->client     = client;
+	flow->clientPort = clientPort;
+	flow->next       = m_flows;
+	m_flows = flow;
+	m_count++;
+	LOG(3, "Following connection of %s (%d followed)\n", inet_ntoa(meter), m_count);
+	return flow;
+}
+
+void removeFlow(Flow* flow)
+{
+	for (Flow** it = &m_flows; *it; it = &(*it)->next) {
+		if (*it == flow) {
+			*it = flow->next;
+			m_count--;
+			free(flow);
+			return;
+		}
+	}
+}
+
+void expireFlows(int id, void* arg)
+{
+	uint64_t now = timer_now();
+	Flow** it = &m_flows;
+	while (*it) {
+		Flow* flow = *it;
+		if (flow->lastSeen + FLOW_TIMEOUT <= now) {
+			*it = flow->next;
+			m_count--;
+			free(flow);
+		} else {
+			it = &flow->next;
+		}
+	}
+}
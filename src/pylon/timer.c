@@ -46,11 +46,39 @@
 
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "common.h"
 
+// Maximum rate to slew the wall-clock time towards the system clock
+// (like NTP, in parts per million)
+#define MAX_SLEW_RATE 500
+
+// Offsets in microseconds beyond which the system clock is adopted right
+// away instead of slewed towards (like NTP)
+#define MAX_SLEW_OFFSET 128000LL
+
+// Rate to slew the wall-clock time after the system clock stepped backwards
+// (in parts per million), so that the time runs at half speed until caught up
+#define MAX_STEP_SLEW_RATE 500000
+
 uint64_t startTime = 0;
 
+// Offset in microseconds of the wall-clock time to the monotonic clock
+static int64_t m_offset;
+
+// Monotonic time in microseconds the offset was last updated
+static uint64_t m_offsetTime;
+
+// Latest wall-clock time in microseconds handed out for the current time
+static int64_t m_latest;
+
+// Flag if the wall-clock time is catching up with a backward step
+static int m_steppedBack;
+
+// Lock for the offset, which is shared by all threads
+static pthread_mutex_t m_offsetLock = PTHREAD_MUTEX_INITIALIZER;
+
 uint64_t timer_now(void) {
 
 	// Query monotonic clock
@@ -64,6 +92,84 @@ uint64_t timer_now(void) {
 	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+uint64_t timer_nowUs(void) {
+
+	// Query monotonic clock
+	struct timespec ts = {0};
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		LOG(0, "Failed to get timestamp: %s\n", strerror(errno));
+		return 0;
+	}
+	
+	// Return timespec as microseconds
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+double timer_wallclock(void)
+{
+	return timer_toWallclock(timer_nowUs());
+}
+
+double timer_toWallclock(uint64_t time)
+{
+	// Query both clocks
+	struct timespec rt = {0}, mt = {0};
+	if (clock_gettime(CLOCK_REALTIME, &rt) == -1 ||
+		clock_gettime(CLOCK_MONOTONIC, &mt) == -1)
+	{
+		LOG(0, "Failed to get timestamp: %s\n", strerror(errno));
+		return 0;
+	}
+	uint64_t now = (uint64_t)mt.tv_sec * 1000000 + mt.tv_nsec / 1000;
+	int64_t offset = ((int64_t)rt.tv_sec * 1000000 + rt.tv_nsec / 1000) - (int64_t)now;
+
+	pthread_mutex_lock(&m_offsetLock);
+
+	// Follow the system clock, but slew small corrections in gradually, so
+	// that the measurements neither jitter nor leave gaps
+	int64_t diff = offset - m_offset;
+	int64_t elapsed = now > m_offsetTime ? (int64_t)(now - m_offsetTime) : 0;
+	int64_t limit = elapsed * MAX_SLEW_RATE / 1000000;
+	if (m_offsetTime == 0 || diff > MAX_SLEW_OFFSET) {
+		if (m_offsetTime != 0) {
+			LOG(1, "System clock stepped by %.3f s\n", diff / 1e6);
+		}
+		m_offset = offset;
+		m_steppedBack = 0;
+	} else if (diff < -MAX_SLEW_OFFSET || (m_steppedBack && diff < 0)) {
+
+		// Slow the time down after a backward step instead of holding it, so
+		// that the measurements neither travel back in time nor share a
+		// timestamp
+		if (!m_steppedBack) {
+			LOG(1, "System clock stepped by %.3f s, slowing down\n", diff / 1e6);
+			m_steppedBack = 1;
+		}
+		int64_t step = elapsed * MAX_STEP_SLEW_RATE / 1000000;
+		m_offset = step < -diff ? m_offset - step : offset;
+	} else if (diff > limit) {
+		m_offset += limit;
+	} else if (diff < -limit) {
+		m_offset -= limit;
+	} else {
+		m_offset = offset;
+		m_steppedBack = 0;
+	}
+	m_offsetTime = now;
+	offset = m_offset;
+
+	// Keep the time strictly increasing, e.g. if another thread read the
+	// monotonic clock later but got the lock first
+	if ((int64_t)now + offset <= m_latest) {
+		offset = m_latest + 1 - (int64_t)now;
+	}
+	m_latest = (int64_t)now + offset;
+
+	pthread_mutex_unlock(&m_offsetLock);
+
+	return ((int64_t)time + offset) / 1e6;
+}
+
 void timer_start(void)
 {
 	startTime = timer_now();
@@ -82,6 +188,20 @@ int timer_restart(void)
 	return elapsed;
 }
 
+uint64_t timer_alignUs(uint64_t time, int interval, int phase)
+{
+	if (interval <= 0) {
+		return time;
+	}
+
+	// Position of the time within the wall-clock period
+	int64_t period = (int64_t)interval * 1000;
+	int64_t wall = (int64_t)(timer_toWallclock(time) * 1e6) - (int64_t)phase * 1000;
+	int64_t offset = (wall % period + period) % period;
+
+	return offset < period / 2 ? time - offset : time + (period - offset);
+}
+
 int timer_sleep(int interval)
 {
 	struct timespec ts;
@@ -94,6 +214,21 @@ int timer_sleep(int interval)
 	return 1; // Success 
 }
 
+int timer_sleepUntil(uint64_t deadline)
+{
+	// Sleeping until an absolute time neither accumulates the latency of the
+	// wakeup nor restarts after signals with the full remainder
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+	int error;
+	while ((error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) != 0) {
+		if (error != EINTR) return 0; // Failed
+	}
+
+	return 1; // Success
+}
+
 int timer_barrier(uint64_t* barrier, int interval, int* elapsed)
 {
 	int ret = 0;
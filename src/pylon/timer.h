@@ -65,9 +65,32 @@ int timer_restart(void);
 // Returns the current POSIX timestamp
 uint64_t timer_now(void);
 
+// Returns the current monotonic timestamp in microseconds
+uint64_t timer_nowUs(void);
+
+// Returns the current POSIX wall-clock time in seconds with microsecond
+// resolution. It is derived from the monotonic clock, slews towards small
+// corrections of the system clock, adopts large forward steps at once, but
+// runs at half speed after backward steps until caught up instead of going
+// backwards.
+double timer_wallclock(void);
+
+// Converts the specified monotonic timestamp in microseconds (see timer_nowUs())
+// into wall-clock time consistent with timer_wallclock()
+double timer_toWallclock(uint64_t time);
+
+// Returns the monotonic time in microseconds (see timer_nowUs()) nearest to
+// 'time' at which the wall-clock time (see timer_wallclock()) is a multiple of
+// 'interval' plus 'phase' milliseconds, e.g. a whole second for 1000 and 0
+uint64_t timer_alignUs(uint64_t time, int interval, int phase);
+
 // Sleeps for the specified time interval in milliseconds
 int timer_sleep(int interval);
 
+// Sleeps until the specified monotonic time in microseconds (see timer_nowUs()).
+// Returns immediately if the time has passed already.
+int timer_sleepUntil(uint64_t deadline);
+
 // Ensures that subsequent code is not executed more often than every 'interval'
 // milliseconds. 'barrier' is a pointer to an u64 integer variable holding context
 // between subsequent calls, 'elapsed' returns the effective time in milliseconds
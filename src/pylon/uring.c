@@ -0,0 +1,529 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : uring
+  Used by   : smartmeter, smlogger
+  Purpose   : Provides an optional io_uring ring to submit chains of socket
+              operations with a single system call. Completions are reaped
+              on the io event loop.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "uring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "io.h"
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// User data of the operations whose completions are ignored, e.g. cancellations
+#define IGNORED_OPERATION UINT64_MAX
+
+// Index marking the end of the lists of operations
+#define NO_OPERATION -1
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Struct to hold an operation in flight, identified by its index in the table
+typedef struct Operation_s {
+	Uring_cb callback;    // Callback invoked upon completion, NULL if cancelled
+	void* arg;            // Argument passed to the callback
+	int flags;            // Flags the operation was queued with
+	int busy;             // Flag if the operation is in flight
+	int skip;             // Flag if the kernel skips the completion upon success
+	int prev;             // Operation linked to this one, or the next free one
+	int next;             // Operation this one is linked to
+} Operation;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Every thread running an event loop may set up a ring of its own
+
+// Descriptor of the ring and its event descriptor signalling completions
+static __thread int m_ringFd = INVALID_SOCKET;
+static __thread int m_eventFd = INVALID_SOCKET;
+
+// Memory shared with the kernel
+static __thread void* m_ringMemory;
+static __thread size_t m_ringSize;
+static __thread struct io_uring_sqe* m_sqes;
+static __thread size_t m_sqesSize;
+
+// Submission queue
+static __thread unsigned int* m_sqHead;
+static __thread unsigned int* m_sqTail;
+static __thread unsigned int* m_sqArray;
+static __thread unsigned int m_sqMask;
+static __thread unsigned int m_sqEntries;
+static __thread unsigned int m_numQueued;
+
+// Completion queue
+static __thread unsigned int* m_cqHead;
+static __thread unsigned int* m_cqTail;
+static __thread unsigned int m_cqMask;
+static __thread struct io_uring_cqe* m_cqes;
+
+// Operations in flight, at most one per completion queue entry
+static __thread Operation* m_operations;
+static __thread unsigned int m_numOperations;
+static __thread int m_freeOperation;
+
+// Last operation and entry queued if the next one is linked to it
+static __thread int m_linkedOperation = NO_OPERATION;
+static __thread struct io_uring_sqe* m_linkedSqe;
+
+// Flag if the kernel can skip the completions of successful operations
+static __thread int m_canSkip;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Maps the queues shared with the kernel
+static int mapRing(const struct io_uring_params* p);
+
+// Returns a cleared submission queue entry for the operation with the
+// specified flags, or NULL if the ring is full
+static struct io_uring_sqe* queueOperation(int flags, Uring_cb callback, void* arg);
+
+// Ends the chain at the last operation queued, e.g. if the next one cannot
+// be queued, so that it completes like any other
+static void breakChain(void);
+
+// Releases the operation and the ones linked to it before, which completed
+// without posting a completion
+static void releaseOperation(int index);
+
+// Drops the operations linked after a failed one, which the kernel cancels.
+// Their completions are skipped as well if the failed one skipped its own.
+static void dropLinked(int index, int skipped);
+
+// Callback to reap the completions upon the ring signals the event descriptor
+static void handleCompletions(int sfd, int events, void* arg);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int uring_init(unsigned int entries)
+{
+	if (m_ringFd != INVALID_SOCKET) {
+		LOG(1, "Ring already set up\n");
+		return 0;
+	}
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	m_ringFd = syscall(__NR_io_uring_setup, entries, &p);
+	if (m_ringFd == INVALID_SOCKET) {
+		LOG(1, "io_uring not available: %s\n", strerror(errno));
+		return 0;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !mapRing(&p)) {
+		LOG(1, "Failed to map ring\n");
+		uring_deinit();
+		return 0;
+	}
+#ifdef IORING_FEAT_CQE_SKIP
+	m_canSkip = (p.features & IORING_FEAT_CQE_SKIP) != 0;
+#endif
+
+	// Every completion queue entry may belong to an operation in flight
+	m_numOperations = p.cq_entries;
+	m_operations = calloc(m_numOperations, sizeof(Operation));
+	if (!m_operations) {
+		LOG(0, "Failed to allocate operations\n");
+		uring_deinit();
+		return 0;
+	}
+	for (unsigned int i = 0; i < m_numOperations; i++) {
+		m_operations[i].prev = i + 1 < m_numOperations ? (int)i + 1 : NO_OPERATION;
+	}
+	m_freeOperation = 0;
+
+	// Let the ring wake up the io event loop
+	m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_eventFd == INVALID_SOCKET ||
+		syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_EVENTFD, &m_eventFd, 1) == -1 ||
+		!io_multiplex(m_eventFd, "uring", IO_READ, handleCompletions, NULL))
+	{
+		LOG(0, "Failed to register event descriptor: %s\n", strerror(errno));
+		uring_deinit();
+		return 0;
+	}
+
+	LOG(2, "Using io_uring with %u entries%s\n", p.sq_entries,
+		m_canSkip ? "" : " (without skipping completions)");
+	return 1; // Success
+}
+
+void uring_deinit(void)
+{
+	io_closeSocket(&m_eventFd);
+	if (m_ringMemory) {
+		munmap(m_ringMemory, m_ringSize);
+		m_ringMemory = NULL;
+	}
+	if (m_sqes) {
+		munmap(m_sqes, m_sqesSize);
+		m_sqes = NULL;
+	}
+	if (m_ringFd != INVALID_SOCKET) {
+		close(m_ringFd);
+		m_ringFd = INVALID_SOCKET;
+	}
+	free(m_operations);
+	m_operations = NULL;
+	m_numOperations = 0;
+	m_numQueued = 0;
+	m_linkedOperation = NO_OPERATION;
+	m_linkedSqe = NULL;
+}
+
+int uring_isEnabled(void)
+{
+	return m_eventFd != INVALID_SOCKET;
+}
+
+int uring_connect(int sfd, const struct sockaddr* sa, socklen_t len, int flags,
+	Uring_cb callback, void* arg)
+{
+	struct io_uring_sqe* sqe = queueOperation(flags, callback, arg);
+	if (!sqe) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd     = sfd;
+	sqe->addr   = (uintptr_t)sa;
+	sqe->off    = len;
+	return 1; // Success
+}
+
+int uring_send(int sfd, const void* buffer, size_t size, int flags,
+	Uring_cb callback, void* arg)
+{
+	struct io_uring_sqe* sqe = queueOperation(flags, callback, arg);
+	if (!sqe) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd     = sfd;
+	sqe->addr   = (uintptr_t)buffer;
+	sqe->len    = size;
+	return 1; // Success
+}
+
+int uring_recv(int sfd, void* buffer, size_t size, int flags,
+	Uring_cb callback, void* arg)
+{
+	struct io_uring_sqe* sqe = queueOperation(flags, callback, arg);
+	if (!sqe) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd     = sfd;
+	sqe->addr   = (uintptr_t)buffer;
+	sqe->len    = size;
+	return 1; // Success
+}
+
+int uring_close(int sfd, int flags, Uring_cb callback, void* arg)
+{
+	struct io_uring_sqe* sqe = queueOperation(flags, callback, arg);
+	if (!sqe) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd     = sfd;
+	return 1; // Success
+}
+
+void uring_cancel(void* arg)
+{
+	// Operations are few, a linear search is cheaper than maintaining an index
+	int count = 0;
+	for (unsigned int i = 0; i < m_numOperations; i++) {
+		Operation* op = &m_operations[i];
+		if (!op->busy || op->arg != arg || !op->callback) {
+			continue;
+		}
+		op->callback = NULL;
+
+		// Operations completed already are not found, which does no harm
+		struct io_uring_sqe* sqe = queueOperation(0, NULL, NULL);
+		if (sqe) {
+			sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+			sqe->fd        = -1;
+			sqe->addr      = i;
+			sqe->user_data = IGNORED_OPERATION;
+			count++;
+		}
+	}
+
+	// Cancel right away, the buffers may be released after return
+	if (count) {
+		uring_submit();
+	}
+}
+
+int uring_submit(void)
+{
+	if (!m_numQueued) {
+		return 1;
+	}
+
+	// Chains do not span submissions
+	breakChain();
+
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, m_ringFd, m_numQueued, 0, 0, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		LOG(0, "Failed to submit operations: %s\n", strerror(errno));
+		return 0;
+	}
+	m_numQueued -= ret;
+	return 1; // Success
+}
+
+int mapRing(const struct io_uring_params* p)
+{
+	// Both queues share a single mapping (IORING_FEAT_SINGLE_MMAP)
+	size_t sqSize = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	size_t cqSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	m_ringSize = sqSize > cqSize ? sqSize : cqSize;
+	m_ringMemory = mmap(NULL, m_ringSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+	if (m_ringMemory == MAP_FAILED) {
+		m_ringMemory = NULL;
+		return 0;
+	}
+
+	m_sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		m_sqes = NULL;
+		return 0;
+	}
+
+	unsigned char* ring = m_ringMemory;
+	m_sqHead    = (unsigned int*)(ring + p->sq_off.head);
+	m_sqTail    = (unsigned int*)(ring + p->sq_off.tail);
+	m_sqArray   = (unsigned int*)(ring + p->sq_off.array);
+	m_sqMask    = *(unsigned int*)(ring + p->sq_off.ring_mask);
+	m_sqEntries = p->sq_entries;
+	m_cqHead    = (unsigned int*)(ring + p->cq_off.head);
+	m_cqTail    = (unsigned int*)(ring + p->cq_off.tail);
+	m_cqMask    = *(unsigned int*)(ring + p->cq_off.ring_mask);
+	m_cqes      = (struct io_uring_cqe*)(ring + p->cq_off.cqes);
+	return 1; // Success
+}
+
+struct io_uring_sqe* queueOperation(int flags, Uring_cb callback, void* arg)
+{
+	if (m_ringFd == INVALID_SOCKET) {
+		LOG(0, "Ring not set up\n");
+		return NULL;
+	}
+
+	// Check for room in the submission queue and for the completion
+	unsigned int tail = *m_sqTail;
+	if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+		LOG(1, "Submission queue full\n");
+		breakChain();
+		return NULL;
+	}
+	int index = NO_OPERATION;
+	if (callback) {
+		if (m_freeOperation == NO_OPERATION) {
+			LOG(1, "Too many operations in flight\n");
+			breakChain();
+			return NULL;
+		}
+		index = m_freeOperation;
+		Operation* op = &m_operations[index];
+		m_freeOperation = op->prev;
+		op->callback = callback;
+		op->arg      = arg;
+		op->flags    = flags;
+		op->busy     = 1;
+		op->skip     = 0;
+		op->next     = NO_OPERATION;
+
+		// Keep track of the chain to release the operations completing
+		// silently along with the last one
+		op->prev = m_linkedOperation;
+		if (m_linkedOperation != NO_OPERATION) {
+			m_operations[m_linkedOperation].next = index;
+		}
+		m_linkedOperation = (flags & URING_LINK) ? index : NO_OPERATION;
+	}
+
+	struct io_uring_sqe* sqe = &m_sqes[tail & m_sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = index != NO_OPERATION ? (uint64_t)index : IGNORED_OPERATION;
+	if (flags & URING_LINK) {
+		sqe->flags |= IOSQE_IO_LINK;
+#ifdef IOSQE_CQE_SKIP_SUCCESS
+		// Only operations followed by others may skip their completion,
+		// otherwise they would never be released
+		if ((flags & URING_QUIET) && m_canSkip) {
+			sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+			if (index != NO_OPERATION) {
+				m_operations[index].skip = 1;
+			}
+		}
+#endif
+	}
+
+	m_linkedSqe = (flags & URING_LINK) ? sqe : NULL;
+
+	// The entry is filled in by the caller before the next submission
+	m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	m_numQueued++;
+	return sqe;
+}
+
+void breakChain(void)
+{
+	if (m_linkedSqe) {
+		m_linkedSqe->flags &= ~IOSQE_IO_LINK;
+#ifdef IOSQE_CQE_SKIP_SUCCESS
+		m_linkedSqe->flags &= ~IOSQE_CQE_SKIP_SUCCESS;
+#endif
+		m_linkedSqe = NULL;
+	}
+	if (m_linkedOperation != NO_OPERATION) {
+		m_operations[m_linkedOperation].skip = 0;
+		m_linkedOperation = NO_OPERATION;
+	}
+}
+
+void releaseOperation(int index)
+{
+	// Unlink the operations still to complete
+	Operation* op = &m_operations[index];
+	if (op->next != NO_OPERATION) {
+		m_operations[op->next].prev = NO_OPERATION;
+	}
+
+	while (index != NO_OPERATION) {
+		op = &m_operations[index];
+		int prev = op->prev;
+		op->busy     = 0;
+		op->callback = NULL;
+		op->prev     = m_freeOperation;
+		m_freeOperation = index;
+		index = prev;
+	}
+}
+
+void dropLinked(int index, int skipped)
+{
+	while (index != NO_OPERATION) {
+		Operation* op = &m_operations[index];
+		int next = op->next;
+		op->callback = NULL;
+		if (skipped) {
+			// Released one by one, they are unlinked already
+			op->prev = NO_OPERATION;
+			op->next = NO_OPERATION;
+			releaseOperation(index);
+		}
+		index = next;
+	}
+}
+
+void handleCompletions(int sfd, int events, void* arg)
+{
+	// Reset the event descriptor, all completions are reaped below
+	uint64_t value;
+	if (read(sfd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+		LOG(1, "Failed to consume completion event: %s\n", strerror(errno));
+	}
+
+	unsigned int head = *m_cqHead;
+	while (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+		const struct io_uring_cqe* cqe = &m_cqes[head & m_cqMask];
+		uint64_t index = cqe->user_data;
+		int result = cqe->res;
+		__atomic_store_n(m_cqHead, ++head, __ATOMIC_RELEASE);
+		if (index == IGNORED_OPERATION || index >= m_numOperations) {
+			continue;
+		}
+
+		// Release before the callback, which may queue further operations
+		Operation* op = &m_operations[index];
+		Uring_cb callback = op->callback;
+		void* opArg = op->arg;
+		int quiet = op->flags & URING_QUIET;
+		int next = op->next;
+		int skipped = op->skip;
+		releaseOperation((int)index);
+		if (result < 0) {
+			dropLinked(next, skipped);
+		}
+		if (callback && (result < 0 || !quiet)) {
+			callback(result, opArg);
+		}
+	}
+
+	// Submit what the callbacks queued in one go
+	uring_submit();
+}
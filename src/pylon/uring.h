@@ -0,0 +1,106 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : uring
+  Used by   : smartmeter, smlogger
+  Purpose   : Provides an optional io_uring ring to submit chains of socket
+              operations with a single system call. Completions are reaped
+              on the io event loop.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Flags of the operations
+#define URING_LINK  0x01   // Start the next operation once this one succeeded
+#define URING_QUIET 0x02   // Invoke the callback only if the operation fails
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Callback invoked upon an operation completes with its result, i.e. the
+// return value of the system call or the negated error code
+typedef void(*Uring_cb)(int result, void* arg);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Sets up the ring of the calling thread for up to the specified number of
+// operations in flight and registers it with the io event loop of the thread
+// (see io_setLoop()). The other functions operate on the ring of the calling
+// thread. Returns 0 if io_uring is not available, e.g. with older kernels, so
+// the callers fall back to the io module.
+int uring_init(unsigned int entries);
+
+// Tears down the ring of the calling thread, the pending operations are dropped
+void uring_deinit(void);
+
+// Returns whether the ring of the calling thread has been set up
+int uring_isEnabled(void);
+
+// Queue operations like the system calls of the same names. The buffers must
+// stay valid until the operation completes or is cancelled. Returns 0 if the
+// ring is full.
+int uring_connect(int sfd, const struct sockaddr* sa, socklen_t len, int flags,
+	Uring_cb callback, void* arg);
+int uring_send(int sfd, const void* buffer, size_t size, int flags,
+	Uring_cb callback, void* arg);
+int uring_recv(int sfd, void* buffer, size_t size, int flags,
+	Uring_cb callback, void* arg);
+int uring_close(int sfd, int flags, Uring_cb callback, void* arg);
+
+// Cancels the operations queued with the specified callback argument, whose
+// callbacks are not invoked any more
+void uring_cancel(void* arg);
+
+// Submits the operations queued so far. Called by the clients before waiting
+// on the io event loop, and after reaping completions.
+int uring_submit(void);
+
+
+#endif // __URING_H
@@ -0,0 +1,277 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : wheel
+  Used by   : meter
+  Purpose   : Provides a hierarchical timer wheel to schedule many timers with
+              constant cost to insert, remove and expire them.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include "wheel.h"
+
+#include <stdlib.h>
+
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Number of levels and slots per level. Level l holds the timers expiring
+// within 64^(l+1) ticks, i.e. up to 4.6 hours at millisecond ticks.
+#define LEVELS     4
+#define SLOT_BITS  6
+#define SLOTS      (1 << SLOT_BITS)
+#define SLOT_MASK  (SLOTS - 1)
+
+// Range of the wheel in ticks, later timers are put in the last slots and
+// placed again when they come up
+#define MAX_DELTA  ((1ULL << (LEVELS * SLOT_BITS)) - 1)
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+struct Wheel_s {
+	uint64_t current;                       // Time in ticks processed up to
+	WheelTimer* slots[LEVELS][SLOTS];       // Lists of the timers per slot
+	uint64_t occupied[LEVELS];              // Bitmaps of the non-empty slots
+	int count;                              // Number of scheduled timers
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Puts the timer into the slot matching its expiration time
+static void insertTimer(Wheel* wheel, WheelTimer* timer);
+
+// Unlinks the timer from its slot
+static void unlinkTimer(Wheel* wheel, WheelTimer* timer);
+
+// Places the timers of the specified slot again, one level down
+static void cascade(Wheel* wheel, int level, int slot);
+
+// Returns the next tick after the current one that has work, i.e. an
+// occupied slot of level 0 or the end of the current round of level 0
+static uint64_t nextTick(const Wheel* wheel);
+
+// Returns the level and slot of a timer expiring at the specified time
+static int getLevel(const Wheel* wheel, uint64_t expires);
+static int getSlot(uint64_t expires, int level);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+Wheel* wheel_create(uint64_t now)
+{
+	Wheel* wheel = calloc(1, sizeof(Wheel));
+	if (!wheel) {
+		LOG(0, "Failed to allocate timer wheel\n");
+		return NULL;
+	}
+	wheel->current = now;
+	return wheel;
+}
+
+void wheel_free(Wheel* wheel)
+{
+	free(wheel);
+}
+
+void wheel_add(Wheel* wheel, WheelTimer* timer, uint64_t expires)
+{
+	if (timer->scheduled) {
+		unlinkTimer(wheel, timer);
+	} else {
+		wheel->count++;
+	}
+	timer->expires = expires > wheel->current ? expires : wheel->current + 1;
+	timer->scheduled = 1;
+	insertTimer(wheel, timer);
+}
+
+void wheel_remove(Wheel* wheel, WheelTimer* timer)
+{
+	if (timer->scheduled) {
+		unlinkTimer(wheel, timer);
+		timer->scheduled = 0;
+		wheel->count--;
+	}
+}
+
+WheelTimer* wheel_advance(Wheel* wheel, uint64_t now)
+{
+	WheelTimer* expired = NULL;
+	WheelTimer** tail = &expired;
+
+	// Jump from one tick with work to the next
+	while (wheel->count > 0) {
+		uint64_t tick = nextTick(wheel);
+		if (tick > now) {
+			break;
+		}
+		wheel->current = tick;
+
+		// Bring the timers of the higher levels down at the end of each round
+		int slot = tick & SLOT_MASK;
+		for (int level = 1; level < LEVELS && (tick & ((1ULL << (level * SLOT_BITS)) - 1)) == 0; level++) {
+			cascade(wheel, level, getSlot(tick, level));
+		}
+
+		// Collect the expired timers
+		WheelTimer* timer = wheel->slots[0][slot];
+		wheel->slots[0][slot] = NULL;
+		wheel->occupied[0] &= ~(1ULL << slot);
+		while (timer) {
+			WheelTimer* next = timer->next;
+			if (timer->expires > tick) {
+
+				// Beyond the range of the wheel when added
+				insertTimer(wheel, timer);
+			} else {
+				timer->scheduled = 0;
+				timer->prev = NULL;
+				timer->next = NULL;
+				wheel->count--;
+				*tail = timer;
+				tail = &timer->next;
+			}
+			timer = next;
+		}
+	}
+
+	if (now > wheel->current) {
+		wheel->current = now;
+	}
+	return expired;
+}
+
+uint64_t wheel_next(const Wheel* wheel)
+{
+	return wheel->count > 0 ? nextTick(wheel) : UINT64_MAX;
+}
+
+int wheel_count(const Wheel* wheel)
+{
+	return wheel->count;
+}
+
+void insertTimer(Wheel* wheel, WheelTimer* timer)
+{
+	int level = getLevel(wheel, timer->expires);
+	uint64_t expires = timer->expires;
+	if (level == LEVELS) {
+		level = LEVELS - 1;
+		expires = wheel->current + MAX_DELTA;
+	}
+	int slot = getSlot(expires, level);
+
+	timer->prev = NULL;
+	timer->next = wheel->slots[level][slot];
+	if (timer->next) {
+		timer->next->prev = timer;
+	}
+	wheel->slots[level][slot] = timer;
+	wheel->occupied[level] |= 1ULL << slot;
+
+	// Remember the slot for removal
+	timer->scheduled = 1 + level * SLOTS + slot;
+}
+
+void unlinkTimer(Wheel* wheel, WheelTimer* timer)
+{
+	int level = (timer->scheduled - 1) / SLOTS;
+	int slot  = (timer->scheduled - 1) % SLOTS;
+
+	if (timer->prev) {
+		timer->prev->next = timer->next;
+	} else {
+		wheel->slots[level][slot] = timer->next;
+		if (!timer->next) {
+			wheel->occupied[level] &= ~(1ULL << slot);
+		}
+	}
+	if (timer->next) {
+		timer->next->prev = timer->prev;
+	}
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+void cascade(Wheel* wheel, int level, int slot)
+{
+	WheelTimer* timer = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+	wheel->occupied[level] &= ~(1ULL << slot);
+	while (timer) {
+		WheelTimer* next = timer->next;
+		insertTimer(wheel, timer);
+		timer = next;
+	}
+}
+
+uint64_t nextTick(const Wheel* wheel)
+{
+	// Occupied slots of level 0 in the rest of the current round
+	int index = wheel->current & SLOT_MASK;
+	uint64_t ahead = index < SLOT_MASK ? wheel->occupied[0] & (~0ULL << (index + 1)) : 0;
+	if (ahead) {
+		return (wheel->current & ~(uint64_t)SLOT_MASK) + __builtin_ctzll(ahead);
+	}
+	return (wheel->current | SLOT_MASK) + 1;
+}
+
+int getLevel(const Wheel* wheel, uint64_t expires)
+{
+	uint64_t delta = expires - wheel->current;
+	for (int level = 0; level < LEVELS; level++) {
+		if (delta < (1ULL << ((level + 1) * SLOT_BITS))) {
+			return level;
+		}
+	}
+	return LEVELS;
+}
+
+int getSlot(uint64_t expires, int level)
+{
+	return (expires >> (level * SLOT_BITS)) & SLOT_MASK;
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : wheel
+  Used by   : meter
+  Purpose   : Provides a hierarchical timer wheel to schedule many timers with
+              constant cost to insert, remove and expire them.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#ifndef __WHEEL_H
+#define __WHEEL_H
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Timer to be embedded into the structure it schedules. The wheel does not
+// allocate memory; a timer must stay valid while it is scheduled.
+typedef struct WheelTimer_s {
+	struct WheelTimer_s* next;   // Links of the slot or the list of expired timers
+	struct WheelTimer_s* prev;
+	uint64_t expires;            // Time in ticks the timer expires at
+	int scheduled;               // Position in the wheel plus one, zero if not scheduled
+} WheelTimer;
+
+// Opaque type
+typedef struct Wheel_s Wheel;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Creates a timer wheel starting at the specified time in ticks (e.g. timer_now())
+Wheel* wheel_create(uint64_t now);
+
+// Releases the wheel, the timers are left alone
+void wheel_free(Wheel* wheel);
+
+// Schedules the timer to expire at the specified time in ticks, or at the next
+// tick if passed. A timer already scheduled is moved.
+void wheel_add(Wheel* wheel, WheelTimer* timer, uint64_t expires);
+
+// Removes the timer from the wheel if scheduled
+void wheel_remove(Wheel* wheel, WheelTimer* timer);
+
+// Advances the wheel to the specified time and returns the list of expired
+// timers linked by 'next', or NULL if none
+WheelTimer* wheel_advance(Wheel* wheel, uint64_t now);
+
+// Returns a time up to which no timer expires, i.e. the time to call
+// wheel_advance() at the latest, or UINT64_MAX if the wheel is empty
+uint64_t wheel_next(const Wheel* wheel);
+
+// Returns the number of scheduled timers
+int wheel_count(const Wheel* wheel);
+
+
+#endif // __WHEEL_H
@@ -0,0 +1,154 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : smbench
+  Used by   :
+  Purpose   : Program to compare the methods to request the current values
+              from a Smart Meter (or smsim) by the size of the responses and
+              the time to decode them.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pylon/io.h"
+#include "pylon/smartmeter.h"
+#include "pylon/args.h"
+#include "pylon/common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Supported program arguments
+static Argument args[] = {
+	{"address",  "-a", "127.0.1.1", ARG_STRING | OPTIONAL, "Hostname/IP of the Smart Meter"},
+	{"port",     "-p", "7259",      ARG_STRING | OPTIONAL, "Port of the Smart Meter"},
+	{"count",    "-c", "100",       ARG_INT    | OPTIONAL, "Number of polls per method"},
+	{"help",     "-h", NULL,        ARG_FLAG   | OPTIONAL, "Display program usage and help"},
+	{"verbose",  "-v", "1",         ARG_INT    | OPTIONAL, "Verbose level"},
+	{0} // End of list
+};
+
+// Names of the methods compared
+static const char* methodNames[] = {
+	"GetProcParameter",
+	"GetList"
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Polls the Smart Meter 'count' times using the specified method and prints
+// the average size and decoding time of the responses
+static int benchmark(SmartMeter_Method method, int count);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+	// Input program arguments
+	if (!args_parse(args, argc, argv) || args_value(args, "help")) {
+		args_printUsage(args, argv[0]);
+		args_printInfo(args);
+		return 0;
+	}
+
+	// Set log level
+	log_level = atoi(args_value(args, "verbose"));
+
+	int count = atoi(args_value(args, "count"));
+	if (count <= 0) {
+		printf("Invalid number of polls\n");
+		return 1;
+	}
+
+	// Initialize I/O subsystem
+	io_init();
+
+	printf("%-18s %8s %12s %12s %12s\n", "method", "polls", "bytes/poll",
+		"decode ms", "response ms");
+	int success = benchmark(SMARTMETER_PROC_PARAMETER, count) &&
+		benchmark(SMARTMETER_GET_LIST, count);
+
+	// Shutdown I/O subsystem
+	io_deinit();
+
+	return success ? 0 : 1;
+}
+
+int benchmark(SmartMeter_Method method, int count)
+{
+	SmartMeter* sm = smartmeter_create(args_value(args, "address"),
+		args_value(args, "port"), 0, NULL, NULL);
+	if (!sm) {
+		return 0;
+	}
+	smartmeter_setMethod(sm, method);
+
+	// Poll as fast as possible
+	int failures = 0;
+	for (int i = 0; i < count; i++) {
+		SmartMeter_Data m = {{0}};
+		if (!smartmeter_read(sm, &m)) {
+			failures++;
+		}
+	}
+
+	SmartMeter_Stats stats;
+	smartmeter_getMeterStats(sm, &stats);
+	smartmeter_free(sm);
+
+	if (stats.numSessions == 0) {
+		printf("%-18s no successful polls\n", methodNames[method]);
+		return 0;
+	}
+	printf("%-18s %8u %12.1f %12.4f %12.3f\n", methodNames[method], stats.numSessions,
+		stats.totalResponseSize / stats.numSessions,
+		stats.totalDecodeTime / stats.numSessions,
+		stats.totalResponseTime / stats.numSessions);
+	if (failures) {
+		LOG(1, "%d of %d polls failed\n", failures, count);
+	}
+
+	return 1; // Success
+}
@@ -48,6 +48,12 @@
 #include "pylon/io.h"
 #include "pylon/smartmeter.h"
 #include "pylon/fluksometer.h"
+#include "pylon/modbus.h"
+#include "pylon/gateway.h"
+#include "pylon/discovery.h"
+#include "pylon/receiver.h"
+#include "pylon/sniffer.h"
+#include "pylon/proxy.h"
 #include "pylon/strbuilder.h"
 #include "pylon/uploader.h"
 #include "pylon/args.h"
@@ -60,6 +66,24 @@
 // Timeout in milliseconds for POST requests
 #define SEND_TIMEOUT 10000
 
+// Time in milliseconds after which Smart Meters no longer heard are not polled anymore
+#define DISCOVERY_TIMEOUT 120000
+
+// Number of io_uring operations submitted at once, the sessions take three each
+#define URING_ENTRIES 1024
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Struct to hold a measurement passed from a shard of the gateway to the
+// main thread to publish it
+typedef struct Measurement_s {
+	SmartMeter_Data data;
+	Hostname host;
+	char* token;
+} Measurement;
+
 ////////////////////////////////////////////////////////////////////////////////
 // STATIC VARIABLES
 ////////////////////////////////////////////////////////////////////////////////
@@ -68,11 +92,28 @@
 static Argument args[] = {
 	{"count",    "-c", "-1",   ARG_INT    | OPTIONAL, "Number of measurements, -1 for infinite"},
 	{"interval", "-i", "1000", ARG_INT    | OPTIONAL, "Interval between two measurements in milliseconds"},
+	{"schedule", "-T", "relative", ARG_STRING | OPTIONAL, "Measure 'relative' to the last measurement, or on a fixed grid and 'skip' or 'catchup' ticks missed by an overrun"},
+	{"align",    "-w", NULL,   ARG_INT    | OPTIONAL, "Measure when the wall clock is a multiple of the interval plus this phase in ms, e.g. 0 for whole seconds"},
+	{"adaptive", "-A", NULL,   ARG_STRING | OPTIONAL, "Back off up to 'max[:threshold]' milliseconds while the power changes by less than threshold W (default 50)"},
 	{"onboard",  "-o", NULL,   ARG_FLAG   | OPTIONAL, "Use Flukso onboard sensors instead of Smart Meter"},
 	{"address",  "-a", NULL,   ARG_STRING | OPTIONAL, "Hostname/IP of the Smart Meter or path of the sensor FIFO"},
 	{"port",     "-p", "7259", ARG_STRING | OPTIONAL, "Port of the Smart Meter"},
+	{"cache",    "-C", "/tmp/smlogger.address", ARG_STRING | OPTIONAL, "File to cache the detected address of the Smart Meter in"},
+	{"meters",   "-m", NULL,   ARG_STRING | OPTIONAL, "File listing Smart Meters to poll concurrently, one 'address [port] [interval] [token] [method] [phase]' per line"},
+	{"method",   "-M", "tree", ARG_STRING | OPTIONAL, "Request the values as parameter 'tree' or as 'list'"},
+	{"discover", "-D", NULL,   ARG_FLAG   | OPTIONAL, "Poll every Smart Meter heard on the network concurrently"},
+	{"uring",    "-R", NULL,   ARG_FLAG   | OPTIONAL, "Run the sessions of concurrently polled meters on io_uring if supported by the kernel"},
+	{"shards",   "-j", "1",    ARG_INT    | OPTIONAL, "Number of threads polling a share of the concurrently polled meters each, pinned to distinct CPUs, 0 for one per CPU"},
+	{"listen",   "-L", NULL,   ARG_STRING | OPTIONAL, "Receive SML files pushed by the meters at 'port[/tcp|/udp]' instead of polling"},
+	{"proxy",    "-P", NULL,   ARG_STRING | OPTIONAL, "Serve local clients at 'port[:maxAge]' from the last response of the meter at -a, polled at most every maxAge ms (default: interval)"},
+	{"modbus",   "-U", NULL,   ARG_STRING | OPTIONAL, "Poll a Modbus TCP meter at -a as 'unit[:port]' (default port " MODBUS_DEFAULT_PORT ") instead of a Smart Meter"},
+	{"registers", "-r", NULL,  ARG_STRING | OPTIONAL, "File mapping the variables to the registers of the Modbus meter, one 'variable address type [scale]' per line"},
+	{"sniff",    "-S", NULL,   ARG_STRING | OPTIONAL, "Capture the responses other clients receive from the meters on this interface ('any' for all) instead of polling"},
 	{"url",      "-u", NULL,   ARG_STRING | OPTIONAL, "URL of the energy server to receive the measurements"},
 	{"token",    "-t", NULL,   ARG_STRING | OPTIONAL, "Token to identify the measurements"},
+	{"backfill", "-B", "0",    ARG_INT    | OPTIONAL, "Backfill gaps of at least this many seconds from the load profile, 0 to disable"},
+	{"timeline", "-H", NULL,   ARG_STRING | OPTIONAL, "Persistent directory to save the time of the latest measurement of every meter in, so that backfilling covers restarts (required by -B)"},
+	{"groups",   "-G", NULL,   ARG_STRING | OPTIONAL, "Poll variables less often, e.g. 'voltage:60000,phase-angle:300000' (name prefix:interval in ms)"},
 	{"upload_threads", "-n", "1",     ARG_INT    | OPTIONAL, "Number of threads used to upload measurements"},
 	{"buffer_size",    "-b", "36000", ARG_INT    | OPTIONAL, "Size of the upload queue to buffer measurements"},
 	{"smart",    "-s", NULL,   ARG_FLAG   | OPTIONAL, "Output values only when differing from defaults"},
@@ -82,6 +123,27 @@ static Argument args[] = {
 	{0} // End of list
 };
 
+// Names of the variables in JSON
+static const char* jsonNames[NUM_VARIABLES] = {
+	"createdOn",
+	"powerAllPhases",
+	"powerL1",
+	"powerL2",
+	"powerL3",
+	"currentNeutral",
+	"currentL1",
+	"currentL2",
+	"currentL3",
+	"voltageL1",
+	"voltageL2",
+	"voltageL3",
+	"phaseAngleVoltageL2L1",
+	"phaseAngleVoltageL3L1",
+	"phaseAngleCurrentVoltageL1",
+	"phaseAngleCurrentVoltageL2",
+	"phaseAngleCurrentVoltageL3"
+};
+
 // String builder to encode measurements in JSON
 static StringBuilder* m_sb;
 
@@ -91,6 +153,9 @@ static const char* m_url;
 // The token to send with the measurements
 static const char* m_token;
 
+// Address of the Smart Meter at startup, used as token if none specified
+static Hostname m_address;
+
 // Counter for meter readings
 static int m_numMeasurements;
 
@@ -100,6 +165,19 @@ static int m_count;
 static int m_interval;
 static int m_quiet;
 static int m_onboard;
+static int m_gateway;
+static int m_discover;
+static int m_backfill;
+static int m_listen;
+static int m_sniff;
+static int m_proxy;
+static int m_modbus;
+
+// Flag if pushed or captured measurements are being received
+static volatile int m_receiving;
+
+// Loop of the main thread, which publishes all measurements
+static IO_Loop* m_loop;
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -109,6 +187,45 @@ static int m_onboard;
 // Callback function invoked by the smartmeter/fluksometer module
 static void processMeasurement(const SmartMeter_Data* m);
 
+// Callback function invoked for the Smart Meters polled by the gateway
+static void processMeterMeasurement(SmartMeter* sm, const SmartMeter_Data* m);
+
+// Task to publish a measurement passed from a shard of the gateway
+static void processForwardedMeasurement(void* arg);
+
+// Callback function invoked for the measurements pushed by the meters or
+// captured from the traffic of other clients
+static void processReceivedMeasurement(IP_Address addr, const SmartMeter_Data* m);
+
+// Starts receiving pushed measurements as specified by 'port[/tcp|/udp]'
+static int startReceiver(const char* spec);
+
+// Outputs and uploads a measurement identified by the specified token
+static void publishMeasurement(const SmartMeter_Data* m, const char* host, const char* token);
+
+// Polls the variable groups specified on the command line at their own intervals
+static int applyGroups(SmartMeter* sm);
+
+// Selects the method to request the values by its name. Returns 0 if unknown
+static int applyMethod(SmartMeter* sm, const char* name);
+
+// Selects the policy to schedule the measurements by its name. Returns 0 if unknown
+static int applySchedule(const char* name);
+
+// Aligns the measurements to the wall clock with the specified phase, if any
+static void applyAlignment(SmartMeter* sm, const char* phase);
+
+// Adds the Smart Meter to proxy as specified by 'port[:maxAge]' to the gateway
+static int startProxy(const char* spec);
+
+// Adds the Smart Meters listed in the specified file to the gateway
+static int loadMeters(const char* path);
+
+// Callback functions invoked by the discovery module to add and remove
+// Smart Meters to and from the gateway
+static void* enrolMeter(IP_Address addr);
+static void dismissMeter(IP_Address addr, void* context);
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // IMPLEMENTATION
@@ -134,14 +251,114 @@ int main(int argc, char **argv)
 	m_token      = args_value(args, "token");
 	m_url        = args_value(args, "url");
 	m_onboard    = args_value(args, "onboard") != NULL;
+	m_discover   = args_value(args, "discover") != NULL;
+	m_proxy      = args_value(args, "proxy") != NULL;
+	m_gateway    = args_value(args, "meters") != NULL || m_discover || m_proxy;
+	m_backfill   = atoi(args_value(args, "backfill"));
+	m_listen     = args_value(args, "listen") != NULL;
+	m_sniff      = args_value(args, "sniff") != NULL;
+	m_modbus     = args_value(args, "modbus") != NULL;
 	
+	// Backfill the gaps spanning restarts as well, which requires a directory
+	// surviving reboots
+	if (m_backfill > 0) {
+		if (!args_value(args, "timeline")) {
+			printf("Backfilling requires a directory to save the timeline in (-H)\n");
+			return 1;
+		}
+		smartmeter_setTimelineCache(args_value(args, "timeline"));
+	}
+
 	// Initialize I/O subsystem
 	io_init();
+	m_loop = io_getLoop();
 
 	// Initialize according module
-	if (!m_onboard) {
+	if (m_listen) {
+
+		// Accept measurements from any number of meters
+		if (!startReceiver(args_value(args, "listen"))) {
+			printf("Failed to start receiving on '%s'\n", args_value(args, "listen"));
+			return 1;
+		}
+
+	} else if (m_sniff) {
+
+		// Follow the sessions of other clients with any number of meters
+		const char* interface = args_value(args, "sniff");
+		if (!sniffer_start(strcmp(interface, "any") ? interface : NULL,
+			atoi(args_value(args, "port")), processReceivedMeasurement))
+		{
+			printf("Failed to start capturing on '%s'\n", interface);
+			return 1;
+		}
+
+	} else if (m_gateway) {
+	
+		// Spread the meters over the shards, the proxy hooks into the
+		// sessions of its meter and thus requires a single thread
+		int shards = atoi(args_value(args, "shards"));
+		if (m_proxy && shards != 1) {
+			LOG(1, "Polling in a single thread to serve the proxy\n");
+			shards = 1;
+		}
+		if (!gateway_setShards(shards)) {
+			printf("Failed to set up %d shards\n", shards);
+			return 1;
+		}
+
+		// Run the sessions on io_uring, every shard falls back to the io
+		// event loop if not available
+		if (args_value(args, "uring")) {
+			gateway_setUring(URING_ENTRIES);
+		}
+
+		// Add all Smart Meters to the gateway
+		if (args_value(args, "meters") && !loadMeters(args_value(args, "meters"))) {
+			printf("Failed to load Smart Meters\n");
+			return 1;
+		}
+
+		// Serve local clients on behalf of the Smart Meter
+		if (m_proxy && !startProxy(args_value(args, "proxy"))) {
+			printf("Failed to start proxy on '%s'\n", args_value(args, "proxy"));
+			return 1;
+		}
+
+		// Add and remove Smart Meters as they are heard on the network
+		if (m_discover) {
+			if (!discovery_track(enrolMeter, dismissMeter, DISCOVERY_TIMEOUT)) {
+				printf("Failed to start discovery\n");
+				return 1;
+			}
+			gateway_setTick(discovery_expire);
+		}
+		
+	} else if (m_modbus) {
+
+		// Initialize modbus module
+		char port[16] = MODBUS_DEFAULT_PORT;
+		int unit = 0;
+		if (sscanf(args_value(args, "modbus"), "%d:%15s", &unit, port) < 1) {
+			printf("Invalid Modbus unit '%s'\n", args_value(args, "modbus"));
+			return 1;
+		}
+		if (!modbus_init(args_value(args, "address"), port, unit, m_interval, processMeasurement)) {
+			printf("Failed to initialize Modbus meter\n");
+			return 1;
+		}
+		if (args_value(args, "registers") && !modbus_loadRegisters(args_value(args, "registers"))) {
+			printf("Failed to load registers from '%s'\n", args_value(args, "registers"));
+			return 1;
+		}
+		if (!m_token) {
+			m_token = args_value(args, "address");
+		}
+
+	} else if (!m_onboard) {
 	
 		// Initialize smartmeter module
+		smartmeter_setAddressCache(args_value(args, "cache"));
 		int init = smartmeter_init(
 			args_value(args, "address"), 
 			args_value(args, "port"),
@@ -151,10 +368,39 @@ int main(int argc, char **argv)
 			printf("Failed to initialize Smart Meter\n");
 			return 1;
 		}
+		smartmeter_setBackfill(smartmeter_instance(), m_backfill);
+		if (!applyGroups(smartmeter_instance())) {
+			printf("Invalid variable groups '%s'\n", args_value(args, "groups"));
+			return 1;
+		}
+		if (!applyMethod(smartmeter_instance(), args_value(args, "method"))) {
+			printf("Invalid method '%s'\n", args_value(args, "method"));
+			return 1;
+		}
+		if (!applySchedule(args_value(args, "schedule"))) {
+			printf("Invalid schedule '%s'\n", args_value(args, "schedule"));
+			return 1;
+		}
+		applyAlignment(smartmeter_instance(), args_value(args, "align"));
+
+		// Adapt the interval to the changes of the power
+		const char* adaptive = args_value(args, "adaptive");
+		if (adaptive) {
+			int maxInterval = 0;
+			double threshold = 50;
+			if (sscanf(adaptive, "%d:%lf", &maxInterval, &threshold) < 1 ||
+				!smartmeter_setAdaptive(maxInterval, POWER_ALL_PHASES, threshold))
+			{
+				printf("Invalid adaptive interval '%s'\n", adaptive);
+				return 1;
+			}
+		}
 
 		// Use Smart Meter address if no token specified
+		// Keep a copy, the address may change while measuring
 		if (!m_token) {
-			m_token = smartmeter_address();
+			strncpy(m_address, smartmeter_address(), sizeof(m_address) - 1);
+			m_token = m_address;
 		}
 		
 	} else {
@@ -191,6 +437,9 @@ int main(int argc, char **argv)
 	// Print headers
 	if (!m_quiet && !m_smart) {
 		printf("#"); // comment for gnuplot
+		if (m_gateway || m_listen || m_sniff) {
+			printf("address\t");
+		}
 		for (SmartMeter_VarID id = 0; id < NUM_VARIABLES; id++) {
 			printf("%s%c", smartmeter_getVarName(id), id < NUM_VARIABLES-1 ? '\t' : '\n');
 		}
@@ -198,7 +447,17 @@ int main(int argc, char **argv)
 
 	// Perform measurements
 	if (m_count != 0) {
-		if (!m_onboard) {
+		if (m_listen || m_sniff) {
+			m_receiving = 1;
+			while (m_receiving) {
+				io_process();
+			}
+		} else if (m_gateway) {
+			gateway_run();
+		} else if (m_modbus) {
+			modbus_start();
+			modbus_join();
+		} else if (!m_onboard) {
 			smartmeter_start();
 			smartmeter_join();
 		} else {
@@ -213,30 +472,301 @@ int main(int argc, char **argv)
 		strbuilder_free(m_sb);
 	}	
 	
+	// Release Smart Meters
+	if (m_listen) {
+		receiver_stop();
+	} else if (m_sniff) {
+		sniffer_stop();
+	} else if (m_gateway) {
+		proxy_stop();
+		discovery_stop();
+		gateway_cleanup(1);
+	}
+	
 	// Shutdown I/O subsystem
 	io_deinit();
 	
 	return 0;
 }
 
+int applyGroups(SmartMeter* sm)
+{
+	const char* groups = args_value(args, "groups");
+	if (!groups) {
+		return 1;
+	}
+
+	// Parse comma-separated entries of the form: prefix:interval
+	char buffer[256];
+	strncpy(buffer, groups, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+
+	char* ctx = NULL;
+	for (char* entry = strtok_r(buffer, ",", &ctx); entry; entry = strtok_r(NULL, ",", &ctx)) {
+		char* sep = strchr(entry, ':');
+		int interval = sep ? atoi(sep + 1) : 0;
+		if (!sep || interval <= 0) {
+			return 0;
+		}
+		*sep = '\0';
+
+		// Group all variables whose name starts with the prefix
+		uint32_t mask = 0;
+		for (SmartMeter_VarID id = TIMESTAMP + 1; id < NUM_VARIABLES; id++) {
+			if (strncmp(smartmeter_getVarName(id), entry, strlen(entry)) == 0) {
+				mask |= SMARTMETER_VAR(id);
+			}
+		}
+		if (!smartmeter_addGroup(sm, mask, interval)) {
+			return 0;
+		}
+	}
+
+	return 1; // Success
+}
+
+int applyMethod(SmartMeter* sm, const char* name)
+{
+	if (strcmp(name, "tree") == 0) {
+		smartmeter_setMethod(sm, SMARTMETER_PROC_PARAMETER);
+	} else if (strcmp(name, "list") == 0) {
+		smartmeter_setMethod(sm, SMARTMETER_GET_LIST);
+	} else {
+		LOG(0, "Unknown method '%s'\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+void applyAlignment(SmartMeter* sm, const char* phase)
+{
+	if (phase) {
+		smartmeter_setAlignment(sm, atoi(phase));
+	}
+}
+
+int applySchedule(const char* name)
+{
+	if (strcmp(name, "relative") == 0) {
+		smartmeter_setSchedule(METER_RELATIVE);
+	} else if (strcmp(name, "skip") == 0) {
+		smartmeter_setSchedule(METER_SKIP);
+	} else if (strcmp(name, "catchup") == 0) {
+		smartmeter_setSchedule(METER_CATCH_UP);
+	} else {
+		LOG(0, "Unknown schedule '%s'\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+int startProxy(const char* spec)
+{
+	const char* address = args_value(args, "address");
+	if (!address) {
+		LOG(0, "Address of the Smart Meter to proxy not specified\n");
+		return 0;
+	}
+
+	int port = 0, maxAge = m_interval;
+	if (sscanf(spec, "%d:%d", &port, &maxAge) < 1 || port <= 0 || maxAge < 0) {
+		return 0;
+	}
+
+	SmartMeter* sm = smartmeter_create(address, args_value(args, "port"),
+		m_interval, m_token, processMeterMeasurement);
+	if (sm) {
+		smartmeter_setBackfill(sm, m_backfill);
+	}
+	if (!sm || !applyGroups(sm) || !applyMethod(sm, args_value(args, "method")) ||
+		!gateway_add(sm))
+	{
+		smartmeter_free(sm);
+		return 0;
+	}
+
+	return proxy_start(sm, port, maxAge);
+}
+
+int loadMeters(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		LOG(0, "Failed to open '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+	
+	// Parse lines of the form: address [port] [interval] [token] [method] [phase]
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+	
+		// Split line into tokens
+		char* ctx = NULL;
+		const char* address  = strtok_r(line, " \t\r\n", &ctx);
+		const char* port     = strtok_r(NULL, " \t\r\n", &ctx);
+		const char* interval = strtok_r(NULL, " \t\r\n", &ctx);
+		const char* token    = strtok_r(NULL, " \t\r\n", &ctx);
+		const char* method   = strtok_r(NULL, " \t\r\n", &ctx);
+		const char* phase    = strtok_r(NULL, " \t\r\n", &ctx);
+		
+		// Skip empty lines and comments
+		if (!address || address[0] == '#') {
+			continue;
+		}
+		
+		// Apply defaults from the command line
+		SmartMeter* sm = smartmeter_create(address, 
+			port ? port : args_value(args, "port"),
+			interval ? atoi(interval) : m_interval,
+			token ? token : m_token,
+			processMeterMeasurement);
+		if (sm) {
+			applyAlignment(sm, phase ? phase : args_value(args, "align"));
+			smartmeter_setBackfill(sm, m_backfill);
+		}
+		if (!sm || !applyGroups(sm) ||
+			!applyMethod(sm, method ? method : args_value(args, "method")) ||
+			!gateway_add(sm))
+		{
+			smartmeter_free(sm);
+			fclose(file);
+			return 0;
+		}
+	}
+	
+	fclose(file);
+	
+	if (gateway_count() == 0) {
+		LOG(0, "No Smart Meters listed in '%s'\n", path);
+		return 0;
+	}
+	
+	return 1; // Success
+}
+
+void* enrolMeter(IP_Address addr)
+{
+	Hostname host;
+	ip_toStr(&addr, host, sizeof(host));
+
+	// Leave Smart Meters listed explicitly alone
+	if (gateway_find(host)) {
+		return NULL;
+	}
+
+	SmartMeter* sm = smartmeter_create(host, args_value(args, "port"),
+		m_interval, m_token, processMeterMeasurement);
+	if (sm) {
+		applyAlignment(sm, args_value(args, "align"));
+		smartmeter_setBackfill(sm, m_backfill);
+	}
+	if (!sm || !applyGroups(sm) || !applyMethod(sm, args_value(args, "method")) ||
+		!gateway_add(sm))
+	{
+		smartmeter_free(sm);
+		return NULL;
+	}
+
+	return sm;
+}
+
+void dismissMeter(IP_Address addr, void* context)
+{
+	gateway_release((SmartMeter*)context);
+}
+
 void processMeasurement(const SmartMeter_Data* m)
+{
+	publishMeasurement(m, NULL, m_token);
+}
+
+void processMeterMeasurement(SmartMeter* sm, const SmartMeter_Data* m)
+{
+	if (io_getLoop() == m_loop) {
+		publishMeasurement(m, smartmeter_getHost(sm), smartmeter_getToken(sm));
+		return;
+	}
+
+	// Polled by another shard of the gateway, publish from the main thread
+	Measurement* msg = malloc(sizeof(Measurement));
+	if (!msg || !(msg->token = strdup(smartmeter_getToken(sm)))) {
+		LOG(0, "Failed to forward measurement\n");
+		free(msg);
+		return;
+	}
+	msg->data = *m;
+	snprintf(msg->host, sizeof(msg->host), "%s", smartmeter_getHost(sm));
+	if (!io_post(m_loop, processForwardedMeasurement, msg)) {
+		free(msg->token);
+		free(msg);
+	}
+}
+
+void processForwardedMeasurement(void* arg)
+{
+	Measurement* msg = (Measurement*)arg;
+	publishMeasurement(&msg->data, msg->host, msg->token);
+	free(msg->token);
+	free(msg);
+}
+
+void processReceivedMeasurement(IP_Address addr, const SmartMeter_Data* m)
+{
+	Hostname host;
+	ip_toStr(&addr, host, sizeof(host));
+	publishMeasurement(m, host, m_token ? m_token : host);
+}
+
+int startReceiver(const char* spec)
+{
+	// Receive over both protocols unless specified
+	int protocols = RECEIVER_TCP | RECEIVER_UDP;
+	const char* sep = strchr(spec, '/');
+	if (sep) {
+		if (strcmp(sep + 1, "tcp") == 0) {
+			protocols = RECEIVER_TCP;
+		} else if (strcmp(sep + 1, "udp") == 0) {
+			protocols = RECEIVER_UDP;
+		} else {
+			return 0;
+		}
+	}
+
+	int port = atoi(spec);
+	if (port <= 0 || port > 65535) {
+		return 0;
+	}
+	return receiver_start(port, protocols, processReceivedMeasurement);
+}
+
+void publishMeasurement(const SmartMeter_Data* m, const char* host, const char* token)
 {
 	if (!m_quiet) {
 	
+		// Identify the Smart Meter if there are many
+		if (host) {
+			printf("%s%s", host, m_smart ? ": " : "\t");
+		}
+	
 		// Output measurement according to selected mode
 		if (m_smart) {
 		
-			// Print only values that differ from default
+			// Print only values measured that differ from default
 			for (SmartMeter_VarID id = 0; id < NUM_VARIABLES; id++) {
-				if (m->val[id] != 0 && m->val[id] != -1) {
+				if ((m->valid & SMARTMETER_VAR(id)) && m->val[id] != 0 && m->val[id] != -1) {
 					printf("%s: %f; ", smartmeter_getVarName(id), m->val[id]);
 				}
 			}
 			printf("\n");
 		} else {
-			// Print all values
+			// Print all values, placeholders for those not measured
 			for (SmartMeter_VarID id = 0; id < NUM_VARIABLES; id++) {
-				printf("%f%c", m->val[id], id < NUM_VARIABLES-1 ? '\t' : '\n');
+				if (m->valid & SMARTMETER_VAR(id)) {
+					printf("%f", m->val[id]);
+				} else {
+					printf("-");
+				}
+				printf("%c", id < NUM_VARIABLES-1 ? '\t' : '\n');
 			}
 		}
 	}
@@ -248,25 +778,16 @@ void processMeasurement(const SmartMeter_Data* m)
 		strbuilder_reset(m_sb);
 		strbuilder_printf(m_sb, "{\"measurement\":{");
 
-		strbuilder_printf(m_sb, "\"powerAllPhases\": %.4f,	", m->val[POWER_ALL_PHASES]);
-		strbuilder_printf(m_sb, "\"powerL1\": %.4f,", m->val[POWER_L1]);
-		strbuilder_printf(m_sb, "\"powerL2\": %.4f,", m->val[POWER_L2]);
-		strbuilder_printf(m_sb, "\"powerL3\": %.4f,", m->val[POWER_L3]);
-		strbuilder_printf(m_sb, "\"currentNeutral\": %.4f,", m->val[CURRENT_NEUTRAL]);
-		strbuilder_printf(m_sb, "\"currentL1\": %.4f,", m->val[CURRENT_L1]);
-		strbuilder_printf(m_sb, "\"currentL2\": %.4f,", m->val[CURRENT_L2]);
-		strbuilder_printf(m_sb, "\"currentL3\": %.4f,", m->val[CURRENT_L3]);
-		strbuilder_printf(m_sb, "\"voltageL1\": %.4f,	", m->val[VOLTAGE_L1]);
-		strbuilder_printf(m_sb, "\"voltageL2\": %.4f,", m->val[VOLTAGE_L2]);
-		strbuilder_printf(m_sb, "\"voltageL3\": %.4f,", m->val[VOLTAGE_L3]);
-		strbuilder_printf(m_sb, "\"phaseAngleVoltageL2L1\": %.4f,", m->val[PHASE_ANGLE_VOLTAGE_L2_L1]);
-		strbuilder_printf(m_sb, "\"phaseAngleVoltageL3L1\": %.4f,", m->val[PHASE_ANGLE_VOLTAGE_L3_L1]);
-		strbuilder_printf(m_sb, "\"phaseAngleCurrentVoltageL1\": %.4f,", m->val[PHASE_ANGLE_CURRENT_VOLTAGE_L1]);
-		strbuilder_printf(m_sb, "\"phaseAngleCurrentVoltageL2\": %.4f,", m->val[PHASE_ANGLE_CURRENT_VOLTAGE_L2]);
-		strbuilder_printf(m_sb, "\"phaseAngleCurrentVoltageL3\": %.4f,	", m->val[PHASE_ANGLE_CURRENT_VOLTAGE_L3]);
-		strbuilder_printf(m_sb, "\"createdOn\": %llu,	", (uint64_t)m->val[TIMESTAMP]);
+		// Include only the values measured
+		for (SmartMeter_VarID id = TIMESTAMP + 1; id < NUM_VARIABLES; id++) {
+			if (m->valid & SMARTMETER_VAR(id)) {
+				strbuilder_printf(m_sb, "\"%s\": %.4f,", jsonNames[id], m->val[id]);
+			}
+		}
+		strbuilder_printf(m_sb, "\"%s\": %.3f,	", jsonNames[TIMESTAMP], m->val[TIMESTAMP]);
+		strbuilder_printf(m_sb, "\"createdOnUncertainty\": %.6f,", m->uncertainty);
 		strbuilder_printf(m_sb, "\"smartMeterId\": 1,");
-		strbuilder_printf(m_sb, "\"smartMeterToken\": \"%s\"	", m_token);
+		strbuilder_printf(m_sb, "\"smartMeterToken\": \"%s\"	", token);
 	
 		strbuilder_printf(m_sb, "}}");	
 		
@@ -284,11 +805,33 @@ void processMeasurement(const SmartMeter_Data* m)
 	// Log info about buffer size every 60 measurements
 	if (m_numMeasurements % 60 == 0) {
 		LOG(2, "numMeasurements: %d, buffered: %d\n", m_numMeasurements, uploader_queueSize());
+		
+		// Compare the time to connect with the time to respond
+		SmartMeter_Stats stats;
+		if (!m_onboard && !m_gateway && !m_modbus && smartmeter_getStats(&stats) && stats.numSessions > 0) {
+			LOG(2, "avg connect: %.3f ms (%u of %u in advance), avg response: %.3f ms, missed ticks: %u\n",
+				stats.totalConnectTime / stats.numSessions, stats.numPreconnected, 
+				stats.numSessions, stats.totalResponseTime / stats.numSessions, stats.missedTicks);
+		}
+
+		// Report the cost of reading the sensor board
+		Fluksometer_Stats fstats;
+		if (m_onboard && fluksometer_getStats(&fstats) && fstats.numLines > 0) {
+			LOG(2, "avg parse: %.3f us per line, %.1f lines per read, max burst: %u lines\n",
+				fstats.totalCpuTime / fstats.numLines,
+				(double)fstats.numLines / fstats.numReads, fstats.maxBurst);
+		}
 	}
 
 	// Check if done	
 	if (m_count > 0 && m_numMeasurements >= m_count) {
-		if (!m_onboard) {
+		if (m_listen || m_sniff) {
+			m_receiving = 0;
+		} else if (m_gateway) {
+			gateway_stop();
+		} else if (m_modbus) {
+			modbus_stop();
+		} else if (!m_onboard) {
 			smartmeter_stop();
 		} else {
 			fluksometer_stop();
@@ -0,0 +1,868 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : smsim
+  Used by   :
+  Purpose   : Program to simulate Smart Meters speaking SML over TCP, e.g. to
+              benchmark and test smlogger without access to real devices.
+              Virtual meter i answers at the local address 'base + i', so
+              thousands of meters can be served by one process on the
+              loopback network (127.0.0.0/8) or on interface aliases.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <sml/sml_transport.h>
+#include <sml/sml_crc16.h>
+
+#include "pylon/io.h"
+#include "pylon/smartmeter.h"
+#include "pylon/timer.h"
+#include "pylon/args.h"
+#include "pylon/common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Multicast group of the BRE announcements waited for by the Smart Meter module
+#define BRE_GROUP "232.0.100.0"
+
+// Maximum size of requests and responses
+#define MAX_REQUEST_SIZE  4096
+#define MAX_RESPONSE_SIZE 4096
+
+// Maximum time in milliseconds to wait for sockets without pending work
+#define IDLE_TIMEOUT 1000
+
+// Units and scaler of the generated values (DLMS unit codes)
+#define UNIT_DEGREE 8
+#define UNIT_WATT   27
+#define UNIT_AMPERE 33
+#define UNIT_VOLT   35
+#define SCALER      -2
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// State of a virtual Smart Meter
+typedef struct VirtualMeter_s {
+	struct in_addr addr;   // Local address the meter answers at
+	double phase;          // Phase offset of the simulated load
+	int frame;             // Index of the next recorded frame to replay
+} VirtualMeter;
+
+// States of a client connection
+typedef enum {
+	CONNECTION_RECEIVING,  // Waiting for a request
+	CONNECTION_WAITING,    // Delaying the response
+	CONNECTION_SENDING     // Response partially sent
+} ConnectionState;
+
+// Context of a client connection
+typedef struct Connection_s {
+	struct Connection_s* prev;       // Previous connection in the list
+	struct Connection_s* next;       // Next connection in the list
+	int sfd;                         // Socket of the connection
+	VirtualMeter* meter;             // Virtual meter addressed by the client
+	ConnectionState state;           // State of the connection
+	int timer;                       // Timer to send the delayed response, 0 if none
+	size_t received;                 // Number of bytes in the request buffer
+	unsigned char request[MAX_REQUEST_SIZE];
+	const unsigned char* response;   // Response to send
+	size_t length;                   // Length of the response
+	size_t sent;                     // Number of bytes sent so far
+	int list;                        // Flag if the values were requested as list
+	unsigned char generated[MAX_RESPONSE_SIZE];
+} Connection;
+
+// A recorded SML transport frame
+typedef struct Frame_s {
+	unsigned char* data;
+	size_t length;
+} Frame;
+
+// Statistics about the simulation
+typedef struct Stats_s {
+	unsigned long connections;
+	unsigned long rejected;
+	unsigned long requests;
+	unsigned long responses;
+	unsigned long dropped;
+	unsigned long resets;
+	unsigned long announcements;
+} Stats;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Supported program arguments
+static Argument args[] = {
+	{"meters",   "-n", "1",          ARG_INT    | OPTIONAL, "Number of virtual Smart Meters"},
+	{"base",     "-a", "127.0.1.1",  ARG_STRING | OPTIONAL, "Local address of the first meter, the others follow consecutively"},
+	{"port",     "-p", "7259",       ARG_INT    | OPTIONAL, "Port to listen at"},
+	{"replay",   "-r", NULL,         ARG_STRING | OPTIONAL, "File with recorded SML transport frames to reply with in turn"},
+	{"latency",  "-l", "0",          ARG_INT    | OPTIONAL, "Delay of the responses in milliseconds"},
+	{"jitter",   "-j", "0",          ARG_INT    | OPTIONAL, "Maximum random delay in milliseconds added to the latency"},
+	{"drops",    "-d", "0",          ARG_FLOAT  | OPTIONAL, "Probability of leaving a request unanswered"},
+	{"resets",   "-x", "0",          ARG_FLOAT  | OPTIONAL, "Probability of resetting the connection upon a request"},
+	{"announce", "-m", "5000",       ARG_INT    | OPTIONAL, "Interval between BRE multicasts in milliseconds, 0 to disable"},
+	{"seed",     "-s", "1",          ARG_INT    | OPTIONAL, "Seed of the random faults"},
+	{"help",     "-h", NULL,         ARG_FLAG   | OPTIONAL, "Display program usage and help"},
+	{"verbose",  "-v", "1",          ARG_INT    | OPTIONAL, "Verbose level"},
+	{0} // End of list
+};
+
+// The virtual Smart Meters
+static VirtualMeter* m_meters;
+static int m_numMeters;
+static uint32_t m_baseAddr;
+
+// Open client connections
+static Connection* m_connections;
+
+// Recorded frames to replay
+static Frame* m_frames;
+static int m_numFrames;
+
+// Sockets to accept connections and to send announcements
+static int m_listener = INVALID_SOCKET;
+static int m_announcer = INVALID_SOCKET;
+
+// Variables to hold program arguments
+static int m_latency;
+static int m_jitter;
+static double m_drops;
+static double m_resets;
+static int m_announce;
+
+// Flag to terminate the simulation
+static volatile sig_atomic_t m_running = 1;
+
+// Statistics about the simulation
+static Stats m_stats;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Signal handler to terminate the simulation
+static void handleSignal(int sig);
+
+// Loads the recorded frames from the specified file
+static int loadFrames(const char* path);
+
+// Accepts pending connections at the listening socket
+static void handleAccept(int sfd, int events, void* arg);
+
+// Handles events of a client connection
+static void handleConnection(int sfd, int events, void* arg);
+
+// Processes a complete request received over the specified connection
+static void handleRequest(Connection* c, size_t length);
+
+// Sends (the rest of) the response over the specified connection
+static void sendResponse(Connection* c);
+
+// Closes the specified connection, optionally with a TCP reset
+static void closeConnection(Connection* c, int reset);
+
+// Sends the delayed response over the connection passed as argument
+static void handleResponseTimer(int id, void* arg);
+
+// Sends a BRE multicast on behalf of every virtual meter
+static void announceMeters(int id, void* arg);
+
+// Computes the current values of the specified virtual meter
+static void simulateValues(const VirtualMeter* vm, double t, double val[NUM_VARIABLES]);
+
+// Creates an SML response holding the current values of the specified
+// virtual meter as parameter tree or as list, framed for transport.
+// Returns the length of the frame.
+static size_t createResponse(const VirtualMeter* vm, int list,
+	unsigned char* buffer, size_t size);
+
+// Creates the subtree holding the specified value
+static sml_tree* createEntry(SmartMeter_VarID id, double value, u8 unit);
+
+// Creates the list entry holding the specified value
+static sml_list* createListEntry(SmartMeter_VarID id, double value, u8 unit);
+
+// Returns the unit of the specified variable
+static u8 getUnit(SmartMeter_VarID id);
+
+// Returns a random number in [0, 1)
+static double randomUniform(void);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+	// Input program arguments
+	if (!args_parse(args, argc, argv) || args_value(args, "help")) {
+		args_printUsage(args, argv[0]);
+		args_printInfo(args);
+		return 0;
+	}
+
+	// Set log level
+	log_level = atoi(args_value(args, "verbose"));
+
+	// Initialize static variables
+	m_numMeters = atoi(args_value(args, "meters"));
+	m_latency   = atoi(args_value(args, "latency"));
+	m_jitter    = atoi(args_value(args, "jitter"));
+	m_drops     = atof(args_value(args, "drops"));
+	m_resets    = atof(args_value(args, "resets"));
+	m_announce  = atoi(args_value(args, "announce"));
+	srandom(atoi(args_value(args, "seed")));
+
+	struct in_addr base;
+	if (m_numMeters <= 0 || !inet_aton(args_value(args, "base"), &base)) {
+		printf("Invalid number of meters or base address\n");
+		return 1;
+	}
+	m_baseAddr = ntohl(base.s_addr);
+
+	// Create the virtual meters
+	m_meters = calloc(m_numMeters, sizeof(VirtualMeter));
+	if (!m_meters) {
+		printf("Failed to allocate %d meters\n", m_numMeters);
+		return 1;
+	}
+	for (int i = 0; i < m_numMeters; i++) {
+		m_meters[i].addr.s_addr = htonl(m_baseAddr + i);
+		m_meters[i].phase = 2 * M_PI * randomUniform();
+	}
+
+	// Load recorded responses if specified
+	if (args_value(args, "replay") && !loadFrames(args_value(args, "replay"))) {
+		printf("Failed to load recorded frames\n");
+		return 1;
+	}
+
+	// Initialize I/O subsystem
+	io_init();
+
+	// Wait for connections
+	m_listener = io_createServerSocket(atoi(args_value(args, "port")));
+	if (m_listener == INVALID_SOCKET ||
+		!io_multiplex(m_listener, "listener", IO_READ, handleAccept, NULL))
+	{
+		printf("Failed to listen at port %s\n", args_value(args, "port"));
+		return 1;
+	}
+
+	// Announce the meters like the real ones do
+	if (m_announce > 0) {
+		m_announcer = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		int on = 1;
+		if (m_announcer == INVALID_SOCKET ||
+			setsockopt(m_announcer, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on)) == -1 ||
+			!io_addTimer(0, m_announce, announceMeters, NULL))
+		{
+			LOG(0, "Failed to create multicast socket: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	signal(SIGINT, handleSignal);
+	signal(SIGTERM, handleSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	LOG(1, "Simulating %d meters at %s and following, port %s\n",
+		m_numMeters, args_value(args, "base"), args_value(args, "port"));
+
+	// Run the simulation, the responses and announcements are due on timers
+	while (m_running) {
+		io_processTimeout(IDLE_TIMEOUT);
+	}
+
+	// Print statistics
+	LOG(1, "connections: %lu (rejected: %lu), requests: %lu, responses: %lu, "
+		"dropped: %lu, resets: %lu, announcements: %lu\n",
+		m_stats.connections, m_stats.rejected, m_stats.requests, m_stats.responses,
+		m_stats.dropped, m_stats.resets, m_stats.announcements);
+
+	// Cleanup
+	while (m_connections) {
+		closeConnection(m_connections, 0);
+	}
+	io_closeSocket(&m_listener);
+	io_closeSocket(&m_announcer);
+	io_deinit();
+	for (int i = 0; i < m_numFrames; i++) {
+		free(m_frames[i].data);
+	}
+	free(m_frames);
+	free(m_meters);
+
+	return 0;
+}
+
+void handleSignal(int sig)
+{
+	m_running = 0;
+}
+
+int loadFrames(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		LOG(0, "Failed to open '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	// Read the whole recording
+	unsigned char* data = NULL;
+	size_t size = 0, capacity = 0;
+	while (!feof(file)) {
+		if (size == capacity) {
+			capacity = capacity ? 2 * capacity : MAX_RESPONSE_SIZE;
+			unsigned char* tmp = realloc(data, capacity);
+			if (!tmp) {
+				LOG(0, "Failed to allocate memory\n");
+				free(data);
+				fclose(file);
+				return 0;
+			}
+			data = tmp;
+		}
+		size += fread(data + size, 1, capacity - size, file);
+		if (ferror(file)) {
+			LOG(0, "Failed to read '%s'\n", path);
+			free(data);
+			fclose(file);
+			return 0;
+		}
+	}
+	fclose(file);
+
+	// Split the recording into frames
+	size_t pos = 0, length = 0;
+	while (pos < size && smartmeter_findFrame(data + pos, size - pos, &length) > 0) {
+		Frame* frames = realloc(m_frames, (m_numFrames + 1) * sizeof(Frame));
+		unsigned char* frame = malloc(length);
+		if (!frames || !frame) {
+			LOG(0, "Failed to allocate memory\n");
+			free(frames ? frames : m_frames);
+			free(frame);
+			free(data);
+			m_frames = NULL;
+			m_numFrames = 0;
+			return 0;
+		}
+		memcpy(frame, data + pos, length);
+		m_frames = frames;
+		m_frames[m_numFrames].data = frame;
+		m_frames[m_numFrames].length = length;
+		m_numFrames++;
+		pos += length;
+	}
+	free(data);
+
+	if (pos < size) {
+		LOG(1, "Ignoring %d bytes not forming a frame in '%s'\n", (int)(size - pos), path);
+	}
+	if (m_numFrames == 0) {
+		LOG(0, "No frames found in '%s'\n", path);
+		return 0;
+	}
+
+	LOG(2, "Loaded %d frames\n", m_numFrames);
+	return 1; // Success
+}
+
+void handleAccept(int sfd, int events, void* arg)
+{
+	// Accept all pending connections
+	while (1) {
+		int cfd = accept4(sfd, NULL, NULL, SOCK_NONBLOCK);
+		if (cfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				LOG(1, "Failed to accept connection: %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		// Determine the virtual meter by the address the client connected to
+		struct sockaddr_in sa = {0};
+		socklen_t len = sizeof(sa);
+		long index = -1;
+		if (getsockname(cfd, (struct sockaddr*) &sa, &len) == 0) {
+			index = (long)ntohl(sa.sin_addr.s_addr) - (long)m_baseAddr;
+		}
+		if (index < 0 || index >= m_numMeters) {
+			LOG(2, "Rejecting connection to %s\n", inet_ntoa(sa.sin_addr));
+			m_stats.rejected++;
+			close(cfd);
+			continue;
+		}
+
+		// Create context
+		Connection* c = malloc(sizeof(Connection));
+		if (!c) {
+			LOG(0, "Failed to allocate connection\n");
+			close(cfd);
+			continue;
+		}
+		c->sfd      = cfd;
+		c->meter    = &m_meters[index];
+		c->state    = CONNECTION_RECEIVING;
+		c->received = 0;
+		c->timer    = 0;
+		c->prev     = NULL;
+		c->next     = m_connections;
+		if (m_connections) {
+			m_connections->prev = c;
+		}
+		m_connections = c;
+		m_stats.connections++;
+
+		if (!io_multiplex(cfd, "client", IO_READ, handleConnection, c)) {
+			closeConnection(c, 0);
+		}
+	}
+}
+
+void handleConnection(int sfd, int events, void* arg)
+{
+	Connection* c = (Connection*)arg;
+
+	// Continue sending the response
+	if (c->state == CONNECTION_SENDING) {
+		if (events & IO_WRITE) {
+			sendResponse(c);
+		}
+		return;
+	}
+	if (!(events & IO_READ)) {
+		return;
+	}
+
+	// Receive available data
+	if (c->received == sizeof(c->request)) {
+		LOG(1, "Request exceeds %d bytes\n", MAX_REQUEST_SIZE);
+		closeConnection(c, 0);
+		return;
+	}
+	ssize_t size = recv(sfd, c->request + c->received, sizeof(c->request) - c->received, 0);
+	if (size == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			closeConnection(c, 0);
+		}
+		return;
+	}
+	if (size == 0) {
+		closeConnection(c, 0);
+		return;
+	}
+	c->received += size;
+
+	// Ignore further requests while one is pending
+	if (c->state != CONNECTION_RECEIVING) {
+		c->received = 0;
+		return;
+	}
+
+	// Wait until the request is complete
+	size_t length = 0;
+	int ret = smartmeter_findFrame(c->request, c->received, &length);
+	if (ret < 0) {
+		LOG(1, "Invalid request\n");
+		closeConnection(c, 0);
+	} else if (ret > 0) {
+		handleRequest(c, length);
+	}
+}
+
+void handleRequest(Connection* c, size_t length)
+{
+	c->received = 0;
+
+	// Check for a request of the values
+	int supported = 0;
+	c->list = 0;
+	sml_file* file = length >= 16 ? sml_file_parse(c->request + 8, length - 16) : NULL;
+	if (file) {
+		for (int i = 0; i < file->messages_len; i++) {
+			sml_message_body* body = file->messages[i] ? file->messages[i]->message_body : NULL;
+			u32 tag = body && body->tag ? *body->tag : 0;
+			if (tag == SML_MESSAGE_GET_PROC_PARAMETER_REQUEST) {
+				supported = 1;
+			} else if (tag == SML_MESSAGE_GET_LIST_REQUEST) {
+				supported = 1;
+				c->list = 1;
+			}
+		}
+		sml_file_free(file);
+	}
+	if (!supported) {
+		LOG(1, "Unsupported request\n");
+		closeConnection(c, 0);
+		return;
+	}
+	m_stats.requests++;
+
+	// Inject faults
+	if (m_resets > 0 && randomUniform() < m_resets) {
+		m_stats.resets++;
+		closeConnection(c, 1);
+		return;
+	}
+	if (m_drops > 0 && randomUniform() < m_drops) {
+		m_stats.dropped++;
+		return;
+	}
+
+	// Prepare the response
+	VirtualMeter* vm = c->meter;
+	if (m_numFrames > 0) {
+		c->response = m_frames[vm->frame].data;
+		c->length   = m_frames[vm->frame].length;
+		vm->frame   = (vm->frame + 1) % m_numFrames;
+	} else {
+		c->response = c->generated;
+		c->length   = createResponse(vm, c->list, c->generated, sizeof(c->generated));
+		if (!c->length) {
+			closeConnection(c, 0);
+			return;
+		}
+	}
+	c->sent = 0;
+
+	// Delay the response
+	int delay = m_latency;
+	if (m_jitter > 0) {
+		delay += (int)(randomUniform() * m_jitter);
+	}
+	c->state = CONNECTION_WAITING;
+	if (delay <= 0) {
+		sendResponse(c);
+		return;
+	}
+	c->timer = io_addTimer(delay, 0, handleResponseTimer, c);
+	if (!c->timer) {
+		closeConnection(c, 0);
+	}
+}
+
+void sendResponse(Connection* c)
+{
+	ssize_t size = send(c->sfd, c->response + c->sent, c->length - c->sent, MSG_NOSIGNAL);
+	if (size == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			closeConnection(c, 0);
+		}
+		return;
+	}
+	c->sent += size;
+
+	// Wait until the socket accepts more data
+	if (c->sent < c->length) {
+		if (c->state != CONNECTION_SENDING) {
+			c->state = CONNECTION_SENDING;
+			io_multiplex(c->sfd, "client", IO_WRITE, handleConnection, c);
+		}
+		return;
+	}
+
+	// The real meters drop the connection after every response
+	m_stats.responses++;
+	closeConnection(c, 0);
+}
+
+void closeConnection(Connection* c, int reset)
+{
+	// Abort the connection instead of closing it gracefully
+	if (reset) {
+		struct linger lg = {1, 0};
+		setsockopt(c->sfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+
+	if (c->timer) {
+		io_cancelTimer(c->timer);
+	}
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		m_connections = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	io_closeSocket(&c->sfd);
+	free(c);
+}
+
+void handleResponseTimer(int id, void* arg)
+{
+	Connection* c = (Connection*)arg;
+	c->timer = 0;
+	sendResponse(c);
+}
+
+void announceMeters(int id, void* arg)
+{
+	struct sockaddr_in sa = {0};
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(atoi(args_value(args, "port")));
+	sa.sin_addr.s_addr = inet_addr(BRE_GROUP);
+
+	// Only the source address matters to the receivers
+	unsigned char payload[4] = {0};
+	struct iovec iov = {payload, sizeof(payload)};
+
+	for (int i = 0; i < m_numMeters; i++) {
+
+		// Send on behalf of the virtual meter
+		union {
+			struct cmsghdr hdr;
+			unsigned char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+		} control = {{0}};
+		struct msghdr msg = {0};
+		msg.msg_name       = &sa;
+		msg.msg_namelen    = sizeof(sa);
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type  = IP_PKTINFO;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(struct in_pktinfo));
+		struct in_pktinfo* info = (struct in_pktinfo*) CMSG_DATA(cmsg);
+		info->ipi_spec_dst = m_meters[i].addr;
+
+		if (sendmsg(m_announcer, &msg, 0) == -1) {
+			LOG(1, "Failed to announce %s: %s\n", inet_ntoa(m_meters[i].addr), strerror(errno));
+			return;
+		}
+		m_stats.announcements++;
+	}
+}
+
+void simulateValues(const VirtualMeter* vm, double t, double val[NUM_VARIABLES])
+{
+	// Slowly varying load around 1 kW, distributed unevenly over the phases
+	static const double share[3] = {0.5, 0.3, 0.2};
+	double load = 1000 + 600 * sin(2 * M_PI * t / 600 + vm->phase);
+	double angle = 18; // cos(phi) of about 0.95
+
+	double re = 0, im = 0;
+	for (int i = 0; i < 3; i++) {
+		double voltage = 230 + 2 * sin(2 * M_PI * t / 60 + vm->phase + i);
+		double power   = load * share[i];
+		double current = power / (voltage * cos(angle * M_PI / 180));
+
+		val[POWER_L1 + i]   = power;
+		val[VOLTAGE_L1 + i] = voltage;
+		val[CURRENT_L1 + i] = current;
+		val[PHASE_ANGLE_CURRENT_VOLTAGE_L1 + i] = angle;
+
+		// The neutral carries the sum of the phase currents
+		re += current * cos(2 * M_PI * i / 3);
+		im += current * sin(2 * M_PI * i / 3);
+	}
+	val[POWER_ALL_PHASES] = load;
+	val[CURRENT_NEUTRAL]  = sqrt(re * re + im * im);
+	val[PHASE_ANGLE_VOLTAGE_L2_L1] = 120;
+	val[PHASE_ANGLE_VOLTAGE_L3_L1] = 240;
+}
+
+size_t createResponse(const VirtualMeter* vm, int list,
+	unsigned char* buffer, size_t size)
+{
+	static const unsigned char escape[] = {0x1b, 0x1b, 0x1b, 0x1b};
+	static const unsigned char begin[]  = {0x01, 0x01, 0x01, 0x01};
+
+	// Compute the values
+	double val[NUM_VARIABLES] = {0};
+	simulateValues(vm, timer_now() / 1000.0, val);
+
+	// Create SML file
+	sml_file* sml = sml_file_init();
+	sml_message* msg = NULL;
+
+	// Open response
+	msg = sml_message_init();
+	msg->group_id = sml_u8_init(1);
+	msg->abort_on_error = sml_u8_init(0);
+	sml_open_response* openRes = sml_open_response_init();
+	openRes->client_id   = sml_octet_string_init_from_hex("010203040506");
+	openRes->req_file_id = sml_octet_string_init_from_hex("51");
+	openRes->server_id   = sml_octet_string_init((unsigned char*) &vm->addr, sizeof(vm->addr));
+	msg->message_body = sml_message_body_init(SML_MESSAGE_OPEN_RESPONSE, openRes);
+	sml_file_add_message(sml, msg);
+
+	msg = sml_message_init();
+	msg->group_id = sml_u8_init(2);
+	msg->abort_on_error = sml_u8_init(0);
+	if (list) {
+		// List response holding one entry per variable
+		sml_list* head = NULL;
+		sml_list** tail = &head;
+		for (SmartMeter_VarID id = POWER_ALL_PHASES; id < NUM_VARIABLES; id++) {
+			*tail = createListEntry(id, val[id], getUnit(id));
+			tail = &(*tail)->next;
+		}
+
+		sml_get_list_response* listRes = sml_get_list_response_init();
+		listRes->server_id = sml_octet_string_init((unsigned char*) &vm->addr, sizeof(vm->addr));
+		listRes->val_list  = head;
+		msg->message_body = sml_message_body_init(SML_MESSAGE_GET_LIST_RESPONSE, listRes);
+	} else {
+		// Process parameter response holding one entry per variable
+		sml_tree* tree = sml_tree_init();
+		tree->parameter_name = sml_octet_string_init_from_hex("8181C78501FF");
+		for (SmartMeter_VarID id = POWER_ALL_PHASES; id < NUM_VARIABLES; id++) {
+			sml_tree_add_tree(tree, createEntry(id, val[id], getUnit(id)));
+		}
+
+		sml_get_proc_parameter_response* procParamRes = sml_get_proc_parameter_response_init();
+		procParamRes->server_id = sml_octet_string_init((unsigned char*) &vm->addr, sizeof(vm->addr));
+		procParamRes->parameter_tree_path = sml_tree_path_init();
+		sml_tree_path_add_path_entry(procParamRes->parameter_tree_path,
+			sml_octet_string_init_from_hex("8181C78501FF"));
+		procParamRes->parameter_tree = tree;
+		msg->message_body = sml_message_body_init(SML_MESSAGE_GET_PROC_PARAMETER_RESPONSE, procParamRes);
+	}
+	sml_file_add_message(sml, msg);
+
+	// Close response
+	msg = sml_message_init();
+	msg->group_id = sml_u8_init(3);
+	msg->abort_on_error = sml_u8_init(0);
+	sml_close_response* closeRes = sml_close_response_init();
+	msg->message_body = sml_message_body_init(SML_MESSAGE_CLOSE_RESPONSE, closeRes);
+	sml_file_add_message(sml, msg);
+
+	// Encode the file like sml_transport_write() does, but into our buffer
+	sml_buffer_free(sml->buf);
+	sml->buf = sml_buffer_init(size);
+	sml_buffer* buf = sml->buf;
+	memcpy(buf->buffer, escape, 4);
+	memcpy(buf->buffer + 4, begin, 4);
+	buf->cursor = 8;
+	sml_file_write(sml);
+
+	size_t length = 0;
+	int padding = buf->cursor % 4 ? 4 - buf->cursor % 4 : 0;
+	if (buf->cursor + padding + 8 <= size) {
+		memset(buf->buffer + buf->cursor, 0, padding);
+		buf->cursor += padding;
+		memcpy(buf->buffer + buf->cursor, escape, 4);
+		buf->cursor += 4;
+		buf->buffer[buf->cursor++] = 0x1a;
+		buf->buffer[buf->cursor++] = padding;
+		u16 crc = sml_crc16_calculate(buf->buffer, buf->cursor);
+		buf->buffer[buf->cursor++] = (crc & 0xff00) >> 8;
+		buf->buffer[buf->cursor++] = crc & 0x00ff;
+
+		length = buf->cursor;
+		memcpy(buffer, buf->buffer, length);
+	} else {
+		LOG(0, "Response exceeds %d bytes\n", (int)size);
+	}
+
+	// Cleanup
+	sml_file_free(sml);
+
+	return length;
+}
+
+sml_tree* createEntry(SmartMeter_VarID id, double value, u8 unit)
+{
+	octet_string* obis = sml_octet_string_init((unsigned char*) smartmeter_getObis(id), 6);
+
+	sml_period_entry* entry = sml_period_entry_init();
+	entry->obj_name = obis;
+	entry->unit     = sml_u8_init(unit);
+	entry->scaler   = sml_i8_init(SCALER);
+	entry->value    = sml_value_init();
+	entry->value->type = SML_TYPE_INTEGER | SML_TYPE_NUMBER_32;
+	entry->value->data.int32 = sml_i32_init((i32) lround(value * pow(10, -SCALER)));
+
+	sml_proc_par_value* ppv = sml_proc_par_value_init();
+	ppv->tag = sml_u8_init(SML_PROC_PAR_VALUE_TAG_PERIOD_ENTRY);
+	ppv->data.period_entry = entry;
+
+	sml_tree* tree = sml_tree_init();
+	tree->parameter_name  = sml_octet_string_init(obis->str, obis->len);
+	tree->parameter_value = ppv;
+	return tree;
+}
+
+sml_list* createListEntry(SmartMeter_VarID id, double value, u8 unit)
+{
+	sml_list* entry = sml_list_init();
+	entry->obj_name = sml_octet_string_init((unsigned char*) smartmeter_getObis(id), 6);
+	entry->unit     = sml_u8_init(unit);
+	entry->scaler   = sml_i8_init(SCALER);
+	entry->value    = sml_value_init();
+	entry->value->type = SML_TYPE_INTEGER | SML_TYPE_NUMBER_32;
+	entry->value->data.int32 = sml_i32_init((i32) lround(value * pow(10, -SCALER)));
+	return entry;
+}
+
+u8 getUnit(SmartMeter_VarID id)
+{
+	return id <= POWER_L3 ? UNIT_WATT : id <= CURRENT_L3 ? UNIT_AMPERE :
+		id <= VOLTAGE_L3 ? UNIT_VOLT : UNIT_DEGREE;
+}
+
+double randomUniform(void)
+{
+	return random() / ((double)RAND_MAX + 1);
+}
@@ -0,0 +1,269 @@
+/*******************************************************************************
+* Copyright (c) 2012, Institute for Pervasive Computing, ETH Zurich.
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions
+* are met:
+* 1. Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+* 2. Redistributions in binary form must reproduce the above copyright
+* notice, this list of conditions and the following disclaimer in the
+* documentation and/or other materials provided with the distribution.
+* 3. Neither the name of the Institute nor the names of its contributors
+* may be used to endorse or promote products derived from this software
+* without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+* ARE DISCLAIMED. IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+* OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+* HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+* OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+* SUCH DAMAGE.
+*
+* This file is part of the Pylon Smart Metering framework.
+*******************************************************************************/
+
+/******************************************************************************\
+  Project   : Pylon
+  Module    : udpbench
+  Used by   :
+  Purpose   : Program to compare receiving datagrams one at a time with
+              receiving them in batches (io_recvBatch) by the number of
+              system calls and the time per datagram, for bursts of
+              datagrams as pushed by many Smart Meters between wakeups.
+
+  Version   : 1.0
+  Date      : 18.10.2026
+  Author    : Pylon contributors
+\******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "pylon/io.h"
+#include "pylon/timer.h"
+#include "pylon/args.h"
+#include "pylon/common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSTANTS
+////////////////////////////////////////////////////////////////////////////////
+
+// Number of datagrams sent between wakeups of the receiver
+static const int BURSTS[] = {1, 4, 16, 64};
+#define NUM_BURSTS (sizeof(BURSTS) / sizeof(BURSTS[0]))
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TYPES
+////////////////////////////////////////////////////////////////////////////////
+
+// Struct to hold the results of a run
+typedef struct Result_s {
+	unsigned int numDatagrams;   // Datagrams received
+	unsigned int numCalls;       // System calls to receive them
+	uint64_t totalTime;          // Time in microseconds spent receiving
+} Result;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// STATIC VARIABLES
+////////////////////////////////////////////////////////////////////////////////
+
+// Supported program arguments
+static Argument args[] = {
+	{"count",    "-c", "100000", ARG_INT    | OPTIONAL, "Number of datagrams per run"},
+	{"size",     "-s", "200",    ARG_INT    | OPTIONAL, "Size of the datagrams in bytes"},
+	{"help",     "-h", NULL,     ARG_FLAG   | OPTIONAL, "Display program usage and help"},
+	{"verbose",  "-v", "1",      ARG_INT    | OPTIONAL, "Verbose level"},
+	{0} // End of list
+};
+
+// Sockets sending and receiving the datagrams over the loopback interface
+static int m_sender = INVALID_SOCKET;
+static int m_receiver = INVALID_SOCKET;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// HELPER FUNCTIONS
+////////////////////////////////////////////////////////////////////////////////
+
+// Creates the pair of sockets connected over the loopback interface
+static int createSockets(void);
+
+// Sends 'count' datagrams in bursts and drains the receiver after every burst
+// either one datagram at a time or in batches
+static int benchmark(int count, size_t size, int burst, int batched, Result* result);
+
+// Receives the pending datagrams and returns the number received
+static int receiveSingle(unsigned char* buffer, size_t size, Result* result);
+static int receiveBatched(IO_Batch* batch, Result* result);
+
+
+////////////////////////////////////////////////////////////////////////////////
+// IMPLEMENTATION
+////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+	// Input program arguments
+	if (!args_parse(args, argc, argv) || args_value(args, "help")) {
+		args_printUsage(args, argv[0]);
+		args_printInfo(args);
+		return 0;
+	}
+
+	// Set log level
+	log_level = atoi(args_value(args, "verbose"));
+
+	int count = atoi(args_value(args, "count"));
+	int size  = atoi(args_value(args, "size"));
+	if (count <= 0 || size <= 0 || size > MTU) {
+		printf("Invalid number or size of datagrams\n");
+		return 1;
+	}
+
+	if (!createSockets()) {
+		return 1;
+	}
+
+	printf("%-9s %6s %10s %10s %14s %12s\n", "method", "burst", "datagrams",
+		"syscalls", "syscalls/dgram", "us/dgram");
+	int success = 1;
+	for (unsigned int i = 0; i < NUM_BURSTS && success; i++) {
+		for (int batched = 0; batched <= 1 && success; batched++) {
+			Result result = {0};
+			success = benchmark(count, size, BURSTS[i], batched, &result);
+			if (success) {
+				printf("%-9s %6d %10u %10u %14.3f %12.3f\n",
+					batched ? "recvmmsg" : "recvmsg", BURSTS[i],
+					result.numDatagrams, result.numCalls,
+					(double)result.numCalls / result.numDatagrams,
+					(double)result.totalTime / result.numDatagrams);
+			}
+		}
+	}
+
+	io_closeSocket(&m_sender);
+	io_closeSocket(&m_receiver);
+
+	return success ? 0 : 1;
+}
+
+int createSockets(void)
+{
+	m_receiver = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	m_sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (m_receiver == INVALID_SOCKET || m_sender == INVALID_SOCKET) {
+		LOG(0, "Failed to create sockets: %s\n", strerror(errno));
+		return 0;
+	}
+
+	// Bind the receiver to any free port on the loopback interface
+	struct sockaddr_in sa = {0};
+	socklen_t len = sizeof(sa);
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = 0;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(m_receiver, (struct sockaddr*) &sa, sizeof(sa)) == -1 ||
+		getsockname(m_receiver, (struct sockaddr*) &sa, &len) == -1 ||
+		connect(m_sender, (struct sockaddr*) &sa, sizeof(sa)) == -1)
+	{
+		LOG(0, "Failed to connect sockets: %s\n", strerror(errno));
+		return 0;
+	}
+
+	// Receive the timestamps like the receiver module
+	io_enableTimestamps(m_receiver);
+	return 1; // Success
+}
+
+int benchmark(int count, size_t size, int burst, int batched, Result* result)
+{
+	unsigned char* buffer = calloc(1, MTU);
+	IO_Batch* batch = io_createBatch(IO_BATCH_SIZE, MTU);
+	if (!buffer || !batch) {
+		LOG(0, "Failed to allocate buffers\n");
+		free(buffer);
+		io_freeBatch(batch);
+		return 0;
+	}
+
+	int success = 1;
+	for (int sent = 0; sent < count && success; ) {
+
+		// Send a burst, the datagrams are queued at the receiver right away
+		int num = count - sent < burst ? count - sent : burst;
+		for (int i = 0; i < num; i++) {
+			if (send(m_sender, buffer, size, 0) != (ssize_t)size) {
+				LOG(0, "Failed to send datagram: %s\n", strerror(errno));
+				success = 0;
+				break;
+			}
+		}
+		sent += num;
+
+		// Drain the receiver like the io module upon a wakeup
+		uint64_t start = timer_nowUs();
+		int received = batched ? receiveBatched(batch, result) :
+			receiveSingle(buffer, MTU, result);
+		result->totalTime += timer_nowUs() - start;
+		if (received != num) {
+			LOG(0, "Received %d of %d datagrams\n", received, num);
+			success = 0;
+		}
+	}
+
+	free(buffer);
+	io_freeBatch(batch);
+	return success;
+}
+
+int receiveSingle(unsigned char* buffer, size_t size, Result* result)
+{
+	// Receive until the socket would block, like the handlers of
+	// io_multiplexRead()
+	struct sockaddr_in sa;
+	uint64_t time;
+	int received = 0;
+	ssize_t ret;
+	do {
+		ret = io_recvFromTimestamp(m_receiver, buffer, size, 0, &sa, &time);
+		result->numCalls++;
+		if (ret >= 0) {
+			received++;
+		}
+	} while (ret >= 0);
+
+	result->numDatagrams += received;
+	return received;
+}
+
+int receiveBatched(IO_Batch* batch, Result* result)
+{
+	// Receive until a batch is partial, like io_multiplexBatch()
+	const IO_Datagram* datagrams;
+	int received = 0;
+	int count;
+	do {
+		count = io_recvBatch(m_receiver, batch, &datagrams);
+		result->numCalls++;
+		if (count > 0) {
+			received += count;
+		}
+	} while (count == IO_BATCH_SIZE);
+
+	result->numDatagrams += received;
+	return received;
+}